@@ -36,6 +36,7 @@
 
 #ifdef __linux__
 #define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE /* For copy_file_range(). */
 #endif
 
 #include "kilo.h"
@@ -56,10 +57,13 @@ struct editorConfig E;
  *
  * Finally add a stanza in the HLDB global variable with two two arrays
  * of strings, and a set of flags in order to enable highlighting of
- * comments and numbers.
+ * strings and numbers.
  *
- * The characters for single and multi line comments must be exactly two
- * and must be provided as well (see the C language example).
+ * The delimiters of single and multi line comments are up to three chars,
+ * and the string delimiters single chars (see the C language example).
+ *
+ * Syntaxes can also be loaded from files, without rebuilding kilo, see
+ * "Loadable syntax definitions" below.
  *
  * There is no support to highlight patterns currently. */
 
@@ -88,7 +92,8 @@ char *C_HL_keywords[] = {
  * comments delimiters and flags. */
 struct editorSyntax HLDB[] = {{/* C / C++ */
                                C_HL_extensions, C_HL_keywords, "//", "/*", "*/",
-                               HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS}};
+                               HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS,
+                               "\"'", "C", NULL, NULL}};
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
@@ -150,8 +155,16 @@ fatal:
 int editorReadKey(int fd) {
   int nread;
   char c, seq[3];
-  while ((nread = read(fd, &c, 1)) == 0)
-    ;
+  while ((nread = read(fd, &c, 1)) == 0) {
+    /* Nothing typed for a while: report on background work, and make
+     * sure the last edits are in the journal. */
+    int refresh = editorSavePoll(0);
+    refresh |= editorHighlightPoll(0);
+    refresh |= editorSearchPoll(0);
+    if (refresh)
+      editorRefreshScreen();
+    editorJournalFlush(1);
+  }
   if (nread == -1)
     exit(1);
 
@@ -166,6 +179,10 @@ int editorReadKey(int fd) {
       if (seq[0] == 'u') {
         return UNDO_KEY;
       }
+      if (seq[0] == 'n')
+        return NEXT_WORD_KEY;
+      if (seq[0] == 'p')
+        return PREV_WORD_KEY;
 
       /* For multi-character sequences, read second character */
       if (read(fd, seq + 1, 1) == 0)
@@ -303,169 +320,572 @@ int is_separator(int c) {
   return c == '\0' || isspace(c) || strchr(",.()+-/*=~%[];", c) != NULL;
 }
 
+/* The lexer skips the runs of bytes that need no decision (the rest of a
+ * word, of a string, of a comment) in bulk, comparing 32 (AVX2) or 16 (SSE2)
+ * bytes at a time. */
+
+/* Return the first byte of [p, end) that is not in [A-Za-z0-9_], or end. */
+const char *lexSkipWord(const char *p, const char *end) {
+#if defined(__AVX2__)
+  const __m256i a = _mm256_set1_epi8('a' - 1), z = _mm256_set1_epi8('z' + 1);
+  const __m256i d0 = _mm256_set1_epi8('0' - 1), d9 = _mm256_set1_epi8('9' + 1);
+  const __m256i us = _mm256_set1_epi8('_'), lower = _mm256_set1_epi8(0x20);
+  for (; p + 32 <= end; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i l = _mm256_or_si256(v, lower); /* Letters as lowercase. */
+    __m256i word = _mm256_or_si256(
+        _mm256_and_si256(_mm256_cmpgt_epi8(l, a), _mm256_cmpgt_epi8(z, l)),
+        _mm256_or_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi8(v, d0),
+                             _mm256_cmpgt_epi8(d9, v)),
+            _mm256_cmpeq_epi8(v, us)));
+    unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(word);
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#elif defined(__SSE2__)
+  const __m128i a = _mm_set1_epi8('a' - 1), z = _mm_set1_epi8('z' + 1);
+  const __m128i d0 = _mm_set1_epi8('0' - 1), d9 = _mm_set1_epi8('9' + 1);
+  const __m128i us = _mm_set1_epi8('_'), lower = _mm_set1_epi8(0x20);
+  for (; p + 16 <= end; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i l = _mm_or_si128(v, lower); /* Letters as lowercase. */
+    __m128i word = _mm_or_si128(
+        _mm_and_si128(_mm_cmpgt_epi8(l, a), _mm_cmpgt_epi8(z, l)),
+        _mm_or_si128(
+            _mm_and_si128(_mm_cmpgt_epi8(v, d0), _mm_cmpgt_epi8(d9, v)),
+            _mm_cmpeq_epi8(v, us)));
+    unsigned int mask = ~(unsigned int)_mm_movemask_epi8(word) & 0xffff;
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+  while (p < end && (isalnum((unsigned char)*p) || *p == '_'))
+    p++;
+  return p;
+}
+
+/* Return the first byte of [p, end) equal to 'a', 'b' or 'c', or end. */
+const char *lexFind(const char *p, const char *end, char a, char b, char c) {
+#if defined(__AVX2__)
+  const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b),
+                vc = _mm256_set1_epi8(c);
+  for (; p + 32 <= end; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+        _mm256_cmpeq_epi8(v, vc)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#elif defined(__SSE2__)
+  const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b),
+                vc = _mm_set1_epi8(c);
+  for (; p + 16 <= end; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+                     _mm_cmpeq_epi8(v, vc)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+  while (p < end && *p != a && *p != b && *p != c)
+    p++;
+  return p;
+}
+
 /* Return true if the specified row last char is part of a multi line comment
  * that starts at this row or at one before, and does not end at the end
- * of the row but spawns to the next row. */
+ * of the row but spawns to the next row. Once the state of the row is known
+ * that is the answer, otherwise it is told from the highlight and the
+ * comment end of the syntax. */
 int editorRowHasOpenComment(erow *row) {
-  if (row->hl && row->rsize && row->hl[row->rsize - 1] == HL_MLCOMMENT &&
-      (row->rsize < 2 || (row->render[row->rsize - 2] != '*' ||
-                          row->render[row->rsize - 1] != '/')))
-    return 1;
-  return 0;
+  if (row->flags & ROW_HL_STATE)
+    return row->hl_oc;
+  if (E.syntax == NULL || row->hl == NULL || row->rsize == 0 ||
+      row->hl[row->rsize - 1] != HL_MLCOMMENT)
+    return 0;
+
+  const char *mce = E.syntax->multiline_comment_end;
+  int len = strlen(mce);
+  return row->rsize < len ||
+         memcmp(row->render + row->rsize - len, mce, len) != 0;
+}
+
+/* Return true if the 'len' bytes of 'delim' are at 'p', before 'end'. Empty
+ * delimiters never match. */
+int lexMatch(const char *p, const char *end, const char *delim, int len) {
+  if (len == 0 || end - p < len)
+    return 0;
+  for (int j = 0; j < len; j++)
+    if (p[j] != delim[j])
+      return 0;
+  return 1;
+}
+
+/* Highlight the 'rsize' bytes of 'render' with 'syn', setting every byte of
+ * 'hl' to the right syntax highlight type (HL_* defines). 'hl' must be all
+ * HL_NORMAL. The row starts inside a multi line comment if 'in_comment' is
+ * set. Returns whether it ends inside one.
+ *
+ * Every byte moves the lexer from a state to the next one according to the
+ * table of the syntax, that also gives its highlight. Some transitions need
+ * to look further (is this a keyword, or a comment delimiter?), and after
+ * each byte, bytes that can't change the state are skipped in bulk. */
+int editorLexRow(struct editorSyntax *syn, char *render, int rsize,
+                 unsigned char *hl, int in_comment) {
+  lexTable *lx = syn->lex;
+  keywordTable *kwtable = syn->kwtable;
+  char *p = render, *end = render + rsize;
+  const char *q;
+  int state = in_comment ? LS_MLCOMMENT : LS_START;
+
+  while (p < end) {
+    lexTrans t = lx->trans[state][lx->cls[(unsigned char)*p]];
+    int i = p - render;
+
+    switch (t.action) {
+    case LA_WORD:
+      /* Highlight the word as a whole if it is a keyword. */
+      if (lx->wordskip) {
+        q = lexSkipWord(p, end);
+      } else {
+        q = p;
+        while (q < end && (lx->cls[(unsigned char)*q] == LC_WORD ||
+                           lx->cls[(unsigned char)*q] == LC_DIGIT))
+          q++;
+      }
+      if (kwtable) {
+        int type = keywordLookup(kwtable, p, q - p);
+        if (type != HL_NORMAL)
+          memset(hl + i, type, q - p);
+      }
+      p += q - p;
+      state = LS_WORD;
+      continue;
+    case LA_OPEN:
+      if (lexMatch(p, end, syn->singleline_comment_start, lx->scslen)) {
+        /* From here to end is a comment */
+        memset(hl + i, HL_COMMENT, end - p);
+        return 0;
+      }
+      if (lexMatch(p, end, syn->multiline_comment_start, lx->mcslen)) {
+        memset(hl + i, HL_MLCOMMENT, lx->mcslen);
+        p += lx->mcslen;
+        state = LS_MLCOMMENT;
+        goto skip;
+      }
+      break;
+    case LA_CLOSE:
+      if (lexMatch(p, end, syn->multiline_comment_end, lx->mcelen)) {
+        memset(hl + i, HL_MLCOMMENT, lx->mcelen);
+        p += lx->mcelen;
+        state = LS_START;
+        continue;
+      }
+      break;
+    case LA_ESCAPE:
+      if (p + 1 < end)
+        hl[i++] = t.hl;
+      hl[i] = t.hl;
+      p = render + i + 1;
+      goto skip;
+    }
+    hl[i] = t.hl;
+    state = t.next;
+    p++;
+
+  skip:
+    /* Go to the next byte that may change something. */
+    if (state == LS_WORD && lx->wordskip) {
+      p += lexSkipWord(p, end) - p;
+    } else if (state == LS_MLCOMMENT) {
+      char c = syn->multiline_comment_end[0];
+      q = lexFind(p, end, c, c, c);
+      memset(hl + (p - render), HL_MLCOMMENT, q - p);
+      p += q - p;
+    } else if (state >= LS_STRING) {
+      char c = lx->quote[state - LS_STRING];
+      q = lexFind(p, end, c, '\\', c);
+      memset(hl + (p - render), HL_STRING, q - p);
+      p += q - p;
+    }
+  }
+  return state == LS_MLCOMMENT;
 }
 
 /* Set every byte of row->hl (that corresponds to every character in the line)
  * to the right syntax highlight type (HL_* defines). */
 void editorUpdateSyntax(erow *row) {
-  if (row->rsize == 0) {
-    free(row->hl);
-    row->hl = NULL;
-  } else {
-    row->hl = realloc(row->hl, row->rsize);
-  }
-  memset(row->hl, HL_NORMAL, row->rsize);
+  /* When allocated, row->hl is always row->rsize bytes: editorUpdateRow()
+   * releases it before the rendered size changes. */
+  if (row->hl == NULL && row->rsize)
+    row->hl = rowAlloc(row->rsize);
+  if (row->rsize)
+    memset(row->hl, HL_NORMAL, row->rsize);
 
   if (E.syntax == NULL)
     return; /* No syntax, everything is HL_NORMAL. */
 
-  int i, prev_sep, in_string, in_comment;
-  char *p;
-  char **keywords = E.syntax->keywords;
-  char *scs = E.syntax->singleline_comment_start;
-  char *mcs = E.syntax->multiline_comment_start;
-  char *mce = E.syntax->multiline_comment_end;
-
-  /* Point to the first non-space char. */
-  p = row->render;
-  i = 0; /* Current char offset */
-  while (*p && isspace(*p)) {
-    p++;
-    i++;
-  }
-  prev_sep = 1;   /* Tell the parser if 'i' points to start of word. */
-  in_string = 0;  /* Are we inside "" or '' ? */
-  in_comment = 0; /* Are we inside multi-line comment? */
-
   /* If the previous line has an open comment, this line starts
    * with an open comment state. */
-  if (row->idx > 0 && editorRowHasOpenComment(&E.row[row->idx - 1]))
-    in_comment = 1;
-
-  while (*p) { // NOLINT(clang-analyzer-core.uninitialized.Branch)
-    /* Handle // comments. */
-    if (prev_sep && *p == scs[0] && *(p + 1) == scs[1]) {
-      /* From here to end is a comment */
-      memset(row->hl + i, HL_COMMENT, row->size - i);
-      return;
+  int in_comment = 0;
+  int idx = editorRowIndex(row), slot;
+  if (idx > 0) {
+    rowNode *n = rowTreeLookup(idx - 1, &slot, 0);
+    if (n->leaf) {
+      erow *prev = n->u.rows[slot];
+      editorRowEnsureState(prev);
+      in_comment = prev->hl_oc;
+    } else {
+      in_comment = n->page->hl_oc; /* Previous page not loaded. */
     }
+  }
+  int oc = editorLexRow(E.syntax, row->render, row->rsize, row->hl,
+                        in_comment);
 
-    /* Handle multi line comments. */
-    if (in_comment) {
-      row->hl[i] = HL_MLCOMMENT;
-      if (*p == mce[0] && *(p + 1) == mce[1]) {
-        row->hl[i + 1] = HL_MLCOMMENT;
-        p += 2;
-        i += 2;
-        in_comment = 0;
-        prev_sep = 1;
-        continue;
-      } else {
-        prev_sep = 0;
-        p++;
-        i++;
-        continue;
-      }
-    } else if (*p == mcs[0] && *(p + 1) == mcs[1]) {
-      row->hl[i] = HL_MLCOMMENT;
-      row->hl[i + 1] = HL_MLCOMMENT;
-      p += 2;
-      i += 2;
-      in_comment = 1;
-      prev_sep = 0;
-      continue;
+  /* Propagate syntax change to the next rows if the open comment
+   * state changed, see editorSyntaxPropagate(). */
+  int changed = !(row->flags & ROW_HL_STATE) || row->hl_oc != oc;
+  row->hl_oc = oc;
+  row->flags |= ROW_HL_STATE;
+  if (changed)
+    editorSyntaxChanged(idx + 1);
+}
+
+/* The state at the end of a row depends on the state at the end of the row
+ * before, so when it changes, the rows that follow have to be highlighted
+ * again until one ends in the same state as before. Opening a comment at
+ * the top of a big file would then go through the whole file: instead only
+ * the rows up to 'last' are highlighted again right away, and the rows from
+ * there on are just marked stale by setting E.hlstale, the first row whose
+ * state may be outdated. States of stale rows are computed again once they
+ * are needed, see editorSyntaxCatchUp().
+ *
+ * Rows are highlighted in a loop: the editorUpdateSyntax() calls it makes
+ * only tell it whether to go on. */
+void editorSyntaxPropagate(int at, int last) {
+  static int active;
+  erow *row;
+
+  if (active)
+    return;
+  active = 1;
+  while (at < E.hlstale && (row = editorRowPeek(at)) != NULL &&
+         row->flags & ROW_HL_STATE) {
+    if (at > last) {
+      E.hlstale = at;
+      break;
+    }
+    if (!editorRowUpdateState(row))
+      break; /* Same state as before: the next rows are still right. */
+    at++;
+  }
+  active = 0;
+}
+
+/* The state before row 'at' changed: highlight again the rows on screen
+ * from there, and mark the ones below stale. */
+void editorSyntaxChanged(int at) {
+  editorSyntaxPropagate(at, at < E.rowoff ? at - 1
+                                          : E.rowoff + E.screenrows - 1);
+}
+
+/* Make sure the states of the rows up to 'upto' are not stale. */
+void editorSyntaxCatchUp(int upto) {
+  while (E.hlstale <= upto) {
+    int at = E.hlstale;
+    E.hlstale = INT_MAX;
+    editorSyntaxPropagate(at, upto);
+  }
+}
+
+/* Rows get their render and hl only once something needs them, like the
+ * screen refresh or a search, so loading a file does not pay for rendering
+ * and highlighting lines that may never be shown. */
+void editorRowMaterialize(erow *row) {
+  if (row->render == NULL)
+    editorUpdateRow(row);
+}
+
+/* Recompute the syntax state at the end of the row. Rows that were not
+ * materialized go back to not having render and hl once done. Returns
+ * whether the state changed. */
+int editorRowUpdateState(erow *row) {
+  int known = row->flags & ROW_HL_STATE, oc = row->hl_oc;
+
+  if (row->render) {
+    editorUpdateSyntax(row);
+  } else {
+    editorUpdateRow(row);
+    rowFree(row->render, row->rsize + 1);
+    rowFree(row->hl, row->rsize);
+    row->render = NULL;
+    row->hl = NULL;
+    row->rsize = 0;
+  }
+  return !known || row->hl_oc != oc;
+}
+
+/* Make sure the syntax state at the end of the row is known. States are
+ * computed from the top of the file down, so rows with a known state always
+ * form a prefix of the file (or of the loaded pages around the row, in
+ * paging mode): walk back to its end and compute the states of the rows in
+ * between. */
+void editorRowEnsureState(erow *row) {
+  if (row->flags & ROW_HL_STATE) {
+    if (E.hlstale != INT_MAX)
+      editorSyntaxCatchUp(editorRowIndex(row));
+    return;
+  }
+
+  int idx = editorRowIndex(row), from = idx;
+  erow *prev;
+  while ((prev = editorRowPeek(from - 1)) != NULL &&
+         !(prev->flags & ROW_HL_STATE))
+    from--;
+  editorSyntaxCatchUp(from - 1);
+
+  rowIter it;
+  rowIterInit(&it, from);
+  for (int j = from; j <= idx; j++)
+    editorRowUpdateState(rowIterNext(&it));
+}
+
+/* While the editor is idle, a background thread computes the states of the
+ * rows that don't have one yet (or have a stale one), from the end of the
+ * known ones down to the end of the file, so that jumping far away does not
+ * have to compute them first. It works on jobs of KILO_HL_JOB_ROWS rows:
+ * the content of the rows is taken on the main thread (rows still inside
+ * E.orig are just pointed to, others are copied), the thread computes
+ * their states with the same lexer on its own buffers, and the main thread
+ * applies them once done and takes the next job.
+ *
+ * Rows may be edited meanwhile. Edits never touch the content given to the
+ * thread, and an edited row gets its state on the spot, so when applying
+ * states the job computed for rows that already have one are compared, and
+ * if they differ the rest of the job is dropped. Rows added or removed move
+ * the others around: E.hlversion changes, and the job is dropped as a
+ * whole. The thread is stopped before E.orig goes away. */
+#define KILO_HL_JOB_ROWS 65536
+
+void hlJobFree(hlJob *j) {
+  free(j->chars);
+  free(j->size);
+  free(j->copy);
+  free(j->oc);
+  pthread_mutex_destroy(&j->lock);
+  free(j);
+}
+
+void *editorHighlightWorker(void *arg) {
+  hlJob *j = arg;
+  char *render = NULL;
+  unsigned char *hl = NULL;
+  size_t cap = 0;
+  int state = j->in;
+
+#if defined(__linux__) && defined(SCHED_IDLE)
+  /* Only use CPU time nothing else wants. */
+  struct sched_param param = {0};
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+  for (int k = 0; k < j->count; k++) {
+    if ((k & 1023) == 0) {
+      pthread_mutex_lock(&j->lock);
+      int cancel = j->cancel;
+      pthread_mutex_unlock(&j->lock);
+      if (cancel)
+        break;
     }
 
-    /* Handle "" and '' */
-    if (in_string) {
-      row->hl[i] = HL_STRING;
-      if (*p == '\\') {
-        row->hl[i + 1] = HL_STRING;
-        p += 2;
-        i += 2;
-        prev_sep = 0;
-        continue;
-      }
-      if (*p == in_string)
-        in_string = 0;
-      p++;
-      i++;
-      continue;
-    } else {
-      if (*p == '"' || *p == '\'') {
-        in_string = *p;
-        row->hl[i] = HL_STRING;
-        p++;
-        i++;
-        prev_sep = 0;
-        continue;
+    /* Render the row as editorUpdateRow() does, then lex it. */
+    const char *chars = j->chars[k];
+    size_t need = (size_t)j->size[k] * TAB_SIZE + 1;
+    if (need > cap) {
+      cap = need * 2;
+      render = realloc(render, cap);
+      hl = realloc(hl, cap);
+    }
+    int rsize = 0;
+    for (int c = 0; c < j->size[k]; c++) {
+      if (chars[c] == TAB) {
+        render[rsize++] = ' ';
+        while (rsize % TAB_SIZE != 0)
+          render[rsize++] = ' ';
+      } else {
+        render[rsize++] = chars[c];
       }
     }
+    render[rsize] = '\0';
+    memset(hl, HL_NORMAL, rsize);
+    state = editorLexRow(j->syntax, render, rsize, hl, state);
+    j->oc[k] = state;
+  }
+  free(render);
+  free(hl);
+  pthread_mutex_lock(&j->lock);
+  j->done = 1;
+  pthread_mutex_unlock(&j->lock);
+  return NULL;
+}
 
-    /* Handle non printable chars. */
-    if (!isprint(*p)) {
-      row->hl[i] = HL_NONPRINT;
-      p++;
-      i++;
-      prev_sep = 0;
+/* Return the first row without a syntax state. Rows with a state are a
+ * prefix of the file, unless in paging mode. */
+int editorSyntaxKnownRows(void) {
+  int lo = 0, hi = E.numrows;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (editorRowAt(mid)->flags & ROW_HL_STATE)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Give the background highlighter its next job, if there is work left. */
+void editorHighlightStart(void) {
+  if (E.hljob || E.syntax == NULL || E.paging)
+    return;
+
+  int from = editorSyntaxKnownRows();
+  if (E.hlstale < from)
+    from = E.hlstale;
+  int count = E.numrows - from;
+  if (count <= 0)
+    return;
+  if (count > KILO_HL_JOB_ROWS)
+    count = KILO_HL_JOB_ROWS;
+
+  hlJob *j = calloc(1, sizeof(*j));
+  j->syntax = E.syntax;
+  j->version = E.hlversion;
+  j->from = from;
+  j->count = count;
+  j->in = from ? editorRowAt(from - 1)->hl_oc : 0;
+  j->chars = malloc(sizeof(j->chars[0]) * count);
+  j->size = malloc(sizeof(j->size[0]) * count);
+  j->oc = malloc(count);
+  pthread_mutex_init(&j->lock, NULL);
+
+  /* Rows in E.orig stay as they are while the job runs, others may be
+   * edited: copy those. */
+  rowIter it;
+  erow *row;
+  size_t copylen = 0;
+  rowIterInit(&it, from);
+  for (int k = 0; k < count; k++) {
+    row = rowIterNext(&it);
+    if (!(row->flags & ROW_VIEW) || row == E.gaprow)
+      copylen += row->size;
+  }
+  j->copy = malloc(copylen + 1);
+  copylen = 0;
+  rowIterInit(&it, from);
+  for (int k = 0; k < count; k++) {
+    row = rowIterNext(&it);
+    j->size[k] = row->size;
+    if ((row->flags & ROW_VIEW) && row != E.gaprow) {
+      j->chars[k] = row->chars;
       continue;
     }
+    for (int c = 0; c < row->size; c++)
+      j->copy[copylen + c] = editorRowCharAt(row, c);
+    j->chars[k] = j->copy + copylen;
+    copylen += row->size;
+  }
 
-    /* Handle numbers */
-    if ((isdigit(*p) && (prev_sep || row->hl[i - 1] == HL_NUMBER)) ||
-        (*p == '.' && i > 0 && row->hl[i - 1] == HL_NUMBER)) {
-      row->hl[i] = HL_NUMBER;
-      p++;
-      i++;
-      prev_sep = 0;
+  if (pthread_create(&j->tid, NULL, editorHighlightWorker, j) != 0) {
+    hlJobFree(j);
+    return;
+  }
+  E.hljob = j;
+}
+
+/* Apply the states computed by a job, see the comment above. Returns 1 if
+ * rows on screen may look different. */
+int editorHighlightApply(hlJob *j) {
+  int k = j->from, redraw = 0;
+
+  if (j->version != E.hlversion || j->syntax != E.syntax || E.paging)
+    return 0;
+  /* The row before must still end in the state the job started from. */
+  if (k > 0) {
+    erow *prev = editorRowAt(k - 1);
+    if (!(prev->flags & ROW_HL_STATE) || k - 1 >= E.hlstale ||
+        prev->hl_oc != j->in)
+      return 0;
+  }
+
+  rowIter it;
+  rowIterInit(&it, k);
+  for (int n = 0; n < j->count; n++, k++) {
+    erow *row = rowIterNext(&it);
+    if (row->flags & ROW_HL_STATE && k < E.hlstale) {
+      /* Edited meanwhile: is the job still right from here? */
+      if (row->hl_oc != j->oc[n])
+        break;
       continue;
     }
 
-    /* Handle keywords and lib calls */
-    if (prev_sep) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2)
-          klen--;
-
-        if (!memcmp(p, keywords[j], klen) && is_separator(*(p + klen))) {
-          /* Keyword */
-          memset(row->hl + i, kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          p += klen;
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) {
-        prev_sep = 0;
-        continue; /* We had a keyword match */
-      }
+    /* Either no state, or the first stale row. Rows before are right. */
+    int stale = row->flags & ROW_HL_STATE, oc = row->hl_oc;
+    if (stale)
+      E.hlstale = k + 1;
+    if (row->render) {
+      editorUpdateSyntax(row); /* Its hl needs to be right too. */
+      redraw = 1;
+    } else {
+      row->hl_oc = j->oc[n];
+      row->flags |= ROW_HL_STATE;
+    }
+    if (stale && row->hl_oc == oc) {
+      E.hlstale = INT_MAX; /* The rows after are right again. */
+      break;
     }
-
-    /* Not special chars */
-    prev_sep = is_separator(*p);
-    p++;
-    i++;
   }
+  if (E.hlstale >= E.numrows)
+    E.hlstale = INT_MAX;
+  return redraw;
+}
 
-  /* Propagate syntax change to the next row if the open commen
-   * state changed. This may recursively affect all the following rows
-   * in the file. */
-  int oc = editorRowHasOpenComment(row);
-  if (row->hl_oc != oc && row->idx + 1 < E.numrows)
-    editorUpdateSyntax(&E.row[row->idx + 1]);
-  row->hl_oc = oc;
+/* Stop the background highlighter, dropping its job. */
+void editorHighlightStop(void) {
+  hlJob *j = E.hljob;
+
+  if (j == NULL)
+    return;
+  pthread_mutex_lock(&j->lock);
+  j->cancel = 1;
+  pthread_mutex_unlock(&j->lock);
+  pthread_join(j->tid, NULL);
+  hlJobFree(j);
+  E.hljob = NULL;
+}
+
+/* Called when the editor is idle: apply the job of the background
+ * highlighter once done, and start the next one. With 'wait' set, wait for
+ * the job to be done. Returns 1 if the screen should be refreshed. */
+int editorHighlightPoll(int wait) {
+  hlJob *j = E.hljob;
+  int redraw = 0;
+
+  if (j) {
+    pthread_mutex_lock(&j->lock);
+    int done = j->done;
+    pthread_mutex_unlock(&j->lock);
+    if (!done && !wait)
+      return 0;
+    pthread_join(j->tid, NULL);
+    E.hljob = NULL;
+    redraw = editorHighlightApply(j);
+    hlJobFree(j);
+  }
+  editorHighlightStart();
+  return redraw;
 }
 
 /* Maps syntax highlight token types to terminal colors. */
@@ -491,190 +911,1327 @@ int editorSyntaxToColor(int hl) {
   }
 }
 
-/* Select the syntax highlight scheme depending on the filename,
- * setting it in the global state E.syntax. */
-void editorSelectSyntaxHighlight(char *filename) {
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-    struct editorSyntax *s = HLDB + j;
-    unsigned int i = 0;
-    while (s->filematch[i]) {
-      char *p;
-      int patlen = strlen(s->filematch[i]);
-      if ((p = strstr(filename, s->filematch[i])) != NULL) {
-        if (s->filematch[i][0] != '.' || p[patlen] == '\0') {
-          E.syntax = s;
-          return;
+/* Keywords are looked up once per word in a table compiled from the list of
+ * the syntax, see keywordTable in kilo.h. The slot of a word is given by a
+ * seeded hash of it: the table is built trying seeds until all the keywords
+ * land in different slots, so a lookup is a single compare. */
+#define KEYWORD_SEED_TRIES 256
+
+uint32_t keywordHash(uint32_t seed, const char *s, int len) {
+  uint32_t h = seed ^ 2166136261u;
+  for (int j = 0; j < len; j++)
+    h = (h ^ (unsigned char)s[j]) * 16777619u;
+  return h ^ (h >> 15);
+}
+
+/* Return the HL_KEYWORD* type of the 'len' bytes at 's', or HL_NORMAL
+ * if they are not a keyword. */
+int keywordLookup(keywordTable *t, const char *s, int len) {
+  if (len < t->minlen || len > t->maxlen)
+    return HL_NORMAL;
+  keywordSlot *slot = t->slots + (keywordHash(t->seed, s, len) & t->mask);
+  if (slot->len != len || memcmp(slot->word, s, len) != 0)
+    return HL_NORMAL;
+  return slot->type;
+}
+
+/* Compile a list of keywords into a lookup table. Keywords ending with '|'
+ * are HL_KEYWORD2, the others HL_KEYWORD1; if a word is listed twice the
+ * first one wins. Returns NULL if there are no keywords. */
+keywordTable *keywordTableBuild(char **keywords) {
+  keywordTable *t;
+  int count = 0;
+
+  if (keywords == NULL || keywords[0] == NULL)
+    return NULL;
+  t = calloc(1, sizeof(*t));
+  t->minlen = INT_MAX;
+  for (count = 0; keywords[count]; count++) {
+    int len = strlen(keywords[count]);
+    if (keywords[count][len - 1] == '|')
+      len--;
+    if (len < t->minlen)
+      t->minlen = len;
+    if (len > t->maxlen)
+      t->maxlen = len;
+  }
+
+  /* Start with four slots per keyword, and double the table in the
+   * unlikely case no seed is found. */
+  size_t size = 4;
+  while (size < (size_t)count * 4)
+    size *= 2;
+  for (;;) {
+    t->slots = calloc(size, sizeof(keywordSlot));
+    t->mask = size - 1;
+    for (t->seed = 0; t->seed < KEYWORD_SEED_TRIES; t->seed++) {
+      int j;
+      for (j = 0; j < count; j++) {
+        char *kw = keywords[j];
+        int len = strlen(kw), type = HL_KEYWORD1;
+        if (kw[len - 1] == '|') {
+          len--;
+          type = HL_KEYWORD2;
         }
+        keywordSlot *slot =
+            t->slots + (keywordHash(t->seed, kw, len) & t->mask);
+        if (slot->len == len && memcmp(slot->word, kw, len) == 0)
+          continue; /* Listed twice. */
+        if (slot->len)
+          break; /* Collision: try the next seed. */
+        slot->word = kw;
+        slot->len = len;
+        slot->type = type;
       }
-      i++;
+      if (j == count)
+        return t;
+      memset(t->slots, 0, size * sizeof(keywordSlot));
     }
+    free(t->slots);
+    size *= 2;
   }
 }
 
-/* ======================= Editor rows implementation ======================= */
+/* Release a table built by keywordTableBuild(), if any. */
+void keywordTableFree(keywordTable *t) {
+  if (t == NULL)
+    return;
+  free(t->slots);
+  free(t);
+}
 
-/* Update the rendered version and the syntax highlight of a row. */
-void editorUpdateRow(erow *row) {
-  unsigned int tabs = 0, nonprint = 0;
-  int j, idx;
+/* Transition of the lexer from code states (LS_START, LS_WORD, LS_NUMBER)
+ * on a byte of class 'cls', comment delimiters and quotes apart. */
+lexTrans lexCodeTrans(int state, int cls) {
+  lexTrans t = {LS_START, HL_NORMAL, LA_NONE};
 
-  /* Create a version of the row we can directly print on the screen,
-   * respecting tabs, substituting non printable characters with '?'. */
-  free(row->render);
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == TAB)
-      tabs++;
+  switch (cls) {
+  case LC_WORD:
+    t.next = LS_WORD;
+    if (state == LS_START)
+      t.action = LA_WORD;
+    break;
+  case LC_DIGIT:
+    t.next = state == LS_WORD ? LS_WORD : LS_NUMBER;
+    t.hl = state == LS_WORD ? HL_NORMAL : HL_NUMBER;
+    break;
+  case LC_DOT:
+    if (state == LS_NUMBER) {
+      t.next = LS_NUMBER;
+      t.hl = HL_NUMBER;
+    }
+    break;
+  case LC_NONPRINT:
+    t.next = LS_WORD;
+    t.hl = HL_NONPRINT;
+    break;
+  }
+  return t;
+}
 
-  unsigned long long allocsize =
-      (unsigned long long)row->size + tabs * 8 + nonprint * 9 + 1;
-  if (allocsize > UINT32_MAX) {
-    printf("Some line of the edited file is too long for kilo\n");
-    exit(1);
+/* Compile the lexer table of a syntax. */
+lexTable *lexTableBuild(struct editorSyntax *syn) {
+  lexTable *lx = calloc(1, sizeof(*lx));
+  char *scs = syn->singleline_comment_start;
+  char *mcs = syn->multiline_comment_start;
+  char *mce = syn->multiline_comment_end;
+  int numbers = syn->flags & HL_HIGHLIGHT_NUMBERS;
+  int base[256];
+
+  /* Classes of bytes, before delimiters and quotes get their own. */
+  for (int c = 0; c < 256; c++) {
+    if (isalpha(c) || c == '_')
+      base[c] = LC_WORD;
+    else if (isdigit(c))
+      base[c] = numbers ? LC_DIGIT : LC_WORD;
+    else if (c == '.')
+      base[c] = numbers ? LC_DOT : LC_SEP;
+    else if (c == '\\')
+      base[c] = LC_ESC;
+    else
+      base[c] = isprint(c) ? LC_SEP : LC_NONPRINT;
+    lx->cls[c] = base[c];
   }
 
-  row->render = malloc(row->size + tabs * 8 + nonprint * 9 + 1);
-  idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == TAB) {
-      row->render[idx++] = ' ';
-      while (idx % TAB_SIZE != 0)
-        row->render[idx++] = ' ';
-    } else {
-      row->render[idx++] = row->chars[j];
+  /* Transitions from every state for the plain classes. */
+  for (int s = 0; s < LEX_STATES; s++) {
+    for (int cls = 0; cls < LC_DELIM; cls++) {
+      lexTrans t = {s, HL_MLCOMMENT, LA_NONE};
+      if (s < LS_MLCOMMENT) {
+        t = lexCodeTrans(s, cls);
+      } else if (s >= LS_STRING) {
+        t.hl = HL_STRING;
+        if (cls == LC_ESC)
+          t.action = LA_ESCAPE;
+      }
+      lx->trans[s][cls] = t;
     }
   }
-  row->rsize = idx;
-  row->render[idx] = '\0';
 
-  /* Update the syntax highlighting attributes of the row. */
-  editorUpdateSyntax(row);
+  /* Quotes start strings in code, and end their own. */
+  int nquotes = 0;
+  for (char *q = syn->quotes; syn->flags & HL_HIGHLIGHT_STRINGS && q && *q &&
+                              nquotes < LEX_MAX_QUOTES;
+       q++) {
+    int cls = LC_QUOTE + nquotes, c = (unsigned char)*q;
+    lx->quote[nquotes] = *q;
+    for (int s = 0; s < LEX_STATES; s++) {
+      lexTrans t = lx->trans[s][base[c]];
+      if (s < LS_MLCOMMENT) {
+        t.next = LS_STRING + nquotes;
+        t.hl = HL_STRING;
+        t.action = LA_NONE;
+      } else if (s == LS_STRING + nquotes) {
+        t.next = LS_WORD;
+      }
+      lx->trans[s][cls] = t;
+    }
+    lx->cls[c] = cls;
+    base[c] = cls;
+    nquotes++;
+  }
+
+  /* First bytes of comment delimiters check for the rest of them. */
+  lx->scslen = strlen(scs);
+  lx->mcslen = strlen(mcs);
+  lx->mcelen = lx->mcslen ? strlen(mce) : 0;
+  char firsts[3] = {scs[0], mcs[0], lx->mcelen ? mce[0] : 0};
+  for (int d = 0; d < 3; d++) {
+    int c = (unsigned char)firsts[d], cls = LC_DELIM + d;
+    if (c == 0 || lx->cls[c] >= LC_DELIM)
+      continue; /* None, or already seen. */
+    for (int s = 0; s < LEX_STATES; s++) {
+      lexTrans t = lx->trans[s][base[c]];
+      if (s < LS_MLCOMMENT && (c == scs[0] || c == mcs[0]))
+        t.action = LA_OPEN;
+      else if (s == LS_MLCOMMENT && lx->mcelen && c == mce[0])
+        t.action = LA_CLOSE;
+      lx->trans[s][cls] = t;
+    }
+    lx->cls[c] = cls;
+  }
+
+  /* Words can be skipped in bulk if none of their bytes is special. */
+  lx->wordskip = 1;
+  for (int c = 0; c < 256; c++)
+    if ((isalnum(c) || c == '_') && lx->cls[c] != LC_WORD &&
+        lx->cls[c] != LC_DIGIT)
+      lx->wordskip = 0;
+  return lx;
 }
 
-/* Insert a row at the specified position, shifting the other rows on the bottom
- * if required. */
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at > E.numrows)
-    return;
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  if (at != E.numrows) {
-    memmove(E.row + at + 1, E.row + at, sizeof(E.row[0]) * (E.numrows - at));
-    for (int j = at + 1; j <= E.numrows; j++)
-      E.row[j].idx++;
-  }
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len + 1);
-  E.row[at].hl = NULL;
-  E.row[at].hl_oc = 0;
-  E.row[at].render = NULL;
-  E.row[at].rsize = 0;
-  E.row[at].idx = at;
-  editorUpdateRow(E.row + at);
-  E.numrows++;
-  E.dirty++;
+/* Compile a syntax for highlighting: its keyword and lexer tables. */
+void editorSyntaxCompile(struct editorSyntax *syn) {
+  syn->kwtable = keywordTableBuild(syn->keywords);
+  syn->lex = lexTableBuild(syn);
 }
 
-/* Free row's heap allocated stuff. */
-void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+/* ======================= Loadable syntax definitions =====================
+ *
+ * Syntaxes other than the built-in ones are described by small text files,
+ * with the .syntax extension, read from the directory in the
+ * KILO_SYNTAX_DIR environment variable, then ~/.kilo/syntax, then
+ * KILO_SYNTAX_DIR as set at build time. Their syntaxes come before the
+ * built-in ones, and earlier directories before later ones. Every line is a
+ * setting followed by its arguments, separated by spaces:
+ *
+ *   # Lines starting with # are ignored.
+ *   name Python           Name of the syntax.
+ *   files .py .pyw        File name matches, as in HLDB.
+ *   keywords if else      Keywords, any number of lines of them.
+ *   types int str         Keywords in the second color.
+ *   comment #             Single line comment start, up to 3 chars.
+ *   block (* *)           Multi line comment start and end.
+ *   strings " '           String delimiters, up to 4 single chars.
+ *   numbers on            Highlight numbers, on or off.
+ *
+ * Keywords are made of letters, digits and '_'. See the syntax directory
+ * for examples. */
+#ifndef KILO_SYNTAX_DIR
+#define KILO_SYNTAX_DIR "/usr/local/share/kilo/syntax"
+#endif
+#define KILO_SYNTAX_EXT ".syntax"
+
+/* Append a copy of 's' to the NULL terminated list '*list' of 'len'
+ * items, with a '|' at the end if 'bar' is set. */
+void syntaxListAdd(char ***list, int *len, const char *s, int bar) {
+  size_t slen = strlen(s);
+  char *copy = malloc(slen + 2);
+
+  memcpy(copy, s, slen);
+  if (bar)
+    copy[slen++] = '|';
+  copy[slen] = '\0';
+  *list = realloc(*list, sizeof(char *) * (*len + 2));
+  (*list)[(*len)++] = copy;
+  (*list)[*len] = NULL;
 }
 
-/* Remove the row at the specified position, shifting the remainign on the
- * top. */
-void editorDelRow(int at) {
-  erow *row;
+/* Release a syntax loaded by editorSyntaxLoad(), with its compiled tables. */
+void editorSyntaxFree(struct editorSyntax *syn) {
+  keywordTableFree(syn->kwtable);
+  free(syn->lex);
+  for (int j = 0; syn->filematch[j]; j++)
+    free(syn->filematch[j]);
+  for (int j = 0; syn->keywords[j]; j++)
+    free(syn->keywords[j]);
+  free(syn->filematch);
+  free(syn->keywords);
+  free(syn->quotes);
+  free(syn->name);
+  free(syn);
+}
 
-  if (at >= E.numrows)
-    return;
-  row = E.row + at;
-  editorFreeRow(row);
-  memmove(E.row + at, E.row + at + 1, sizeof(E.row[0]) * (E.numrows - at - 1));
-  for (int j = at; j < E.numrows - 1; j++)
-    E.row[j].idx++;
-  E.numrows--;
-  E.dirty++;
+/* Copy a comment delimiter argument into 'dst'. Returns 0 on success, -1
+ * if it is missing or too long. */
+int syntaxDelim(char *dst, const char *arg) {
+  if (arg == NULL || strlen(arg) > LEX_MAX_DELIM)
+    return -1;
+  strcpy(dst, arg);
+  return 0;
 }
 
-/* Turn the editor rows into a single heap-allocated string.
- * Returns the pointer to the heap-allocated string and populate the
- * integer pointed by 'buflen' with the size of the string, escluding
- * the final nulterm. */
-char *editorRowsToString(int *buflen) {
-  char *buf = NULL, *p;
-  int totlen = 0;
-  int j;
+/* Load the syntax definition file at 'path'. Returns NULL if it can't be
+ * read, or with a status message telling why if it is not valid. */
+struct editorSyntax *editorSyntaxLoad(const char *path) {
+  FILE *fp = fopen(path, "r");
+  const char *err = NULL, *sep = " \t\r\n";
+  char line[1024], *arg;
+  int lineno = 0, nfiles = 0, nkeywords = 0, nquotes = 0;
+
+  if (fp == NULL)
+    return NULL;
+  struct editorSyntax *syn = calloc(1, sizeof(*syn));
+  syn->filematch = calloc(1, sizeof(char *));
+  syn->keywords = calloc(1, sizeof(char *));
+  syn->quotes = calloc(LEX_MAX_QUOTES + 1, 1);
+  while (err == NULL && fgets(line, sizeof(line), fp)) {
+    char *key = strtok(line, sep);
+    lineno++;
+    if (key == NULL || key[0] == '#')
+      continue;
 
-  /* Compute count of bytes */
-  for (j = 0; j < E.numrows; j++)
-    totlen += E.row[j].size + 1; /* +1 is for "\n" at end of every row */
-  *buflen = totlen;
-  totlen++; /* Also make space for nulterm */
-
-  p = buf = malloc(totlen);
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+    if (!strcmp(key, "name")) {
+      arg = strtok(NULL, "\r\n");
+      free(syn->name);
+      syn->name = strdup(arg ? arg : "");
+    } else if (!strcmp(key, "files")) {
+      while ((arg = strtok(NULL, sep)) != NULL)
+        syntaxListAdd(&syn->filematch, &nfiles, arg, 0);
+    } else if (!strcmp(key, "keywords") || !strcmp(key, "types")) {
+      while (err == NULL && (arg = strtok(NULL, sep)) != NULL) {
+        for (char *c = arg; *c; c++)
+          if (!isalnum((unsigned char)*c) && *c != '_')
+            err = "keywords are made of letters, digits and _";
+        if (err == NULL)
+          syntaxListAdd(&syn->keywords, &nkeywords, arg, key[0] == 't');
+      }
+    } else if (!strcmp(key, "comment")) {
+      if (syntaxDelim(syn->singleline_comment_start, strtok(NULL, sep)))
+        err = "comment needs a delimiter of 1 to 3 chars";
+    } else if (!strcmp(key, "block")) {
+      if (syntaxDelim(syn->multiline_comment_start, strtok(NULL, sep)) ||
+          syntaxDelim(syn->multiline_comment_end, strtok(NULL, sep)))
+        err = "block needs start and end delimiters of 1 to 3 chars";
+    } else if (!strcmp(key, "strings")) {
+      while (err == NULL && (arg = strtok(NULL, sep)) != NULL) {
+        if (strlen(arg) != 1 || nquotes == LEX_MAX_QUOTES)
+          err = "strings needs up to 4 single char delimiters";
+        else
+          syn->quotes[nquotes++] = arg[0];
+      }
+      syn->flags |= HL_HIGHLIGHT_STRINGS;
+    } else if (!strcmp(key, "numbers")) {
+      arg = strtok(NULL, sep);
+      if (arg && !strcmp(arg, "on"))
+        syn->flags |= HL_HIGHLIGHT_NUMBERS;
+      else if (arg == NULL || strcmp(arg, "off"))
+        err = "numbers is on or off";
+    } else {
+      err = "unknown setting";
+    }
   }
-  *p = '\0';
-  return buf;
+  fclose(fp);
+  if (err == NULL && nfiles == 0) {
+    err = "no files to match";
+    lineno = 0;
+  }
+  if (err) {
+    editorSetStatusMessage("%s:%d: %s", path, lineno, err);
+    editorSyntaxFree(syn);
+    return NULL;
+  }
+  if (syn->name == NULL)
+    syn->name = strdup(path);
+  return syn;
 }
 
-/* Insert a character at the specified position in a row, moving the remaining
- * chars on the right if needed. */
-void editorRowInsertChar(erow *row, int at, int c) {
-  if (row == NULL)
+/* Load every syntax definition file of a directory, if it exists. */
+void editorSyntaxLoadDir(const char *dir) {
+  DIR *d = opendir(dir);
+  struct dirent *de;
+  size_t extlen = strlen(KILO_SYNTAX_EXT);
+
+  if (d == NULL)
     return;
+  while ((de = readdir(d)) != NULL) {
+    size_t len = strlen(de->d_name);
+    if (len <= extlen ||
+        strcmp(de->d_name + len - extlen, KILO_SYNTAX_EXT) != 0)
+      continue;
 
-  if (at > row->size) {
-    /* Pad the string with spaces if the insert location is outside the
-     * current length by more than a single character. */
-    int padlen = at - row->size;
-    /* In the next line +2 means: new char and null term. */
-    row->chars = realloc(row->chars, row->size + padlen + 2);
-    memset(row->chars + row->size, ' ', padlen);
-    row->chars[row->size + padlen + 1] = '\0';
-    row->size += padlen + 1;
-  } else {
-    /* If we are in the middle of the string just make space for 1 new
-     * char plus the (already existing) null term. */
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(row->chars + at + 1, row->chars + at, row->size - at + 1);
-    row->size++;
+    char *path = malloc(strlen(dir) + len + 2);
+    sprintf(path, "%s/%s", dir, de->d_name);
+    struct editorSyntax *syn = editorSyntaxLoad(path);
+    free(path);
+    if (syn == NULL)
+      continue;
+    E.syntaxdb = realloc(E.syntaxdb, sizeof(syn) * (E.syntaxcount + 1));
+    E.syntaxdb[E.syntaxcount++] = syn;
   }
-  row->chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty++;
+  closedir(d);
 }
 
-/* Append the string 's' at the end of a row */
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(row->chars + row->size, s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+/* Release the syntaxes loaded from files. They are loaded again the next
+ * time a syntax is selected. */
+void editorSyntaxUnload(void) {
+  for (int j = 0; j < E.syntaxcount; j++) {
+    if (E.syntax == E.syntaxdb[j])
+      E.syntax = NULL;
+    editorSyntaxFree(E.syntaxdb[j]);
+  }
+  free(E.syntaxdb);
+  E.syntaxdb = NULL;
+  E.syntaxcount = 0;
+  E.syntaxloaded = 0;
 }
 
-/* Delete the character at offset 'at' from the specified row. */
-void editorRowDelChar(erow *row, int at) {
-  if (row->size <= at)
-    return;
-  memmove(row->chars + at, row->chars + at + 1, row->size - at);
-  editorUpdateRow(row);
-  row->size--;
-  E.dirty++;
+/* Return true if 'filename' is one of the files of the syntax. */
+int editorSyntaxMatches(struct editorSyntax *s, char *filename) {
+  for (unsigned int i = 0; s->filematch[i]; i++) {
+    char *p;
+    int patlen = strlen(s->filematch[i]);
+    if ((p = strstr(filename, s->filematch[i])) != NULL) {
+      if (s->filematch[i][0] != '.' || p[patlen] == '\0')
+        return 1;
+    }
+  }
+  return 0;
 }
 
-/* Insert the specified char at the current prompt position. */
-void editorInsertChar(int c) {
-  int filerow = E.rowoff + E.cy;
-  int filecol = E.coloff + E.cx;
-  erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
+/* Select the syntax highlight scheme depending on the filename,
+ * setting it in the global state E.syntax. */
+void editorSelectSyntaxHighlight(char *filename) {
+  struct editorSyntax *s = NULL;
+
+  if (!E.syntaxloaded) {
+    char *home = getenv("HOME");
+    E.syntaxloaded = 1;
+    if (getenv("KILO_SYNTAX_DIR"))
+      editorSyntaxLoadDir(getenv("KILO_SYNTAX_DIR"));
+    if (home) {
+      char *dir = malloc(strlen(home) + 16);
+      sprintf(dir, "%s/.kilo/syntax", home);
+      editorSyntaxLoadDir(dir);
+      free(dir);
+    }
+    editorSyntaxLoadDir(KILO_SYNTAX_DIR);
+  }
+
+  for (int j = 0; s == NULL && j < E.syntaxcount; j++)
+    if (editorSyntaxMatches(E.syntaxdb[j], filename))
+      s = E.syntaxdb[j];
+  for (unsigned int j = 0; s == NULL && j < HLDB_ENTRIES; j++)
+    if (editorSyntaxMatches(HLDB + j, filename))
+      s = HLDB + j;
+  if (s == NULL)
+    return;
+  if (s->lex == NULL)
+    editorSyntaxCompile(s);
+  E.syntax = s;
+}
+
+/* ========================= Row storage allocator ========================== */
+
+/* Rows, row tree nodes and the buffers hanging from rows are carved out of
+ * big chunks instead of each being a malloc() call of its own. Blocks are
+ * handed out in size classes: a block is taken from the class free list if
+ * possible, otherwise from the end of the current chunk, so rows created one
+ * after the other, like when loading a file, end up next to each other in
+ * memory. Blocks bigger than the largest class come from malloc() but are
+ * tracked as well, so that rowAllocReset() can release everything at once
+ * when the buffer is closed.
+ *
+ * The caller passes the size of the block to rowFree() and rowRealloc(),
+ * the allocator does not store it. Only the main thread may use it. */
+
+static const int rowAllocClassSize[ROWALLOC_CLASSES] = {
+    16,  32,  48,  64,   80,   96,   112,  128,  192,
+    256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096};
+
+/* Header of blocks bigger than the largest class. */
+typedef struct rowBigBlock {
+  struct rowBigBlock *prev, *next;
+} rowBigBlock;
+
+/* Return the size class for 'size' bytes, or -1 if it is too big. */
+int rowAllocClass(size_t size) {
+  if (size <= 128)
+    return size ? (int)(size - 1) / 16 : 0;
+  for (int j = 8; j < ROWALLOC_CLASSES; j++)
+    if (size <= (size_t)rowAllocClassSize[j])
+      return j;
+  return -1;
+}
+
+/* Allocate 'size' bytes of row storage. */
+void *rowAlloc(size_t size) {
+  rowArena *a = &E.arena;
+  int class = rowAllocClass(size);
+  void *p;
+
+  if (class == -1) {
+    rowBigBlock *b = malloc(sizeof(*b) + size);
+    if (b == NULL)
+      goto oom;
+    b->prev = NULL;
+    b->next = a->big;
+    if (a->big)
+      a->big->prev = b;
+    a->big = b;
+    return b + 1;
+  }
+
+  if ((p = a->freelist[class]) != NULL) {
+    a->freelist[class] = *(void **)p;
+    return p;
+  }
+
+  size_t bsize = rowAllocClassSize[class];
+  if (a->chunk == NULL || a->used + bsize > ROWALLOC_CHUNK) {
+    /* Start a new chunk. Its first block links it to the previous one. */
+    char *chunk = malloc(ROWALLOC_CHUNK);
+    if (chunk == NULL)
+      goto oom;
+    *(char **)chunk = a->chunk;
+    a->chunk = chunk;
+    a->used = 16;
+  }
+  p = a->chunk + a->used;
+  a->used += bsize;
+  return p;
+
+oom:
+  perror("Out of memory");
+  exit(1);
+}
+
+/* Release a block of 'size' bytes obtained with rowAlloc(). */
+void rowFree(void *p, size_t size) {
+  rowArena *a = &E.arena;
+  int class = rowAllocClass(size);
+
+  if (p == NULL)
+    return;
+  if (class == -1) {
+    rowBigBlock *b = (rowBigBlock *)p - 1;
+    if (b->prev)
+      b->prev->next = b->next;
+    else
+      a->big = b->next;
+    if (b->next)
+      b->next->prev = b->prev;
+    free(b);
+    return;
+  }
+  *(void **)p = a->freelist[class];
+  a->freelist[class] = p;
+}
+
+/* Resize a block of 'oldsize' bytes to 'newsize' bytes. */
+void *rowRealloc(void *p, size_t oldsize, size_t newsize) {
+  if (p == NULL)
+    return rowAlloc(newsize);
+  int class = rowAllocClass(newsize), oldclass = rowAllocClass(oldsize);
+  if (newsize == oldsize || (class != -1 && class == oldclass))
+    return p;
+  if (class == -1 && oldclass == -1) {
+    /* Still too big for any class: realloc() may resize it in place, then
+     * the neighbours of the block in the list follow it. */
+    rowBigBlock *b = realloc((rowBigBlock *)p - 1, sizeof(*b) + newsize);
+    if (b == NULL) {
+      perror("Out of memory");
+      exit(1);
+    }
+    if (b->prev)
+      b->prev->next = b;
+    else
+      E.arena.big = b;
+    if (b->next)
+      b->next->prev = b;
+    return b + 1;
+  }
+
+  void *new = rowAlloc(newsize);
+  memcpy(new, p, oldsize < newsize ? oldsize : newsize);
+  rowFree(p, oldsize);
+  return new;
+}
+
+/* Release all the row storage at once. */
+void rowAllocReset(void) {
+  rowArena *a = &E.arena;
+
+  while (a->chunk) {
+    char *prev = *(char **)a->chunk;
+    free(a->chunk);
+    a->chunk = prev;
+  }
+  while (a->big) {
+    rowBigBlock *next = a->big->next;
+    free(a->big);
+    a->big = next;
+  }
+  memset(a, 0, sizeof(*a));
+}
+
+/* ============================== Row tree ================================== */
+
+/* Allocate an empty tree node. */
+rowNode *rowTreeNewNode(int leaf) {
+  rowNode *n = rowAlloc(sizeof(*n));
+  memset(n, 0, sizeof(*n));
+  n->leaf = leaf;
+  return n;
+}
+
+/* Release a tree node. */
+void rowTreeFreeNode(rowNode *n) { rowFree(n, sizeof(*n)); }
+
+/* Add 'delta' to the row count of 'n' and of all its ancestors. */
+void rowTreeAddCount(rowNode *n, int delta) {
+  for (; n; n = n->parent)
+    n->count += delta;
+}
+
+/* Return the position of 'child' inside its parent. */
+int rowTreeChildPos(rowNode *child) {
+  rowNode *p = child->parent;
+  int j = 0;
+  while (p->u.nodes[j] != child)
+    j++;
+  return j;
+}
+
+/* Descend to the leaf holding row 'at' and store in *slot the position of the
+ * row inside the leaf. When 'at' is E.numrows the last leaf is returned with
+ * *slot set to its size, which is the right place to append a row.
+ *
+ * In paging mode the row may be in a page that is not loaded: with 'load'
+ * set the page is loaded, otherwise the page node is returned instead of a
+ * leaf. */
+rowNode *rowTreeLookup(int at, int *slot, int load) {
+  rowNode *n = E.rows;
+  while (!n->leaf) {
+    int j;
+    if (n->page) {
+      if (n->page->loaded)
+        rowPageTouch(n->page);
+      else if (load)
+        rowPageLoad(n);
+      else
+        break;
+    }
+    for (j = 0; j < n->n - 1; j++) {
+      if (at < n->u.nodes[j]->count)
+        break;
+      at -= n->u.nodes[j]->count;
+    }
+    n = n->u.nodes[j];
+  }
+  *slot = at;
+  return n;
+}
+
+/* Like rowTreeLookup(), loading the page of the row if needed. */
+rowNode *rowTreeFind(int at, int *slot) { return rowTreeLookup(at, slot, 1); }
+
+/* Move the right half of the full node 'n' into a new sibling, and link the
+ * sibling in the parent, splitting the parent as well if it is full. Returns
+ * the new sibling. */
+rowNode *rowTreeSplit(rowNode *n) {
+  /* Make room in the parent first, so that the counts it computes while
+   * splitting still cover every row below 'n'. */
+  if (n->parent && n->parent->n == ROWTREE_FANOUT)
+    rowTreeSplit(n->parent);
+
+  rowNode *s = rowTreeNewNode(n->leaf);
+  int half = n->n / 2;
+
+  s->n = n->n - half;
+  memcpy(s->u.nodes, n->u.nodes + half, sizeof(s->u.nodes[0]) * s->n);
+  n->n = half;
+  for (int j = 0; j < s->n; j++) {
+    if (s->leaf) {
+      s->u.rows[j]->leaf = s;
+      s->count++;
+    } else {
+      s->u.nodes[j]->parent = s;
+      s->count += s->u.nodes[j]->count;
+    }
+  }
+  n->count -= s->count;
+  if (n->leaf) {
+    s->prev = n;
+    s->next = n->next;
+    if (n->next)
+      n->next->prev = s;
+    n->next = s;
+  }
+
+  if (n->parent == NULL) {
+    /* Splitting the root: the tree grows one level. */
+    rowNode *root = rowTreeNewNode(0);
+    root->n = 2;
+    root->u.nodes[0] = n;
+    root->u.nodes[1] = s;
+    root->count = n->count + s->count;
+    n->parent = s->parent = root;
+    E.rows = root;
+    return s;
+  }
+
+  rowNode *p = n->parent;
+  int pos = rowTreeChildPos(n) + 1;
+  memmove(p->u.nodes + pos + 1, p->u.nodes + pos,
+          sizeof(p->u.nodes[0]) * (p->n - pos));
+  p->u.nodes[pos] = s;
+  p->n++;
+  s->parent = p;
+  return s;
+}
+
+/* Remove the child at position 'pos' of the inner node 'p'. */
+void rowTreeRemoveChild(rowNode *p, int pos) {
+  memmove(p->u.nodes + pos, p->u.nodes + pos + 1,
+          sizeof(p->u.nodes[0]) * (p->n - pos - 1));
+  p->n--;
+}
+
+/* After a deletion, merge 'n' into a neighbour if it became small enough to
+ * fit, and shrink the tree height when the root is left with one child. */
+void rowTreeRebalance(rowNode *n) {
+  while (n->parent) {
+    rowNode *p = n->parent;
+    int pos = rowTreeChildPos(n);
+    rowNode *left, *right;
+
+    if (n->n >= ROWTREE_FANOUT / 4 || p->n < 2)
+      break;
+    if (pos + 1 < p->n) {
+      left = n;
+      right = p->u.nodes[pos + 1];
+    } else {
+      left = p->u.nodes[pos - 1];
+      right = n;
+      pos--;
+    }
+    if (left->n + right->n > ROWTREE_FANOUT || left->page || right->page)
+      break;
+
+    /* Move every child of 'right' at the end of 'left'. */
+    for (int j = 0; j < right->n; j++) {
+      if (left->leaf)
+        right->u.rows[j]->leaf = left;
+      else
+        right->u.nodes[j]->parent = left;
+    }
+    memcpy(left->u.nodes + left->n, right->u.nodes,
+           sizeof(left->u.nodes[0]) * right->n);
+    left->n += right->n;
+    left->count += right->count;
+    left->pristine = 0;
+    if (left->leaf) {
+      left->next = right->next;
+      if (right->next)
+        right->next->prev = left;
+    }
+    rowTreeRemoveChild(p, pos + 1);
+    rowTreeFreeNode(right);
+    n = p;
+  }
+
+  /* Collapse roots with a single child. */
+  while (!E.rows->leaf && E.rows->n == 1) {
+    rowNode *old = E.rows;
+    E.rows = old->u.nodes[0];
+    E.rows->parent = NULL;
+    rowTreeFreeNode(old);
+  }
+}
+
+/* Link 'row' in the tree so that it becomes the row at index 'at'. */
+void rowTreeInsert(int at, erow *row) {
+  int slot;
+  rowNode *leaf = rowTreeFind(at, &slot);
+
+  rowPagePin(leaf->parent);
+  if (leaf->n == ROWTREE_FANOUT) {
+    rowNode *s = rowTreeSplit(leaf);
+    if (slot > leaf->n) {
+      slot -= leaf->n;
+      leaf = s;
+    }
+  }
+  memmove(leaf->u.rows + slot + 1, leaf->u.rows + slot,
+          sizeof(leaf->u.rows[0]) * (leaf->n - slot));
+  leaf->u.rows[slot] = row;
+  leaf->n++;
+  leaf->pristine = 0;
+  row->leaf = leaf;
+  rowTreeAddCount(leaf, 1);
+  E.numrows = E.rows->count;
+  E.hlversion++;
+  E.rowversion++;
+}
+
+/* Unlink the row at index 'at' from the tree and return it. */
+erow *rowTreeRemove(int at) {
+  int slot;
+  rowNode *leaf = rowTreeFind(at, &slot);
+  erow *row = leaf->u.rows[slot];
+
+  rowPagePin(leaf->parent);
+  memmove(leaf->u.rows + slot, leaf->u.rows + slot + 1,
+          sizeof(leaf->u.rows[0]) * (leaf->n - slot - 1));
+  leaf->n--;
+  leaf->pristine = 0;
+  E.hlversion++;
+  E.rowversion++;
+  rowTreeAddCount(leaf, -1);
+  row->leaf = NULL;
+
+  /* Empty leaves are dropped right away, the others only when small enough
+   * to be merged with a neighbour. */
+  if (leaf->n == 0 && leaf->parent) {
+    rowNode *p = leaf->parent;
+    if (leaf->prev)
+      leaf->prev->next = leaf->next;
+    if (leaf->next)
+      leaf->next->prev = leaf->prev;
+    rowTreeRemoveChild(p, rowTreeChildPos(leaf));
+    rowTreeFreeNode(leaf);
+    leaf = p;
+    /* Inner nodes left without children go away as well. */
+    while (leaf->n == 0 && leaf->parent) {
+      p = leaf->parent;
+      rowTreeRemoveChild(p, rowTreeChildPos(leaf));
+      rowTreeFreeNode(leaf);
+      leaf = p;
+    }
+    if (leaf->n == 0) {
+      rowTreeFreeNode(leaf);
+      leaf = E.rows = rowTreeNewNode(1);
+    }
+  }
+  rowTreeRebalance(leaf);
+  E.numrows = E.rows->count;
+  return row;
+}
+
+/* Return the row at index 'at', or NULL if there is no such row. */
+erow *editorRowAt(int at) {
+  int slot;
+
+  if (at < 0 || at >= E.numrows)
+    return NULL;
+  return rowTreeFind(at, &slot)->u.rows[slot];
+}
+
+/* Like editorRowAt(), but returns NULL instead of loading the page of the
+ * row if it is not loaded. */
+erow *editorRowPeek(int at) {
+  int slot;
+  rowNode *n;
+
+  if (at < 0 || at >= E.numrows)
+    return NULL;
+  n = rowTreeLookup(at, &slot, 0);
+  return n->leaf ? n->u.rows[slot] : NULL;
+}
+
+/* Return the index of 'row' in the file, zero-based. */
+int editorRowIndex(erow *row) {
+  rowNode *n = row->leaf;
+  int idx = 0;
+
+  while (n->u.rows[idx] != row)
+    idx++;
+  for (; n->parent; n = n->parent) {
+    rowNode *p = n->parent;
+    for (int j = 0; p->u.nodes[j] != n; j++)
+      idx += p->u.nodes[j]->count;
+  }
+  return idx;
+}
+
+/* Position the iterator on the row at index 'at'. */
+void rowIterInit(rowIter *it, int at) {
+  it->at = at;
+  if (at < 0 || at >= E.numrows) {
+    it->leaf = NULL;
+    it->slot = 0;
+    return;
+  }
+  it->leaf = rowTreeFind(at, &it->slot);
+}
+
+/* Return the row under the iterator and advance to the next one, or NULL
+ * once the end of the file is reached. */
+erow *rowIterNext(rowIter *it) {
+  while (it->leaf && it->slot >= it->leaf->n) {
+    it->leaf = it->leaf->next;
+    it->slot = 0;
+    /* Leaves of different pages are not linked: look the next one up. */
+    if (it->leaf == NULL)
+      rowIterInit(it, it->at);
+  }
+  if (it->leaf == NULL)
+    return NULL;
+  it->at++;
+  return it->leaf->u.rows[it->slot++];
+}
+
+/* Return the leftmost leaf or not loaded page below 'n'. */
+rowNode *rowTreeFirstUnit(rowNode *n) {
+  while (!n->leaf && n->n)
+    n = n->u.nodes[0];
+  return n;
+}
+
+/* Return the leaf or not loaded page that follows 'n' in file order, or NULL
+ * if 'n' is the last one. Walking the tree this way visits the whole content
+ * without loading pages. */
+rowNode *rowTreeNextUnit(rowNode *n) {
+  for (; n->parent; n = n->parent) {
+    int pos = rowTreeChildPos(n);
+    if (pos + 1 < n->parent->n)
+      return rowTreeFirstUnit(n->parent->u.nodes[pos + 1]);
+  }
+  return NULL;
+}
+
+/* Replace the (empty) tree with one built bottom-up out of 'n' leaves already
+ * filled with rows and linked to each other, or 'n' page nodes, in order.
+ * This is how files are loaded: it is linear in the number of rows, instead
+ * of inserting them one by one. The 'nodes' array is used as scratch
+ * space. */
+void rowTreeBuild(rowNode **nodes, int n) {
+  if (n == 0)
+    return;
+  while (n > 1) {
+    int m = 0;
+    for (int j = 0; j < n; j += ROWTREE_FANOUT) {
+      rowNode *p = rowTreeNewNode(0);
+      for (int k = j; k < n && k < j + ROWTREE_FANOUT; k++) {
+        p->u.nodes[p->n++] = nodes[k];
+        p->count += nodes[k]->count;
+        nodes[k]->parent = p;
+      }
+      nodes[m++] = p;
+    }
+    n = m;
+  }
+  rowTreeFreeNode(E.rows);
+  E.rows = nodes[0];
+  E.numrows = E.rows->count;
+}
+
+/* Drop every row and start again with an empty tree. Rows and nodes all
+ * live in the row storage, which is released in bulk. */
+void editorFreeRows(void) {
+  editorHighlightStop();
+  E.gaprow = NULL;
+  E.rxrow = NULL;
+  E.pagelru = E.pagetail = NULL;
+  E.pageloaded = 0;
+  rowAllocReset();
+  E.rows = rowTreeNewNode(1);
+  E.numrows = 0;
+  E.hlstale = INT_MAX;
+  identIndexFree();
+}
+
+/* ======================= Editor rows implementation ======================= */
+
+/* Update the rendered version and the syntax highlight of a row. */
+void editorUpdateRow(erow *row) {
+  editorUpdateRowFrom(row, 0);
+}
+
+/* Like editorUpdateRow(), for a row whose content only changed from offset
+ * 'at' on: the render before it is kept, and only the rest of the row is
+ * rendered again. The render column of the gap start is remembered in
+ * E.rxcol, so that typing or deleting there does not walk the row prefix
+ * again: it is found from E.rxcol when no tab lies between the two offsets.
+ * The syntax highlight is still computed for the whole row, as the lexer
+ * state inside a row is not kept. */
+void editorUpdateRowFrom(erow *row, int at) {
+  unsigned int tabs = 0;
+  int j, idx, tab;
+  /* Content past the gap start is shifted by the gap length, see
+   * editorRowGapReserve(). */
+  int gapstart = row == E.gaprow ? E.gapstart : row->size;
+  int gaplen = row == E.gaprow ? E.gaplen : 0;
+
+  /* Rows rendered before are rendered again because they changed. */
+  if (row->render)
+    E.rowversion++;
+  else
+    at = 0;
+
+  /* Create a version of the row we can directly print on the screen,
+   * respecting tabs, substituting non printable characters with '?'. The
+   * render of the first 'at' chars ends at column 'idx'. */
+  rowFree(row->hl, row->rsize);
+  row->hl = NULL;
+  idx = j = tab = 0;
+  if (row == E.rxrow && at >= E.rxtab) {
+    /* The content before 'at' did not change since E.rxcol was taken. */
+    j = at < E.rxat ? at : E.rxat;
+    idx = E.rxcol - (E.rxat - j);
+    tab = E.rxtab;
+  }
+  for (; j < at; j++) {
+    if (row->chars[j < gapstart ? j : j + gaplen] == TAB) {
+      idx += TAB_SIZE - idx % TAB_SIZE;
+      tab = j + 1;
+    } else {
+      idx++;
+    }
+  }
+  for (j = at; j < row->size; j++)
+    if (row->chars[j < gapstart ? j : j + gaplen] == TAB)
+      tabs++;
+
+  unsigned long long allocsize = (unsigned long long)idx + (row->size - at) +
+                                 tabs * (TAB_SIZE - 1) + 1;
+  if (allocsize > UINT32_MAX) {
+    printf("Some line of the edited file is too long for kilo\n");
+    exit(1);
+  }
+
+  if (at == 0) {
+    rowFree(row->render, row->rsize + 1);
+    row->render = rowAlloc(allocsize);
+  } else {
+    row->render = rowRealloc(row->render, row->rsize + 1, allocsize);
+  }
+  E.rxrow = row;
+  E.rxat = at;
+  E.rxcol = idx;
+  E.rxtab = tab;
+  for (j = at; j < row->size; j++) {
+    char c = row->chars[j < gapstart ? j : j + gaplen];
+    if (j == gapstart) {
+      E.rxat = j;
+      E.rxcol = idx;
+      E.rxtab = tab;
+    }
+    if (c == TAB) {
+      row->render[idx++] = ' ';
+      while (idx % TAB_SIZE != 0)
+        row->render[idx++] = ' ';
+      tab = j + 1;
+    } else {
+      row->render[idx++] = c;
+    }
+  }
+  if (gapstart == row->size && gapstart >= at) {
+    E.rxat = gapstart;
+    E.rxcol = idx;
+    E.rxtab = tab;
+  }
+  row->render[idx] = '\0';
+  /* The rendered size is what render and hl are released with, so shrink
+   * render to it. */
+  row->render = rowRealloc(row->render, allocsize, idx + 1);
+  row->rsize = idx;
+
+  /* Update the syntax highlighting attributes of the row. */
+  editorUpdateSyntax(row);
+}
+
+/* Create a row with the given content, not yet linked in the tree. With
+ * ROW_VIEW in 'flags' the row just points to 's', that must be inside
+ * E.orig, otherwise it gets its own copy. */
+erow *editorAllocRow(char *s, size_t len, int flags) {
+  erow *row = rowAlloc(sizeof(erow));
+  row->size = len;
+  if (flags & ROW_VIEW) {
+    row->chars = s;
+  } else {
+    row->chars = rowAlloc(len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+  }
+  row->flags = flags;
+  row->hl = NULL;
+  row->hl_oc = 0;
+  row->render = NULL;
+  row->rsize = 0;
+  row->leaf = NULL;
+  return row;
+}
+
+/* Create a row with the given content and link it at the specified position,
+ * see editorAllocRow(). */
+erow *editorNewRow(int at, char *s, size_t len, int flags) {
+  erow *row = editorAllocRow(s, len, flags);
+  rowTreeInsert(at, row);
+  return row;
+}
+
+/* Insert a row at the specified position, shifting the other rows on the bottom
+ * if required. */
+void editorInsertRow(int at, char *s, size_t len) {
+  if (at > E.numrows)
+    return;
+  editorJournalRecord(JOURNAL_INSERT_ROW, at, 0, s, len);
+  if (at <= E.hlstale && E.hlstale != INT_MAX)
+    E.hlstale++;
+  erow *row = editorNewRow(at, s, len, 0);
+  editorUpdateRow(row);
+  identIndexRowAdded(row);
+  E.dirty++;
+}
+
+/* Give a row pointing into the original file its own copy of the content,
+ * so that it can be modified. Must be called before changing 'chars'. */
+void editorRowMakeOwned(erow *row) {
+  if (!(row->flags & ROW_VIEW))
+    return;
+  if (row->leaf) {
+    rowPagePin(row->leaf->parent);
+    row->leaf->pristine = 0;
+  }
+  char *chars = rowAlloc(row->size + 1);
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+  row->chars = chars;
+  row->flags &= ~ROW_VIEW;
+}
+
+/* The row being edited is kept as a gap buffer, so that typing in the middle
+ * of a long line does not move its whole tail at every keystroke. Its first
+ * E.gapstart bytes are at the start of 'chars', then come E.gaplen unused
+ * bytes, then the rest of the content. Only one row at a time is in this
+ * form: it goes back to a flat null terminated string with
+ * editorRowGapClose() when the cursor leaves it, or before some code needs
+ * 'chars' to be contiguous. */
+
+/* Return the character at offset 'at' of the row, skipping the gap. */
+char editorRowCharAt(erow *row, int at) {
+  if (row == E.gaprow && at >= E.gapstart)
+    at += E.gaplen;
+  return row->chars[at];
+}
+
+/* Return the column of render matching the char at offset 'at' of a row. */
+int editorRowRenderCol(erow *row, int at) {
+  int col = 0;
+
+  for (int j = 0; j < at && j < row->size; j++) {
+    col++;
+    if (editorRowCharAt(row, j) == TAB)
+      while (col % TAB_SIZE != 0)
+        col++;
+  }
+  return col;
+}
+
+/* Turn the gap buffer row, if any, back into a flat string. */
+void editorRowGapClose(void) {
+  erow *row = E.gaprow;
+
+  if (row == NULL)
+    return;
+  memmove(row->chars + E.gapstart, row->chars + E.gapstart + E.gaplen,
+          row->size - E.gapstart);
+  row->chars[row->size] = '\0';
+  row->chars = rowRealloc(row->chars, row->size + E.gaplen + 1, row->size + 1);
+  E.gaprow = NULL;
+  E.gapstart = E.gaplen = 0;
+}
+
+/* Make 'row' the gap buffer row, with the gap moved at offset 'at' and at
+ * least 'need' bytes long. The allocation of 'chars' is always the size of
+ * the content plus the gap plus one, so that closing the gap leaves room for
+ * the null term. */
+void editorRowGapReserve(erow *row, int at, int need) {
+  if (row != E.gaprow) {
+    editorRowGapClose();
+    editorRowMakeOwned(row);
+    E.gaprow = row;
+    E.gapstart = row->size;
+    E.gaplen = 0;
+  }
+
+  /* Moving the gap only costs the distance it travels, which is small when
+   * typing or deleting chars one after the other. */
+  if (at < E.gapstart)
+    memmove(row->chars + at + E.gaplen, row->chars + at, E.gapstart - at);
+  else if (at > E.gapstart)
+    memmove(row->chars + E.gapstart, row->chars + E.gapstart + E.gaplen,
+            at - E.gapstart);
+  E.gapstart = at;
+
+  /* Grow the gap proportionally to the row, so inserts are amortized O(1). */
+  if (E.gaplen < need) {
+    int grow = need + 16 + row->size / 2;
+    int tail = row->size - E.gapstart;
+    row->chars = rowRealloc(row->chars, row->size + E.gaplen + 1,
+                            row->size + E.gaplen + grow + 1);
+    memmove(row->chars + E.gapstart + E.gaplen + grow,
+            row->chars + E.gapstart + E.gaplen, tail);
+    E.gaplen += grow;
+  }
+}
+
+/* Free row's heap allocated stuff. Owned chars are always size + 1 bytes,
+ * plus the gap for the gap buffer row. */
+void editorFreeRow(erow *row) {
+  int gaplen = 0;
+  if (row == E.rxrow)
+    E.rxrow = NULL;
+  if (row == E.gaprow) {
+    gaplen = E.gaplen;
+    E.gaprow = NULL;
+  }
+  rowFree(row->render, row->rsize + 1);
+  if (!(row->flags & ROW_VIEW))
+    rowFree(row->chars, row->size + gaplen + 1);
+  rowFree(row->hl, row->rsize);
+}
+
+/* Remove the row at the specified position, shifting the remainign on the
+ * top. */
+void editorDelRow(int at) {
+  erow *row;
+
+  if (at < 0 || at >= E.numrows)
+    return;
+  editorJournalRecord(JOURNAL_DEL_ROW, at, 0, NULL, 0);
+  if (E.idents.built)
+    identIndexRowRemoved(editorRowAt(at));
+  row = rowTreeRemove(at);
+  editorFreeRow(row);
+  rowFree(row, sizeof(*row));
+  /* The next row now follows a different one: its syntax state may change. */
+  if (at < E.hlstale && E.hlstale != INT_MAX)
+    E.hlstale--;
+  if (E.syntax)
+    editorSyntaxChanged(at);
+  E.dirty++;
+}
+
+/* Insert a character at the specified position in a row, moving the remaining
+ * chars on the right if needed. */
+void editorRowInsertChar(erow *row, int at, int c) {
+  if (row == NULL)
+    return;
+  char ch = c;
+  editorJournalRecord(JOURNAL_INSERT_CHAR, editorRowIndex(row), at, &ch, 1);
+  identIndexRowBegin(row);
+  int from = at < row->size ? at : row->size;
+
+  if (at > row->size) {
+    /* Pad the string with spaces if the insert location is outside the
+     * current length by more than a single character. */
+    int padlen = at - row->size;
+    editorRowGapReserve(row, row->size, padlen + 1);
+    memset(row->chars + E.gapstart, ' ', padlen);
+    E.gapstart += padlen;
+    E.gaplen -= padlen;
+    row->size += padlen;
+  } else {
+    editorRowGapReserve(row, at, 1);
+  }
+  row->chars[E.gapstart++] = c;
+  E.gaplen--;
+  row->size++;
+  editorUpdateRowFrom(row, from);
+  identIndexRowEnd(row);
+  E.dirty++;
+}
+
+/* Append the string 's' at the end of a row */
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorJournalRecord(JOURNAL_APPEND, editorRowIndex(row), 0, s, len);
+  identIndexRowBegin(row);
+  editorRowGapReserve(row, row->size, len);
+  memcpy(row->chars + E.gapstart, s, len);
+  E.gapstart += len;
+  E.gaplen -= len;
+  row->size += len;
+  editorUpdateRowFrom(row, row->size - len);
+  identIndexRowEnd(row);
+  E.dirty++;
+}
+
+/* Delete the character at offset 'at' from the specified row. */
+void editorRowDelChar(erow *row, int at) {
+  if (row->size <= at)
+    return;
+  editorJournalRecord(JOURNAL_DEL_CHAR, editorRowIndex(row), at, NULL, 0);
+  identIndexRowBegin(row);
+  /* With the gap just before the char, deleting it is growing the gap. */
+  editorRowGapReserve(row, at, 0);
+  E.gaplen++;
+  row->size--;
+  editorUpdateRowFrom(row, at);
+  identIndexRowEnd(row);
+  E.dirty++;
+}
+
+/* Drop the content of the row from offset 'at' to the end. */
+void editorRowTruncate(erow *row, int at) {
+  if (row->size <= at)
+    return;
+  editorJournalRecord(JOURNAL_TRUNCATE, editorRowIndex(row), at, NULL, 0);
+  identIndexRowBegin(row);
+  if (row == E.gaprow)
+    editorRowGapClose();
+  editorRowMakeOwned(row);
+  row->chars = rowRealloc(row->chars, row->size + 1, at + 1);
+  row->chars[at] = '\0';
+  row->size = at;
+  editorUpdateRowFrom(row, at);
+  identIndexRowEnd(row);
+  E.dirty++;
+}
+
+/* Replace the whole content of a row with the 'len' bytes at 's'. */
+void editorRowSetChars(erow *row, const char *s, size_t len) {
+  editorJournalRecord(JOURNAL_SET_ROW, editorRowIndex(row), 0, s, len);
+  identIndexRowBegin(row);
+  if (row == E.gaprow)
+    editorRowGapClose();
+  editorRowMakeOwned(row);
+  row->chars = rowRealloc(row->chars, row->size + 1, len + 1);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  row->size = len;
+  editorUpdateRow(row);
+  identIndexRowEnd(row);
+  E.dirty++;
+}
+
+/* Insert the specified char at the current prompt position. */
+void editorInsertChar(int c) {
+  int filerow = E.rowoff + E.cy;
+  int filecol = E.coloff + E.cx;
+  erow *row = editorRowAt(filerow);
 
   /* If the row where the cursor is currently located does not exist in our
    * logical representaion of the file, add enough empty rows as needed. */
@@ -682,7 +2239,7 @@ void editorInsertChar(int c) {
     while (E.numrows <= filerow)
       editorInsertRow(E.numrows, "", 0);
   }
-  row = &E.row[filerow];
+  row = editorRowAt(filerow);
   /* Save insert operation for undo */
   pushUndoOp(UNDO_INSERT_CHAR, filerow, filecol, NULL, 0);
   editorRowInsertChar(row, filecol, c);
@@ -698,7 +2255,7 @@ void editorInsertChar(int c) {
 void editorInsertNewline(void) {
   int filerow = E.rowoff + E.cy;
   int filecol = E.coloff + E.cx;
-  erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
+  erow *row = editorRowAt(filerow);
 
   if (!row) {
     if (filerow == E.numrows) {
@@ -715,11 +2272,9 @@ void editorInsertNewline(void) {
     editorInsertRow(filerow, "", 0);
   } else {
     /* We are in the middle of a line. Split it between two rows. */
+    editorRowGapClose();
     editorInsertRow(filerow + 1, row->chars + filecol, row->size - filecol);
-    row = &E.row[filerow];
-    row->chars[filecol] = '\0';
-    row->size = filecol;
-    editorUpdateRow(row);
+    editorRowTruncate(editorRowAt(filerow), filecol);
   }
 fixcursor:
   if (E.cy == E.screenrows - 1) {
@@ -735,15 +2290,17 @@ fixcursor:
 void editorDelChar(void) {
   int filerow = E.rowoff + E.cy;
   int filecol = E.coloff + E.cx;
-  erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
+  erow *row = editorRowAt(filerow);
 
   if (!row || (filecol == 0 && filerow == 0))
     return;
   if (filecol == 0) {
     /* Handle the case of column 0, we need to move the current line
      * on the right of the previous one. */
-    filecol = E.row[filerow - 1].size;
-    editorRowAppendString(&E.row[filerow - 1], row->chars, row->size);
+    erow *prev = editorRowAt(filerow - 1);
+    filecol = prev->size;
+    editorRowGapClose();
+    editorRowAppendString(prev, row->chars, row->size);
     editorDelRow(filerow);
     row = NULL;
     if (E.cy == 0)
@@ -759,7 +2316,7 @@ void editorDelChar(void) {
   } else {
     /* Save character for undo before deleting */
     if (filecol > 0 && filecol <= row->size) {
-      char deleted_char = row->chars[filecol - 1];
+      char deleted_char = editorRowCharAt(row, filecol - 1);
       pushUndoOp(UNDO_DELETE_CHAR, filerow, filecol - 1, &deleted_char, 1);
     }
     editorRowDelChar(row, filecol - 1);
@@ -768,8 +2325,6 @@ void editorDelChar(void) {
     else
       E.cx--;
   }
-  if (row)
-    editorUpdateRow(row);
   E.dirty++;
 }
 
@@ -777,7 +2332,7 @@ void editorDelChar(void) {
 void editorForwardDelChar(void) {
   int filerow = E.rowoff + E.cy;
   int filecol = E.coloff + E.cx;
-  erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
+  erow *row = editorRowAt(filerow);
 
   if (!row)
     return;
@@ -789,8 +2344,9 @@ void editorForwardDelChar(void) {
   // If the cursor is at the end of a line (not the last one),
   // we need to merge the next line with the current one.
   if (filecol >= row->size) {
-    erow *next_row = &E.row[filerow + 1];
+    erow *next_row = editorRowAt(filerow + 1);
     // Append the content of the next line to the current one.
+    editorRowGapClose();
     editorRowAppendString(row, next_row->chars, next_row->size);
     // Delete the next line.
     editorDelRow(filerow + 1);
@@ -801,108 +2357,1473 @@ void editorForwardDelChar(void) {
   }
 }
 
-/* Load the specified program in the editor memory and returns 0 on success
- * or 1 on error. */
-int editorOpen(char *filename) {
-  FILE *fp;
-
-  E.dirty = 0;
-  free(E.filename);
-  size_t fnlen = strlen(filename) + 1;
-  E.filename = malloc(fnlen);
-  memcpy(E.filename, filename, fnlen);
+/* Release the original file content. No row must point into it anymore. */
+void editorCloseOrig(void) {
+  editorHighlightStop(); /* It may be reading E.orig. */
+  editorSearchStop();    /* Likewise. */
+  if (E.orig.mapped) {
+    munmap(E.orig.base, E.orig.len);
+    close(E.orig.fd);
+  } else {
+    free(E.orig.base);
+  }
+  E.orig.base = NULL;
+  E.orig.len = 0;
+  E.orig.mapped = 0;
+  E.orig.lost = 0;
+}
 
-  fp = fopen(filename, "r");
-  if (!fp) {
+/* Rows not modified since loading are views of the file, mapped privately:
+ * if another program rewrites it they change with it, and if it truncates
+ * it reading what is past the new end raises SIGBUS. The handler maps a
+ * page of zeros there instead, so that the read goes on. Faults anywhere
+ * else still kill the process. */
+void handleSigBus(int sig, siginfo_t *info, void *ctx) {
+  char *addr = info->si_addr;
+  uintptr_t page = (uintptr_t)addr & ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+
+  (void)ctx;
+  if (E.orig.mapped && addr >= E.orig.base &&
+      addr < E.orig.base + E.orig.len &&
+      mmap((void *)page, sysconf(_SC_PAGESIZE), PROT_READ,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+    E.orig.lost = 1;
+    return;
+  }
+  signal(sig, SIG_DFL); /* Faults again once returning, and dies. */
+}
+
+/* Check whether the file E.orig maps changed since it was loaded or saved,
+ * warning once per change. Returns 1 if it did. */
+int editorOrigCheck(void) {
+  struct stat st;
+
+  if (!E.orig.mapped || fstat(E.orig.fd, &st) == -1)
+    return 0;
+  if (st.st_size == E.orig.st.st_size && !E.orig.lost &&
+      st.st_mtim.tv_sec == E.orig.st.st_mtim.tv_sec &&
+      st.st_mtim.tv_nsec == E.orig.st.st_mtim.tv_nsec)
+    return 0;
+  if ((size_t)st.st_size < E.orig.len || E.orig.lost)
+    editorSetStatusMessage("File truncated by another program: what it "
+                           "lost reads as zeros");
+  else
+    editorSetStatusMessage("File changed by another program: unedited rows "
+                           "may show its changes");
+  E.orig.st = st;
+  E.orig.lost = 0;
+  return 1;
+}
+
+/* Load the content of 'fd' in E.orig. Regular files are mapped read-only, so
+ * that opening costs nothing but the row index, and 'fd' is kept open to
+ * copy from it when saving; anything else (pipes, special files, or a
+ * failing mmap()) is read in memory. Returns 0 on success, -1 on error. */
+int editorLoadOrig(int fd) {
+  struct stat st;
+
+  if (fstat(fd, &st) == -1)
+    return -1;
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      E.orig.base = map;
+      E.orig.len = st.st_size;
+      E.orig.mapped = 1;
+      E.orig.fd = fd;
+      E.orig.st = st;
+      return 0;
+    }
+  }
+
+  char *buf = NULL;
+  size_t len = 0, cap = 0;
+  ssize_t nread;
+  do {
+    if (len == cap) {
+      cap = cap ? cap * 2 : 65536;
+      buf = realloc(buf, cap);
+    }
+    nread = read(fd, buf + len, cap - len);
+    if (nread > 0)
+      len += nread;
+  } while (nread > 0 || (nread == -1 && errno == EINTR));
+  if (nread == -1) {
+    free(buf);
+    return -1;
+  }
+  E.orig.base = buf;
+  E.orig.len = len;
+  E.orig.mapped = 0;
+  return 0;
+}
+
+/* Point every row to its content inside 'base', which must hold the rows
+ * separated by newlines exactly as editorSave() writes them, and
+ * make 'base' the new original content. Rows owning their content release
+ * it. 'base' is a mapping of 'fd', or in the heap if 'fd' is -1. */
+void editorRebaseRows(char *base, size_t len, int fd) {
+  char *p = base;
+
+  editorRowGapClose();
+  for (rowNode *u = rowTreeFirstUnit(E.rows); u; u = rowTreeNextUnit(u)) {
+    if (!u->leaf) {
+      /* A page that is not loaded, saved as it was. */
+      int addnl;
+      size_t saved = rowPageSavedLen(u->page, &addnl);
+      u->page->off = p - base;
+      u->page->len = saved + (addnl ? 1 + E.crlf : 0);
+      p += u->page->len;
+      continue;
+    }
+
+    rowPage *pg = u->parent ? u->parent->page : NULL;
+    if (pg && u->parent->u.nodes[0] == u)
+      pg->off = p - base;
+    for (int j = 0; j < u->n; j++) {
+      erow *row = u->u.rows[j];
+      if (!(row->flags & ROW_VIEW))
+        rowFree(row->chars, row->size + 1);
+      row->chars = p;
+      row->flags |= ROW_VIEW;
+      p += row->size + 1 + E.crlf;
+    }
+    u->pristine = 1;
+    if (pg && u->parent->u.nodes[u->parent->n - 1] == u)
+      pg->len = p - base - pg->off;
+  }
+  editorCloseOrig();
+  E.orig.base = base;
+  E.orig.len = len;
+  E.orig.mapped = fd != -1;
+  E.orig.fd = fd;
+  if (fd != -1)
+    fstat(fd, &E.orig.st);
+}
+
+/* Move the original content from its mapping to memory, for when the file
+ * is about to be overwritten in place. */
+void editorOrigToMemory(void) {
+  char *base = malloc(E.orig.len), *old = E.orig.base;
+  size_t len = E.orig.len;
+
+  if (base == NULL) {
+    perror("Out of memory");
+    exit(1);
+  }
+  memcpy(base, old, len);
+  editorRowGapClose();
+  for (rowNode *u = rowTreeFirstUnit(E.rows); u; u = rowTreeNextUnit(u)) {
+    if (!u->leaf)
+      continue; /* Pages only know their offset. */
+    for (int j = 0; j < u->n; j++) {
+      erow *row = u->u.rows[j];
+      if (row->flags & ROW_VIEW)
+        row->chars = base + (row->chars - old);
+    }
+  }
+  editorCloseOrig();
+  E.orig.base = base;
+  E.orig.len = len;
+  E.orig.mapped = 0;
+}
+
+/* ============================ Line indexing =============================== */
+
+/* Append 'off', the offset of a newline in 'buf', to the line index,
+ * unless it is a newline to skip. */
+void lineIndexAdd(lineIndex *li, const char *buf, size_t off) {
+  li->lines++;
+  if (off && buf[off - 1] == '\r')
+    li->crlf++;
+  li->last = off;
+  if (li->skip) {
+    li->skip--;
+    return;
+  }
+  if (li->stride > 1)
+    li->skip = li->stride - 1;
+
+  if (li->count == li->cap) {
+    li->cap = li->cap ? li->cap * 2 : 1024;
+    li->nl = realloc(li->nl, sizeof(size_t) * li->cap);
+    if (li->nl == NULL) {
+      perror("Out of memory");
+      exit(1);
+    }
+  }
+  li->nl[li->count++] = off;
+}
+
+/* Append to the index the offset of every newline in buf[from..to). Bytes
+ * are compared 32 (AVX2) or 16 (SSE2) at a time and matches come out as a
+ * bit mask, so short lines cost no more than long ones. The tail, and the
+ * whole range on other architectures, goes through memchr(). */
+void lineIndexScan(lineIndex *li, const char *buf, size_t from, size_t to) {
+  size_t j = from;
+
+#if defined(__AVX2__)
+  const __m256i nl = _mm256_set1_epi8('\n');
+  for (; j + 32 <= to; j += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(buf + j));
+    unsigned int mask =
+        (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+    while (mask) {
+      lineIndexAdd(li, buf, j + __builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; j + 16 <= to; j += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(buf + j));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    while (mask) {
+      lineIndexAdd(li, buf, j + __builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  while (j < to) {
+    const char *p = memchr(buf + j, '\n', to - j);
+    if (p == NULL)
+      break;
+    lineIndexAdd(li, buf, p - buf);
+    j = p - buf + 1;
+  }
+}
+
+/* One range of the buffer indexed by a worker thread. */
+typedef struct lineIndexJob {
+  pthread_t tid;
+  const char *buf;
+  size_t from, to;
+  lineIndex li;
+  int started;
+} lineIndexJob;
+
+/* Return how many threads should share the work on 'len' bytes: one for
+ * less than 'min' bytes, else E.indexthreads, or one per CPU if not set. */
+int editorThreadCount(size_t len, size_t min) {
+  int nthreads = E.indexthreads;
+
+  if (nthreads <= 0)
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > KILO_INDEX_MAX_THREADS)
+    nthreads = KILO_INDEX_MAX_THREADS;
+  if (nthreads < 2 || len < min || len < (size_t)nthreads)
+    nthreads = 1;
+  return nthreads;
+}
+
+void *lineIndexWorker(void *arg) {
+  lineIndexJob *job = arg;
+  lineIndexScan(&job->li, job->buf, job->from, job->to);
+  return NULL;
+}
+
+/* Scan buf[0..len) for newlines with one job per range, each keeping one
+ * newline every 'stride' in its own index. Large buffers are split in equal
+ * ranges, one per thread; a range whose thread could not be started is
+ * scanned by the caller. Returns the number of jobs. */
+int lineIndexRun(lineIndexJob *jobs, const char *buf, size_t len,
+                 size_t stride) {
+  int nthreads = editorThreadCount(len, E.indexmin);
+
+  size_t chunk = len / nthreads;
+  for (int j = 0; j < nthreads; j++) {
+    lineIndexJob *job = jobs + j;
+    job->buf = buf;
+    job->from = chunk * j;
+    job->to = j == nthreads - 1 ? len : chunk * (j + 1);
+    memset(&job->li, 0, sizeof(job->li));
+    job->li.stride = stride;
+    job->li.skip = stride > 1 ? stride - 1 : 0;
+    job->started =
+        j > 0 && pthread_create(&job->tid, NULL, lineIndexWorker, job) == 0;
+  }
+  /* The first range, and any range without a thread, is ours. */
+  for (int j = 0; j < nthreads; j++) {
+    if (jobs[j].started)
+      pthread_join(jobs[j].tid, NULL);
+    else
+      lineIndexWorker(jobs + j);
+  }
+  return nthreads;
+}
+
+/* Index the newlines of the whole buffer, appending them to 'li'. The
+ * offsets found by every job are concatenated: ranges are in order, so the
+ * result is sorted as well. */
+void lineIndexBuild(lineIndex *li, const char *buf, size_t len) {
+  lineIndexJob jobs[KILO_INDEX_MAX_THREADS];
+  int njobs = lineIndexRun(jobs, buf, len, 1);
+  size_t total = li->count;
+
+  if (njobs == 1 && li->nl == NULL) {
+    *li = jobs[0].li;
+    return;
+  }
+  for (int j = 0; j < njobs; j++)
+    total += jobs[j].li.count;
+  if (total > li->cap) {
+    li->nl = realloc(li->nl, sizeof(size_t) * total);
+    if (li->nl == NULL) {
+      perror("Out of memory");
+      exit(1);
+    }
+    li->cap = total;
+  }
+  for (int j = 0; j < njobs; j++) {
+    if (jobs[j].li.count)
+      memcpy(li->nl + li->count, jobs[j].li.nl,
+             sizeof(size_t) * jobs[j].li.count);
+    li->count += jobs[j].li.count;
+    li->lines += jobs[j].li.lines;
+    li->crlf += jobs[j].li.crlf;
+    free(jobs[j].li.nl);
+  }
+}
+
+/* Create a row viewing every line of E.orig[start..end), given the offsets
+ * of its newlines, and group the rows in full leaves linked to each other.
+ * The leaves are stored in 'leaves', that must have room for
+ * li->count / ROWTREE_FANOUT + 2 of them. Returns the number of leaves.
+ *
+ * With E.crlf set the lines end with \r\n: the \r is not part of the rows
+ * and is written back on save. Otherwise a \r ending a line stays in its
+ * row, as with files mixing both endings. */
+int editorLoadLeaves(lineIndex *li, size_t start, size_t end,
+                     rowNode **leaves) {
+  char *base = E.orig.base;
+  rowNode *leaf = NULL;
+  int nleaves = 0;
+
+  for (size_t j = 0; j <= li->count; j++) {
+    size_t stop = j < li->count ? li->nl[j] : end;
+    if (j == li->count && start == stop)
+      break; /* Nothing after the last newline. */
+    size_t len = stop - start;
+    if (E.crlf && len && base[start + len - 1] == '\r')
+      len--;
+
+    if (leaf == NULL || leaf->n == ROWTREE_FANOUT) {
+      rowNode *prev = leaf;
+      leaf = rowTreeNewNode(1);
+      leaf->pristine = 1;
+      leaf->prev = prev;
+      if (prev)
+        prev->next = leaf;
+      leaves[nleaves++] = leaf;
+    }
+    erow *row = editorAllocRow(base + start, len, ROW_VIEW);
+    row->leaf = leaf;
+    leaf->u.rows[leaf->n++] = row;
+    leaf->count++;
+    start = stop + 1;
+  }
+  return nleaves;
+}
+
+/* Create a row viewing every line of E.orig and build the row tree out of
+ * them in one go. Returns -1 without creating anything if there are more
+ * than E.maxrows lines. */
+int editorLoadRows(void) {
+  lineIndex li;
+
+  memset(&li, 0, sizeof(li));
+  lineIndexBuild(&li, E.orig.base, E.orig.len);
+  if (li.lines >= (size_t)E.maxrows) {
+    free(li.nl);
+    return -1;
+  }
+  E.crlf = li.lines && li.crlf == li.lines;
+  rowNode **leaves = malloc(sizeof(rowNode *) * (li.count / ROWTREE_FANOUT + 2));
+  rowTreeBuild(leaves, editorLoadLeaves(&li, 0, E.orig.len, leaves));
+  free(leaves);
+  free(li.nl);
+  return 0;
+}
+
+/* ================================ Paging ================================== */
+
+/* Remove a loaded page from the LRU list. */
+void rowPageUnlink(rowPage *pg) {
+  if (pg->prev)
+    pg->prev->next = pg->next;
+  else
+    E.pagelru = pg->next;
+  if (pg->next)
+    pg->next->prev = pg->prev;
+  else
+    E.pagetail = pg->prev;
+  pg->prev = pg->next = NULL;
+}
+
+/* Put a loaded page at the head of the LRU list. */
+void rowPagePush(rowPage *pg) {
+  pg->prev = NULL;
+  pg->next = E.pagelru;
+  if (E.pagelru)
+    E.pagelru->prev = pg;
+  else
+    E.pagetail = pg;
+  E.pagelru = pg;
+}
+
+/* Mark a loaded page as the most recently used. */
+void rowPageTouch(rowPage *pg) {
+  if (E.pagelru == pg)
+    return;
+  rowPageUnlink(pg);
+  rowPagePush(pg);
+}
+
+/* Create the node of a page of 'lines' lines, E.orig[start..end). */
+rowNode *rowPageNew(size_t start, size_t end, int lines) {
+  rowNode *n = rowTreeNewNode(0);
+  rowPage *pg = rowAlloc(sizeof(*pg));
+
+  memset(pg, 0, sizeof(*pg));
+  pg->node = n;
+  pg->off = start;
+  pg->len = end - start;
+  n->page = pg;
+  n->count = lines;
+  return n;
+}
+
+/* Create the rows of the page of node 'n'. If this makes too many pages
+ * loaded, the least recently used ones are evicted. */
+void rowPageLoad(rowNode *n) {
+  rowPage *pg = n->page;
+  rowNode *leaves[ROWTREE_FANOUT + 2];
+  lineIndex li;
+
+  memset(&li, 0, sizeof(li));
+  lineIndexScan(&li, E.orig.base, pg->off, pg->off + pg->len);
+  n->n = editorLoadLeaves(&li, pg->off, pg->off + pg->len, leaves);
+  free(li.nl);
+  for (int j = 0; j < n->n; j++) {
+    n->u.nodes[j] = leaves[j];
+    leaves[j]->parent = n;
+  }
+  pg->loaded = 1;
+  rowPagePush(pg);
+  E.pageloaded++;
+  while (E.pageloaded > E.pagemax && E.pagetail != pg)
+    rowPageEvict(E.pagetail->node);
+}
+
+/* Drop the rows of the loaded page of node 'n', remembering the syntax state
+ * at its end for the page that follows. */
+void rowPageEvict(rowNode *n) {
+  rowPage *pg = n->page;
+
+  for (int j = 0; j < n->n; j++) {
+    rowNode *leaf = n->u.nodes[j];
+    for (int k = 0; k < leaf->n; k++) {
+      erow *row = leaf->u.rows[k];
+      if (j == n->n - 1 && k == leaf->n - 1 && row->flags & ROW_HL_STATE)
+        pg->hl_oc = row->hl_oc;
+      editorFreeRow(row);
+      rowFree(row, sizeof(*row));
+    }
+    rowTreeFreeNode(leaf);
+  }
+  n->n = 0;
+  pg->loaded = 0;
+  rowPageUnlink(pg);
+  E.pageloaded--;
+}
+
+/* Called before modifying the rows below 'n': if it is a page, it becomes
+ * a regular node that is never evicted. */
+void rowPagePin(rowNode *n) {
+  if (n == NULL || n->page == NULL)
+    return;
+  if (n->page->loaded) {
+    rowPageUnlink(n->page);
+    E.pageloaded--;
+  }
+  rowFree(n->page, sizeof(rowPage));
+  n->page = NULL;
+}
+
+/* Build the tree of a file opened in paging mode: one node per page,
+ * without creating any row. Only every KILO_PAGE_LINES-th newline is kept
+ * while scanning, plus the last one of every range scanned by a thread, so
+ * that pages never span two ranges. Returns -1 like editorLoadRows(). */
+int editorLoadPages(void) {
+  lineIndexJob jobs[KILO_INDEX_MAX_THREADS];
+  int njobs = lineIndexRun(jobs, E.orig.base, E.orig.len, KILO_PAGE_LINES);
+  size_t npages = 1, start = 0;
+
+  size_t lines = 0, crlf = 0;
+
+  for (int j = 0; j < njobs; j++) {
+    npages += jobs[j].li.count + 1;
+    lines += jobs[j].li.lines;
+    crlf += jobs[j].li.crlf;
+  }
+  if (lines >= (size_t)E.maxrows) {
+    for (int j = 0; j < njobs; j++)
+      free(jobs[j].li.nl);
+    return -1;
+  }
+  E.crlf = lines && crlf == lines;
+  rowNode **nodes = malloc(sizeof(rowNode *) * npages);
+  int n = 0;
+  for (int j = 0; j < njobs; j++) {
+    lineIndex *li = &jobs[j].li;
+    for (size_t k = 0; k < li->count; k++) {
+      nodes[n++] = rowPageNew(start, li->nl[k] + 1, KILO_PAGE_LINES);
+      start = li->nl[k] + 1;
+    }
+    if (li->lines % KILO_PAGE_LINES) {
+      nodes[n++] = rowPageNew(start, li->last + 1, li->lines % KILO_PAGE_LINES);
+      start = li->last + 1;
+    }
+    free(li->nl);
+  }
+  if (start < E.orig.len)
+    nodes[n++] = rowPageNew(start, E.orig.len, 1);
+  rowTreeBuild(nodes, n);
+  free(nodes);
+  return 0;
+}
+
+/* Return how many bytes of the page 'pg', that is not loaded, are saved as
+ * they are. Only the last page of the file may not end with a newline: then
+ * *addnl is set, as the caller must write one, and with E.crlf set a \r
+ * before it is not saved, just like for the last row. */
+size_t rowPageSavedLen(rowPage *pg, int *addnl) {
+  char *s = E.orig.base + pg->off;
+  size_t len = pg->len;
+
+  *addnl = !(len && s[len - 1] == '\n');
+  if (*addnl && E.crlf && len && s[len - 1] == '\r')
+    len--;
+  return len;
+}
+
+/* Load the specified program in the editor memory and returns 0 on success
+ * or 1 on error. */
+int editorOpen(char *filename) {
+  int fd;
+
+  editorSavePoll(1);
+  E.dirty = 0;
+  free(E.filename);
+  size_t fnlen = strlen(filename) + 1;
+  E.filename = malloc(fnlen);
+  memcpy(E.filename, filename, fnlen);
+  editorFreeRows();
+  editorCloseOrig();
+
+  fd = open(filename, O_RDONLY);
+  if (fd == -1) {
     if (errno != ENOENT) {
       perror("Opening file");
       exit(1);
     }
+    editorJournalOpen();
     return 1;
   }
+  if (editorLoadOrig(fd) == -1) {
+    perror("Reading file");
+    exit(1);
+  }
+  if (!E.orig.mapped)
+    close(fd);
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    if (linelen && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      line[--linelen] = '\0';
-    editorInsertRow(E.numrows, line, linelen);
+  /* Rows are just views inside the original content. If every line ends
+   * with \r\n, the file is taken to use \r\n line endings. */
+  E.paging = E.orig.len >= E.pagingmin;
+  if ((E.paging ? editorLoadPages() : editorLoadRows()) == -1) {
+    /* Rows are counted with an int. */
+    fprintf(stderr, "%s has more than %d lines, too many to edit\n",
+            filename, E.maxrows - 1);
+    exit(1);
   }
-  free(line);
-  fclose(fp);
   E.dirty = 0;
+  editorJournalOpen();
   return 0;
 }
 
-/* Save the current file on disk. Return 0 on success, 1 on error. */
-int editorSave(void) {
-  int len;
-  char *buf = editorRowsToString(&len);
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd == -1)
+/* Saving works on a snapshot of the content, see saveSnapshot in kilo.h, so
+ * that the file can be written while editing goes on. The snapshot is
+ * written with writev(2), KILO_SAVE_IOV buffers at a time: saving takes no
+ * memory beyond the snapshot, which for a file that was not modified much is
+ * a few buffers pointing into E.orig. */
+#define KILO_SAVE_IOV 1024
+#define KILO_SAVE_CHUNK (1024 * 1024)
+#define KILO_SAVE_COPY_MIN (64 * 1024)
+
+/* Add 'len' bytes at 'p' to the snapshot. Bytes that directly follow the
+ * last buffer extend it: untouched rows are next to each other, newlines
+ * included, in the original file, so they become a single buffer. */
+void saveSnapshotAdd(saveSnapshot *s, const char *p, size_t len) {
+  if (len == 0)
+    return;
+  s->len += len;
+  if (s->n) {
+    struct iovec *last = s->iov + s->n - 1;
+    if ((char *)last->iov_base + last->iov_len == p) {
+      last->iov_len += len;
+      return;
+    }
+  }
+  if (s->n == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 64;
+    s->iov = realloc(s->iov, sizeof(struct iovec) * s->cap);
+    if (s->iov == NULL) {
+      perror("Out of memory");
+      exit(1);
+    }
+  }
+  s->iov[s->n].iov_base = (char *)p;
+  s->iov[s->n].iov_len = len;
+  s->n++;
+}
+
+/* Add a copy of 'len' bytes at 'p' to the snapshot. Copies are packed in
+ * chunks, so that consecutive ones end up in the same buffer as well. */
+void saveSnapshotCopy(saveSnapshot *s, const char *p, size_t len) {
+  if (s->copy == NULL || s->copyused + len > s->copysize) {
+    size_t size = len + 16 > KILO_SAVE_CHUNK ? len + 16 : KILO_SAVE_CHUNK;
+    char *chunk = malloc(size);
+    if (chunk == NULL) {
+      perror("Out of memory");
+      exit(1);
+    }
+    /* The first bytes of a chunk link it to the previous one. */
+    *(char **)chunk = s->copy;
+    s->copy = chunk;
+    s->copyused = 16;
+    s->copysize = size;
+  }
+  memcpy(s->copy + s->copyused, p, len);
+  saveSnapshotAdd(s, s->copy + s->copyused, len);
+  s->copyused += len;
+}
+
+/* Release a snapshot. */
+void saveSnapshotFree(saveSnapshot *s) {
+  while (s->copy) {
+    char *prev = *(char **)s->copy;
+    free(s->copy);
+    s->copy = prev;
+  }
+  pthread_mutex_destroy(&s->lock);
+  if (s->orig.mapped && s->orig.fd != -1)
+    close(s->orig.fd);
+  free(s->iov);
+  free(s->filename);
+  free(s->target);
+  free(s->tmp);
+  free(s);
+}
+
+/* Take a snapshot of the content. Rows and pages still in E.orig are
+ * referenced, the others are copied: this only costs a walk of the rows
+ * and a copy of the modified ones. */
+saveSnapshot *editorSaveSnapshot(void) {
+  const char *nl = E.crlf ? "\r\n" : "\n";
+  size_t nllen = strlen(nl);
+  saveSnapshot *s = malloc(sizeof(*s));
+
+  memset(s, 0, sizeof(*s));
+  s->fd = -1;
+  s->dirty = E.dirty;
+  editorJournalFlush(0);
+  s->journalpos = E.journal.written;
+  s->filename = malloc(strlen(E.filename) + 1);
+  strcpy(s->filename, E.filename);
+  s->orig = E.orig;
+  if (E.orig.mapped)
+    s->orig.fd = dup(E.orig.fd);
+  pthread_mutex_init(&s->lock, NULL);
+
+  editorRowGapClose();
+  for (rowNode *u = rowTreeFirstUnit(E.rows); u; u = rowTreeNextUnit(u)) {
+    if (!u->leaf) {
+      /* A page that is not loaded is saved as it is. */
+      int addnl;
+      saveSnapshotAdd(s, E.orig.base + u->page->off,
+                      rowPageSavedLen(u->page, &addnl));
+      if (addnl)
+        saveSnapshotCopy(s, nl, nllen);
+      continue;
+    }
+    for (int j = 0; j < u->n; j++) {
+      erow *row = u->u.rows[j];
+      const char *end = row->chars + row->size;
+      if (!(row->flags & ROW_VIEW)) {
+        saveSnapshotCopy(s, row->chars, row->size);
+        saveSnapshotCopy(s, nl, nllen);
+        continue;
+      }
+      /* Take the newline from the original file if it is there, so that the
+       * next row can join the same buffer. */
+      saveSnapshotAdd(s, row->chars, row->size);
+      if ((size_t)(E.orig.base + E.orig.len - end) >= nllen &&
+          memcmp(end, nl, nllen) == 0)
+        saveSnapshotAdd(s, end, nllen);
+      else
+        saveSnapshotCopy(s, nl, nllen);
+    }
+  }
+  return s;
+}
+
+/* Flush the directory holding 'filename' to disk, so that a rename inside
+ * it survives a crash. Errors are ignored: not every file system allows
+ * it. */
+void editorSyncDir(const char *filename) {
+  char *dir = malloc(strlen(filename) + 2);
+  char *slash;
+  int fd;
+
+  strcpy(dir, filename);
+  if ((slash = strrchr(dir, '/')) != NULL)
+    slash[slash == dir] = '\0';
+  else
+    strcpy(dir, ".");
+  if ((fd = open(dir, O_RDONLY)) != -1) {
+    fsync(fd);
+    close(fd);
+  }
+  free(dir);
+}
+
+/* Return true if the buffer is an unmodified span of the original file big
+ * enough to be copied from it instead of written, see saveSnapshotWrite(). */
+int saveSnapshotCopyable(saveSnapshot *s, struct iovec *v) {
+  char *p = v->iov_base;
+
+  return s->orig.mapped && s->orig.fd != -1 && v->iov_len >= KILO_SAVE_COPY_MIN &&
+         p >= s->orig.base && p + v->iov_len <= s->orig.base + s->orig.len;
+}
+
+/* Add to the progress of the save. */
+void saveSnapshotProgress(saveSnapshot *s, size_t len) {
+  pthread_mutex_lock(&s->lock);
+  s->written += len;
+  pthread_mutex_unlock(&s->lock);
+}
+
+/* Write 'n' buffers, no more than KILO_SAVE_IOV. Returns 0 on success, -1 on
+ * error. */
+int saveSnapshotWritev(saveSnapshot *s, struct iovec *iov, int n) {
+  while (n) {
+    ssize_t nwritten = writev(s->fd, iov, n);
+    if (nwritten == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    saveSnapshotProgress(s, nwritten);
+    /* Skip what was written, that may end in the middle of a buffer. */
+    while (n && (size_t)nwritten >= iov->iov_len) {
+      nwritten -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n) {
+      iov->iov_base = (char *)iov->iov_base + nwritten;
+      iov->iov_len -= nwritten;
+    }
+  }
+  return 0;
+}
+
+/* Copy a span of the original file. The kernel does it without the data
+ * going through kilo, and file systems supporting it share the blocks with
+ * the original file instead of copying them (reflink), so unmodified parts
+ * of a big file cost next to nothing. Where copy_file_range() is missing or
+ * refuses the files, the span is written from the mapping. Returns 0 on
+ * success, -1 on error. */
+int saveSnapshotCopyRange(saveSnapshot *s, struct iovec *v) {
+  size_t off = (char *)v->iov_base - s->orig.base, len = v->iov_len;
+
+#ifdef __linux__
+  while (len && !s->nocopy) {
+    loff_t from = off;
+    ssize_t ncopied = copy_file_range(s->orig.fd, &from, s->fd, NULL, len, 0);
+    if (ncopied == -1 && errno == EINTR)
+      continue;
+    if (ncopied <= 0) {
+      if (ncopied == -1 && errno != ENOSYS && errno != EXDEV &&
+          errno != EINVAL && errno != EOPNOTSUPP && errno != EBADF)
+        return -1;
+      s->nocopy = 1; /* Don't try again for this save. */
+      break;
+    }
+    saveSnapshotProgress(s, ncopied);
+    off += ncopied;
+    len -= ncopied;
+  }
+#endif
+
+  struct iovec rest = {s->orig.base + off, len};
+  return len ? saveSnapshotWritev(s, &rest, 1) : 0;
+}
+
+/* Write the snapshot to a temporary file next to the file, sync it and
+ * rename it over the file: a crash at any time leaves either the old or the
+ * new file in place. Big unmodified spans are copied from the original file,
+ * the rest is written in batches. The temporary file is left open in s->fd.
+ * This only touches the snapshot, so it can run on any thread. Returns 0 on
+ * success, otherwise -1 with s->err set.
+ *
+ * A symlink is followed, so that the file it points to is replaced rather
+ * than the link. The new file gets the mode, owner and group of the old
+ * one; if it has other names, or its owner can't be given to the new one,
+ * renaming would break them, so s->inplace is set instead and
+ * editorSaveFinish() copies the new file over the old one. The same happens
+ * when no file can be created next to it. */
+int saveSnapshotWrite(saveSnapshot *s) {
+  struct stat st;
+  int exists;
+
+  if ((s->target = realpath(s->filename, NULL)) == NULL) {
+    s->target = malloc(strlen(s->filename) + 1);
+    strcpy(s->target, s->filename);
+  }
+  exists = stat(s->target, &st) == 0;
+  size_t tmplen = strlen(s->target) + 16;
+  s->tmp = malloc(tmplen);
+  snprintf(s->tmp, tmplen, "%s.kiloXXXXXX", s->target);
+  if ((s->fd = mkstemp(s->tmp)) == -1) {
+    if (!exists || (errno != EACCES && errno != EPERM && errno != EROFS))
+      goto writeerr;
+    /* The directory takes no new files, but the file itself may still be
+     * writable: write the content aside, in the temporary directory, and
+     * copy it over the file in place. */
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    free(s->tmp);
+    tmplen = strlen(dir) + 16;
+    s->tmp = malloc(tmplen);
+    snprintf(s->tmp, tmplen, "%s/kiloXXXXXX", dir);
+    if ((s->fd = mkstemp(s->tmp)) == -1)
+      goto writeerr;
+    s->inplace = 1;
+  }
+  if (exists && (st.st_nlink > 1 || fchown(s->fd, st.st_uid, st.st_gid) == -1))
+    s->inplace = 1;
+  if (fchmod(s->fd, exists ? st.st_mode & 07777 : 0644) == -1)
     goto writeerr;
 
-  /* Use truncate + a single write(2) call in order to make saving
-   * a bit safer, under the limits of what we can do in a small editor. */
-  if (ftruncate(fd, len) == -1)
+  for (int j = 0; j < s->n;) {
+    if (saveSnapshotCopyable(s, s->iov + j)) {
+      if (saveSnapshotCopyRange(s, s->iov + j) == -1)
+        goto writeerr;
+      j++;
+      continue;
+    }
+    /* Write the buffers up to the next one to copy. */
+    int n = 0;
+    while (j + n < s->n && n < KILO_SAVE_IOV &&
+           !saveSnapshotCopyable(s, s->iov + j + n))
+      n++;
+    if (saveSnapshotWritev(s, s->iov + j, n) == -1)
+      goto writeerr;
+    j += n;
+  }
+  if (fsync(s->fd) == -1)
+    goto writeerr;
+  if (s->inplace)
+    return 0;
+  if (rename(s->tmp, s->target) == -1)
     goto writeerr;
-  if (write(fd, buf, len) != len)
+  editorSyncDir(s->target);
+  return 0;
+
+writeerr:
+  s->err = errno;
+  if (s->fd != -1) {
+    close(s->fd);
+    unlink(s->tmp);
+    s->fd = -1;
+  }
+  return -1;
+}
+
+/* Copy the new content, in the temporary file 'from', over the file itself
+ * when it can't be replaced, see saveSnapshotWrite(). This runs on the main
+ * thread, as rows must not be views of the file meanwhile: if E.orig is
+ * still a mapping of it, its content moves to memory first. The temporary
+ * file is removed once done. Returns 0 on success, otherwise -1 with s->err
+ * set, leaving the temporary file. */
+int saveSnapshotInPlace(saveSnapshot *s, int from) {
+  struct stat st, orig;
+  char buf[65536];
+  off_t off = 0;
+  int fd;
+
+  if ((fd = open(s->target, O_WRONLY)) == -1 || fstat(fd, &st) == -1)
     goto writeerr;
+  if (E.orig.mapped && fstat(E.orig.fd, &orig) == 0 &&
+      orig.st_dev == st.st_dev && orig.st_ino == st.st_ino)
+    editorOrigToMemory();
 
+  while (1) {
+    ssize_t nread = pread(from, buf, sizeof(buf), off);
+    if (nread == -1 && errno == EINTR)
+      continue;
+    if (nread == -1)
+      goto writeerr;
+    if (nread == 0)
+      break;
+    for (ssize_t done = 0; done < nread;) {
+      ssize_t nwritten = write(fd, buf + done, nread - done);
+      if (nwritten == -1 && errno != EINTR)
+        goto writeerr;
+      if (nwritten > 0)
+        done += nwritten;
+    }
+    off += nread;
+  }
+  if (ftruncate(fd, off) == -1 || fsync(fd) == -1)
+    goto writeerr;
   close(fd);
-  free(buf);
-  E.dirty = 0;
-  editorSetStatusMessage("%d bytes written on disk", len);
+  unlink(s->tmp);
   return 0;
 
 writeerr:
-  free(buf);
+  s->err = errno;
   if (fd != -1)
     close(fd);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
-  return 1;
+  return -1;
 }
 
-/* ============================= Terminal update ============================ */
+/* Account for a written snapshot, on the main thread. Edits made since the
+ * snapshot was taken keep the file dirty; if there were none, rows and pages
+ * move to the new content. If it can't be mapped they just stay on the old
+ * one, which remains valid as long as it is mapped even if the file is
+ * gone. A failed save leaves everything as it was. */
+void editorSaveFinish(saveSnapshot *s) {
+  int fd = s->fd;
+
+  if (s->err) {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(s->err));
+    saveSnapshotFree(s);
+    return;
+  }
 
-/* We define a very simple "append buffer" structure, that is an heap
- * allocated string where we can append to. This is useful in order to
- * write all the escape sequences in a buffer and flush them to the standard
- * output in a single call, to avoid flickering effects. */
-struct abuf {
-  char *b;
-  int len;
-};
+  if (E.dirty == s->dirty && s->len > 0) {
+    void *map = mmap(NULL, s->len, PROT_READ, MAP_PRIVATE, s->fd, 0);
+    if (map != MAP_FAILED) {
+      editorRebaseRows(map, s->len, s->fd);
+      s->fd = -1; /* Now owned by E.orig. */
+    }
+  }
+  if (s->inplace && saveSnapshotInPlace(s, fd) == -1) {
+    editorSetStatusMessage("Can't save! I/O error: %s (new content in %s)",
+                           strerror(s->err), s->tmp);
+    if (s->fd != -1)
+      close(s->fd);
+    saveSnapshotFree(s);
+    return;
+  }
 
-#define ABUF_INIT                                                              \
-  { NULL, 0 }
+  struct stat st;
+  if ((s->inplace ? stat(s->target, &st) : fstat(fd, &st)) == 0)
+    editorJournalSaved(&st, s->journalpos, E.dirty == s->dirty);
+  if (s->fd != -1)
+    close(s->fd);
+  E.dirty -= s->dirty;
+  editorSetStatusMessage("%zu bytes written on disk", s->len);
+  saveSnapshotFree(s);
+}
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
+/* Save the current file on disk, waiting for the write to complete. If the
+ * file changed since it was loaded, the first attempt only warns. Return 0
+ * on success, 1 on error. */
+int editorSave(void) {
+  editorSavePoll(1);
+  if (editorOrigCheck()) {
+    editorSetStatusMessage("File changed by another program, save again "
+                           "to overwrite it");
+    return 1;
+  }
 
-  if (new == NULL)
-    return;
-  memcpy(new + ab->len, s, len);
-  ab->b = new;
-  ab->len += len;
+  saveSnapshot *s = editorSaveSnapshot();
+  int err = saveSnapshotWrite(s) == -1;
+  editorSaveFinish(s);
+  return err;
 }
 
-void abFree(struct abuf *ab) { free(ab->b); }
+/* Thread writing a snapshot for editorSaveBackground(). */
+void *editorSaveWorker(void *arg) {
+  saveSnapshot *s = arg;
 
-/* This function writes the whole screen using VT100 escape characters
- * starting from the logical state of the editor in the global state 'E'. */
-void editorRefreshScreen(void) {
-  int y;
-  erow *r;
-  char buf[32];
-  struct abuf ab = ABUF_INIT;
+  saveSnapshotWrite(s);
+  pthread_mutex_lock(&s->lock);
+  s->done = 1;
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
 
-  /* Highlight word under cursor */
-  editorHighlightWordUnderCursor();
+/* Save the current file on disk from a background thread, so that editing
+ * can go on meanwhile. editorSavePoll() reports the progress and accounts
+ * for the save once done. */
+void editorSaveBackground(void) {
+  if (E.saving) {
+    editorSetStatusMessage("Already saving, please wait");
+    return;
+  }
+  if (editorOrigCheck()) {
+    editorSetStatusMessage("File changed by another program, save again "
+                           "to overwrite it");
+    return;
+  }
+
+  saveSnapshot *s = editorSaveSnapshot();
+  if (pthread_create(&s->tid, NULL, editorSaveWorker, s) != 0) {
+    saveSnapshotWrite(s);
+    editorSaveFinish(s);
+    return;
+  }
+  E.saving = s;
+  s->shown = -1;
+  editorSavePoll(0);
+}
+
+/* Check on the background save, if any. With 'wait' set, block until it is
+ * complete. Returns 1 if the status message changed. */
+int editorSavePoll(int wait) {
+  saveSnapshot *s = E.saving;
+  int done, percent;
+
+  if (s == NULL)
+    return 0;
+  pthread_mutex_lock(&s->lock);
+  done = s->done;
+  percent = s->len ? (int)(s->written * 100 / s->len) : 100;
+  pthread_mutex_unlock(&s->lock);
+
+  if (done || wait) {
+    pthread_join(s->tid, NULL);
+    E.saving = NULL;
+    editorSaveFinish(s);
+    return 1;
+  }
+  if (percent == s->shown)
+    return 0;
+  s->shown = percent;
+  editorSetStatusMessage("Saving... %d%%", percent);
+  return 1;
+}
+
+/* ============================== Edit journal ============================== */
+
+/* Every edit of the file goes through a few row primitives (inserting and
+ * deleting rows, inserting and deleting chars, appending to and truncating
+ * rows), that append a compact record of it to a journal next to the file,
+ * ".<name>.kjournal". Records are kept in memory and written in batches,
+ * at the latest when kilo is idle. The journal only exists while the file
+ * has unsaved changes: it is removed once they are saved, or when quitting
+ * without saving them. If kilo finds a journal when opening a file, it
+ * replays it over the file, recovering the edits lost by a crash.
+ *
+ * The journal starts with a header identifying the version of the file the
+ * edits apply to. Records are an opcode followed by integer arguments as
+ * LEB128 varints, and by the bytes of the text they insert if any, so the
+ * journal grows with the size of the edits, not of the file. */
+#define KILO_JOURNAL_MAGIC "KILOJRN1"
+#define KILO_JOURNAL_HDRLEN 32
+#define KILO_JOURNAL_BATCH 4096
+
+/* Store in 'hdr' the journal header for the file version described by
+ * 'st', or a missing file if NULL. */
+void editorJournalHeader(char *hdr, struct stat *st) {
+  uint64_t id[3] = {0, 0, 0};
+
+  if (st) {
+    id[0] = st->st_size;
+    id[1] = st->st_mtim.tv_sec;
+    id[2] = st->st_mtim.tv_nsec;
+  }
+  memcpy(hdr, KILO_JOURNAL_MAGIC, 8);
+  memcpy(hdr + 8, id, sizeof(id));
+}
+
+/* Append 'v' as a varint to the pending records. */
+void editorJournalPutInt(editJournal *j, size_t v) {
+  do {
+    j->buf[j->len++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+    v >>= 7;
+  } while (v);
+}
+
+/* Record an edit of the file: 'op' with its row and column, and the text it
+ * inserts. Nothing is recorded while replaying the journal itself. */
+void editorJournalRecord(int op, int row, int col, const char *s,
+                         size_t len) {
+  editJournal *j = &E.journal;
+
+  if (!j->enabled || j->replaying || j->path == NULL)
+    return;
+  if (j->len + len + 32 > j->cap) {
+    j->cap = j->len + len + 32 > KILO_JOURNAL_BATCH * 2
+                 ? j->len + len + 32
+                 : KILO_JOURNAL_BATCH * 2;
+    j->buf = realloc(j->buf, j->cap);
+  }
+  j->buf[j->len++] = op;
+  editorJournalPutInt(j, row);
+  switch (op) {
+  case JOURNAL_INSERT_ROW:
+  case JOURNAL_APPEND:
+  case JOURNAL_SET_ROW:
+    editorJournalPutInt(j, len);
+    memcpy(j->buf + j->len, s, len);
+    j->len += len;
+    break;
+  case JOURNAL_INSERT_CHAR:
+    editorJournalPutInt(j, col);
+    j->buf[j->len++] = s[0];
+    break;
+  case JOURNAL_DEL_CHAR:
+  case JOURNAL_TRUNCATE:
+    editorJournalPutInt(j, col);
+    break;
+  }
+  if (j->len >= KILO_JOURNAL_BATCH)
+    editorJournalFlush(0);
+}
+
+/* Write the pending records to the journal, creating it on the first edit.
+ * With 'sync' set, also make sure they reached the disk. Failing to write
+ * the journal is not fatal: the journal is dropped, as later records would
+ * not apply without the lost ones, and the edits are no longer journaled. */
+void editorJournalFlush(int sync) {
+  editJournal *j = &E.journal;
+
+  if (j->len && j->fd == -1) {
+    /* Never write through a link, or over a journal that is not ours. */
+    char hdr[KILO_JOURNAL_HDRLEN];
+    j->fd = open(j->path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    editorJournalHeader(hdr, j->filemissing ? NULL : &j->filest);
+    if (j->fd == -1 || write(j->fd, hdr, sizeof(hdr)) != sizeof(hdr)) {
+      editorSetStatusMessage("Can't write the journal %s: %s", j->path,
+                             strerror(errno));
+      editorJournalDiscard();
+      return;
+    }
+  }
+  const char *p = j->buf;
+  size_t left = j->len;
+  while (left) {
+    ssize_t nwritten = write(j->fd, p, left);
+    if (nwritten == -1) {
+      if (errno == EINTR)
+        continue;
+      editorSetStatusMessage("Can't write the journal %s: %s", j->path,
+                             strerror(errno));
+      editorJournalDiscard();
+      return;
+    }
+    p += nwritten;
+    left -= nwritten;
+    j->unsynced = 1;
+  }
+  j->written += j->len;
+  j->len = 0;
+  if (sync && j->unsynced) {
+    fdatasync(j->fd);
+    j->unsynced = 0;
+  }
+}
+
+/* Remove the journal: the edits it holds are saved or unwanted. */
+void editorJournalDiscard(void) {
+  editJournal *j = &E.journal;
+
+  if (j->fd != -1) {
+    close(j->fd);
+    unlink(j->path);
+  }
+  free(j->path);
+  free(j->buf);
+  j->path = NULL;
+  j->buf = NULL;
+  j->fd = -1;
+  j->len = j->cap = j->written = 0;
+  j->unsynced = 0;
+}
+
+/* Read a varint from the journal at *p, before 'end'. Returns -1 if the
+ * record is truncated. */
+int editorJournalGetInt(const unsigned char **p, const unsigned char *end,
+                        size_t *v) {
+  int shift = 0;
+
+  *v = 0;
+  while (*p < end && shift < 64) {
+    unsigned char b = *(*p)++;
+    *v |= (size_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return 0;
+    shift += 7;
+  }
+  return -1;
+}
+
+/* Apply the records of a journal. Replay stops at the first record that is
+ * truncated, as written by a crash, or does not apply. Returns the number
+ * of records replayed, and sets *used to the bytes they take. */
+int editorJournalReplay(const unsigned char *p, const unsigned char *end,
+                        size_t *used) {
+  const unsigned char *start = p;
+  int count = 0;
+
+  E.journal.replaying = 1;
+  *used = 0;
+  while (p < end) {
+    int op = *p++;
+    size_t row, col = 0, len = 0;
+    const unsigned char *text = NULL;
+
+    if (editorJournalGetInt(&p, end, &row) == -1)
+      break;
+    if (op == JOURNAL_INSERT_ROW || op == JOURNAL_APPEND ||
+        op == JOURNAL_SET_ROW) {
+      if (editorJournalGetInt(&p, end, &len) == -1 ||
+          (size_t)(end - p) < len)
+        break;
+      text = p;
+      p += len;
+    } else if (op == JOURNAL_INSERT_CHAR || op == JOURNAL_DEL_CHAR ||
+               op == JOURNAL_TRUNCATE) {
+      if (editorJournalGetInt(&p, end, &col) == -1 || col > INT_MAX)
+        break;
+      if (op == JOURNAL_INSERT_CHAR) {
+        if (p == end)
+          break;
+        text = p++;
+      }
+    } else if (op != JOURNAL_DEL_ROW) {
+      break;
+    }
+
+    if (row > (size_t)E.numrows ||
+        (op != JOURNAL_INSERT_ROW && row == (size_t)E.numrows))
+      break;
+    erow *r = op == JOURNAL_INSERT_ROW ? NULL : editorRowAt(row);
+    switch (op) {
+    case JOURNAL_INSERT_ROW:
+      editorInsertRow(row, (char *)text, len);
+      break;
+    case JOURNAL_DEL_ROW:
+      editorDelRow(row);
+      break;
+    case JOURNAL_INSERT_CHAR:
+      editorRowInsertChar(r, col, *text);
+      break;
+    case JOURNAL_DEL_CHAR:
+      editorRowDelChar(r, col);
+      break;
+    case JOURNAL_APPEND:
+      editorRowAppendString(r, (char *)text, len);
+      break;
+    case JOURNAL_TRUNCATE:
+      editorRowTruncate(r, col);
+      break;
+    case JOURNAL_SET_ROW:
+      editorRowSetChars(r, (char *)text, len);
+      break;
+    }
+    count++;
+    *used = p - start;
+  }
+  E.journal.replaying = 0;
+  return count;
+}
+
+/* Start journaling the edits of the file just opened. If a journal was left
+ * by a previous session, replay it if it matches the file, and go on
+ * appending to it; otherwise move it aside, so that it is not lost. */
+void editorJournalOpen(void) {
+  editJournal *j = &E.journal;
+  struct stat st;
+
+  editorJournalDiscard();
+  if (!j->enabled)
+    return;
+
+  const char *slash = strrchr(E.filename, '/');
+  size_t dirlen = slash ? (size_t)(slash - E.filename + 1) : 0;
+  j->path = malloc(strlen(E.filename) + 16);
+  sprintf(j->path, "%.*s.%s.kjournal", (int)dirlen, E.filename,
+          E.filename + dirlen);
+  j->filemissing = stat(E.filename, &st) == -1;
+  if (!j->filemissing)
+    j->filest = st;
+
+  int fd = open(j->path, O_RDWR | O_NOFOLLOW);
+  if (fd == -1)
+    return;
+
+  char hdr[KILO_JOURNAL_HDRLEN];
+  unsigned char *data = NULL;
+  struct stat jst;
+  ssize_t len = -1;
+  editorJournalHeader(hdr, j->filemissing ? NULL : &j->filest);
+  if (fstat(fd, &jst) == 0 && jst.st_size >= KILO_JOURNAL_HDRLEN &&
+      (data = malloc(jst.st_size)) != NULL)
+    len = pread(fd, data, jst.st_size, 0);
+  if (len < KILO_JOURNAL_HDRLEN || memcmp(data, hdr, sizeof(hdr)) != 0) {
+    char *old = malloc(strlen(j->path) + 5);
+    sprintf(old, "%s.old", j->path);
+    rename(j->path, old);
+    editorSetStatusMessage("Journal for another version of the file moved "
+                           "to %s",
+                           old);
+    free(old);
+    free(data);
+    close(fd);
+    return;
+  }
+
+  size_t used;
+  int count =
+      editorJournalReplay(data + KILO_JOURNAL_HDRLEN, data + len, &used);
+  free(data);
+  editorSetStatusMessage("Recovered %d edits from the journal", count);
+  if (count == 0) {
+    close(fd);
+    unlink(j->path);
+    return;
+  }
+  /* Go on from the end of the records that were replayed, dropping what
+   * follows them: new records must not complete a truncated one. */
+  if (ftruncate(fd, KILO_JOURNAL_HDRLEN + used) == -1 ||
+      lseek(fd, KILO_JOURNAL_HDRLEN + used, SEEK_SET) == -1) {
+    close(fd);
+    return;
+  }
+  j->fd = fd;
+  j->written = used;
+}
+
+/* Called once the file is saved, from a snapshot taken when the journal had
+ * 'pos' bytes of records, as the version described by 'st'. If nothing was
+ * edited since then ('clean' set) the journal goes away, otherwise it is
+ * rewritten with the records that came after the snapshot, as edits of the
+ * new version of the file. */
+void editorJournalSaved(struct stat *st, size_t pos, int clean) {
+  editJournal *j = &E.journal;
+
+  if (j->path == NULL)
+    return;
+  j->filest = *st;
+  j->filemissing = 0;
+  if (clean || j->fd == -1) {
+    if (j->fd != -1) {
+      close(j->fd);
+      unlink(j->path);
+      j->fd = -1;
+    }
+    j->written = 0;
+    return;
+  }
+
+  editorJournalFlush(0);
+  if (j->path == NULL)
+    return; /* Dropped as it could not be written. */
+  size_t taillen = j->written - pos;
+  char *tail = malloc(taillen + KILO_JOURNAL_HDRLEN);
+  char *tmp = malloc(strlen(j->path) + 5);
+  sprintf(tmp, "%s.new", j->path);
+  editorJournalHeader(tail, st);
+  unlink(tmp); /* Left by a crash, if any. */
+  int fd = open(tmp, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+  if (fd != -1 &&
+      pread(j->fd, tail + KILO_JOURNAL_HDRLEN, taillen,
+            KILO_JOURNAL_HDRLEN + pos) == (ssize_t)taillen &&
+      write(fd, tail, taillen + KILO_JOURNAL_HDRLEN) ==
+          (ssize_t)(taillen + KILO_JOURNAL_HDRLEN) &&
+      rename(tmp, j->path) == 0) {
+    close(j->fd);
+    j->fd = fd;
+    j->written = taillen;
+    j->unsynced = 1;
+  } else {
+    /* The old journal no longer applies to the file: drop it rather than
+     * have it moved aside when recovering. */
+    editorSetStatusMessage("Can't write the journal %s: %s", j->path,
+                           strerror(errno));
+    if (fd != -1) {
+      close(fd);
+      unlink(tmp);
+    }
+    editorJournalDiscard();
+  }
+  free(tmp);
+  free(tail);
+}
+
+/* ============================= Terminal update ============================ */
+
+/* We define a very simple "append buffer" structure, that is an heap
+ * allocated string where we can append to. This is useful in order to
+ * write all the escape sequences in a buffer and flush them to the standard
+ * output in a single call, to avoid flickering effects. */
+struct abuf {
+  char *b;
+  int len;
+};
+
+#define ABUF_INIT                                                              \
+  { NULL, 0 }
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+  char *new = realloc(ab->b, ab->len + len);
+
+  if (new == NULL)
+    return;
+  memcpy(new + ab->len, s, len);
+  ab->b = new;
+  ab->len += len;
+}
+
+void abFree(struct abuf *ab) { free(ab->b); }
+
+/* Rows materialized around the visible ones by editorRefreshScreen(). */
+#define KILO_PREFETCH_ROWS 16
+
+/* This function writes the whole screen using VT100 escape characters
+ * starting from the logical state of the editor in the global state 'E'. */
+void editorRefreshScreen(void) {
+  int y;
+  erow *r;
+  char buf[32];
+  struct abuf ab = ABUF_INIT;
+
+  /* Materialize the rows on screen, plus a margin above and below so that
+   * scrolling a bit does not have to wait for them. */
+  rowIter it;
+  int first = E.rowoff - KILO_PREFETCH_ROWS;
+  if (first < 0)
+    first = 0;
+  editorSyntaxCatchUp(E.rowoff + E.screenrows + KILO_PREFETCH_ROWS - 1);
+  rowIterInit(&it, first);
+  for (y = first; y < E.rowoff + E.screenrows + KILO_PREFETCH_ROWS; y++) {
+    if ((r = rowIterNext(&it)) == NULL)
+      break;
+    editorRowMaterialize(r);
+  }
+
+  /* Highlight word under cursor */
+  editorHighlightWordUnderCursor();
 
   abAppend(&ab, "\x1b[?25l", 6); /* Hide cursor. */
   abAppend(&ab, "\x1b[H", 3);    /* Go home. */
+  unsigned char *rowhl = malloc(E.screencols + 1); /* Row with overlays. */
   int lineno_width = 1;
   if (E.numrows > 0) {
     int max_lineno = E.numrows;
@@ -936,7 +3857,7 @@ void editorRefreshScreen(void) {
       continue;
     }
 
-    r = &E.row[filerow];
+    r = editorRowAt(filerow);
     int len = r->rsize - E.coloff;
     int current_color = -1;
     // Print line number
@@ -953,7 +3874,9 @@ void editorRefreshScreen(void) {
       if (len > E.screencols - lineno_width)
         len = E.screencols - lineno_width;
       char *c = r->render + E.coloff;
-      unsigned char *hl = r->hl + E.coloff;
+      unsigned char *hl = rowhl;
+      memcpy(hl, r->hl + E.coloff, len);
+      editorOverlayApply(filerow, E.coloff, len, hl);
       int j;
       int screen_col =
           lineno_width; // screen column index (starts after line number)
@@ -1040,354 +3963,2042 @@ void editorRefreshScreen(void) {
       int screen_col = lineno_width;
       int source_col = E.coloff;
 
-      // For empty lines, draw indent guides based on surrounding context
-      if (r->size == 0 && filerow > 0 && filerow < E.numrows - 1) {
-        // Look for indent level from previous or next non-empty line
-        int indent_level = 0;
-        for (int search_row = filerow - 1; search_row >= 0; search_row--) {
-          if (E.row[search_row].size > 0) {
-            // Count leading spaces in this line
-            for (int i = 0; i < E.row[search_row].size; i++) {
-              if (E.row[search_row].chars[i] == ' ') {
-                indent_level++;
-              } else {
-                break;
-              }
-            }
-            break;
-          }
-        }
+      // For empty lines, draw indent guides based on surrounding context
+      if (r->size == 0 && filerow > 0 && filerow < E.numrows - 1) {
+        // Look for indent level from previous or next non-empty line
+        int indent_level = 0;
+        for (int search_row = filerow - 1; search_row >= 0; search_row--) {
+          erow *sr = editorRowAt(search_row);
+          if (sr->size > 0) {
+            // Count leading spaces in this line
+            for (int i = 0; i < sr->size; i++) {
+              if (editorRowCharAt(sr, i) == ' ') {
+                indent_level++;
+              } else {
+                break;
+              }
+            }
+            break;
+          }
+        }
+
+        // Draw indent guides for empty line
+        while (source_col < indent_level && screen_col < E.screencols) {
+          if (source_col % TAB_SIZE == 0 && source_col > 0) {
+            abAppend(&ab, "\x1b[2m", 4); // dim
+            abAppend(&ab, "|", 1);
+            abAppend(&ab, "\x1b[0m", 4); // reset
+          } else {
+            abAppend(&ab, " ", 1);
+          }
+          source_col++;
+          screen_col++;
+        }
+      }
+
+      // Fill remaining space and draw colorcolumn if visible
+      if ((E.screencols - lineno_width) >= 80) {
+        int pad = 80 - screen_col;
+        while (pad-- > 0) {
+          abAppend(&ab, " ", 1);
+          screen_col++;
+        }
+        abAppend(&ab, "\x1b[7m \x1b[0m", 9);
+      }
+    }
+    abAppend(&ab, "\x1b[39m", 5);
+    if (y == E.cy)
+      abAppend(&ab, "\x1b[0m", 4); // reset after active line
+    abAppend(&ab, "\x1b[0K", 4);
+    abAppend(&ab, "\r\n", 2);
+  }
+
+  /* Create a two rows status. First row: */
+  abAppend(&ab, "\x1b[0K", 4);
+  abAppend(&ab, "\x1b[7m", 4);
+  char status[80], rstatus[80];
+  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+                     E.filename ? E.filename : "[No Name]", E.numrows,
+                     E.dirty ? "(modified)" : "");
+  snprintf(rstatus, sizeof(rstatus), "%d:%d", E.rowoff + E.cy + 1,
+           E.coloff + E.cx + 1);
+  if (len > E.screencols)
+    len = E.screencols;
+  abAppend(&ab, status, len);
+  while (len < E.screencols) {
+    if (E.screencols - len == (int)strlen(rstatus)) {
+      abAppend(&ab, rstatus, strlen(rstatus));
+      break;
+    } else {
+      abAppend(&ab, " ", 1);
+      len++;
+    }
+  }
+  abAppend(&ab, "\x1b[0m\r\n", 6);
+
+  /* Second row depends on E.statusmsg and the status message update time. */
+  abAppend(&ab, "\x1b[0K", 4);
+  int msglen = strlen(E.statusmsg);
+  if (msglen && time(NULL) - E.statusmsg_time < 5)
+    abAppend(&ab, E.statusmsg, msglen <= E.screencols ? msglen : E.screencols);
+
+  /* Put cursor at its current position. Note that the horizontal position
+   * at which the cursor is displayed may be different compared to 'E.cx'
+   * because of TABs. */
+  int j;
+  int cx = lineno_width + 1; // account for line number margin
+  int filerow = E.rowoff + E.cy;
+  erow *row = editorRowAt(filerow);
+  if (row) {
+    for (j = E.coloff; j < (E.cx + E.coloff); j++) {
+      if (j < row->size && editorRowCharAt(row, j) == TAB)
+        cx += 7 - ((cx) % 8);
+      cx++;
+    }
+  }
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy + 1, cx);
+  abAppend(&ab, buf, strlen(buf));
+  abAppend(&ab, "\x1b[?25h", 6); /* Show cursor. */
+  write(STDOUT_FILENO, ab.b, ab.len);
+  abFree(&ab);
+  free(rowhl);
+}
+
+/* Set an editor status message for the second line of the status, at the
+ * end of the screen. */
+void editorSetStatusMessage(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+  va_end(ap);
+  E.statusmsg_time = time(NULL);
+}
+
+/* =============================== Word highlighting ======================= */
+
+/* Search matches and occurrences of the word under the cursor are not
+ * written into row->hl: they are kept as spans in a layer of E.overlay, and
+ * merged with the syntax highlight only when rows are drawn. So removing
+ * them does not have to restore anything, a layer is just emptied. */
+void editorOverlayClear(int layer) { E.overlay[layer].count = 0; }
+
+/* Add a span to a layer. Spans must be added in row and column order. */
+void editorOverlayAdd(int layer, int row, int start, int len) {
+  hlOverlay *o = &E.overlay[layer];
+
+  if (o->count == o->cap) {
+    o->cap = o->cap ? o->cap * 2 : 64;
+    o->spans = realloc(o->spans, sizeof(hlSpan) * o->cap);
+  }
+  o->spans[o->count].row = row;
+  o->spans[o->count].start = start;
+  o->spans[o->count].len = len;
+  o->count++;
+}
+
+/* Merge the overlays of the file row 'row' into 'hl', a copy of the
+ * highlight of 'len' render columns of the row starting at 'from'. Word
+ * occurrences are not drawn over comments and strings. */
+void editorOverlayApply(int row, int from, int len, unsigned char *hl) {
+  for (int layer = 0; layer < OVERLAY_LAYERS; layer++) {
+    hlOverlay *o = &E.overlay[layer];
+    unsigned char type = layer == OVERLAY_MATCH ? HL_MATCH : HL_UNDERLINE;
+
+    /* First span of the row. */
+    int lo = 0, hi = o->count;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (o->spans[mid].row < row)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    for (; lo < o->count && o->spans[lo].row == row; lo++) {
+      int start = o->spans[lo].start - from;
+      int end = start + o->spans[lo].len;
+      if (start < 0)
+        start = 0;
+      if (end > len)
+        end = len;
+      for (int j = start; j < end; j++) {
+        if (layer == OVERLAY_WORD &&
+            (hl[j] == HL_COMMENT || hl[j] == HL_MLCOMMENT ||
+             hl[j] == HL_STRING))
+          continue;
+        hl[j] = type;
+      }
+    }
+  }
+}
+
+/* Get the word under the cursor. Returns 1 if a word is found, 0 otherwise. */
+int editorGetWordAtCursor(char *word, int *start_pos, int *end_pos) {
+  int filerow = E.rowoff + E.cy;
+  int filecol = E.coloff + E.cx;
+
+  if (filerow >= E.numrows)
+    return 0;
+
+  erow *row = editorRowAt(filerow);
+  if (filecol >= row->size)
+    return 0;
+
+  /* Check if cursor is on a word character */
+  char c = editorRowCharAt(row, filecol);
+  if (!isalnum(c) && c != '_')
+    return 0;
+
+  /* Find start of word */
+  int start = filecol;
+  while (start > 0 && (isalnum(c = editorRowCharAt(row, start - 1)) ||
+                       c == '_')) {
+    start--;
+  }
+
+  /* Find end of word */
+  int end = filecol;
+  while (end < row->size &&
+         (isalnum(c = editorRowCharAt(row, end)) || c == '_')) {
+    end++;
+  }
+
+  /* Extract word */
+  int word_len = end - start;
+  if (word_len > 255)
+    word_len = 255; /* Limit word length */
+
+  for (int j = 0; j < word_len; j++)
+    word[j] = editorRowCharAt(row, start + j);
+  word[word_len] = '\0';
+
+  *start_pos = start;
+  *end_pos = end;
+
+  return word_len > 0 ? 1 : 0;
+}
+
+/* Highlight all occurrences of the word under cursor in the rows on
+ * screen. This runs at every refresh, so the occurrences found are kept
+ * until the word, the rows on screen, or their content change. */
+void editorHighlightWordUnderCursor(void) {
+  char word[256];
+  int start_pos, end_pos;
+  wordCache *wc = &E.wordhl;
+
+  rowIter it;
+  erow *row;
+  int first = E.rowoff;
+  int last = E.rowoff + E.screenrows;
+
+  /* Get word under cursor */
+  if (!editorGetWordAtCursor(word, &start_pos, &end_pos))
+    word[0] = '\0'; /* No word under cursor */
+  if (wc->valid && wc->rowoff == E.rowoff && wc->screenrows == E.screenrows &&
+      wc->version == E.rowversion && strcmp(wc->word, word) == 0)
+    return;
+  wc->valid = 1;
+  wc->rowoff = E.rowoff;
+  wc->screenrows = E.screenrows;
+  wc->version = E.rowversion;
+  strcpy(wc->word, word);
+
+  editorOverlayClear(OVERLAY_WORD);
+  int wlen = strlen(word);
+  if (wlen == 0)
+    return;
+
+  /* Highlight all matching words in all rows */
+  rowIterInit(&it, first);
+  for (int y = first; y < last && (row = rowIterNext(&it)) != NULL; y++) {
+    if (!row->render)
+      continue;
+
+    char *match = row->render;
+    while ((match = strstr(match, word)) != NULL) {
+      /* Check if this is a whole word match */
+      int match_start = match - row->render;
+      int match_end = match_start + wlen;
+
+      /* Check boundaries */
+      int is_word_start =
+          (match_start == 0 || (!isalnum(row->render[match_start - 1]) &&
+                                row->render[match_start - 1] != '_'));
+      int is_word_end =
+          (match_end >= row->rsize ||
+           (!isalnum(row->render[match_end]) && row->render[match_end] != '_'));
+
+      if (is_word_start && is_word_end)
+        editorOverlayAdd(OVERLAY_WORD, y, match_start, wlen);
+
+      match++; /* Move to next position */
+    }
+  }
+}
+
+/* ============================ Identifier index ============================ */
+
+/* To jump between the occurrences of the identifier under the cursor, and
+ * tell which one it is, identifiers are mapped to the rows they occur in,
+ * in file order, each with the number of occurrences in it. Rows keep their
+ * address while others are added and removed around them, and
+ * editorRowIndex() gives their position, so the row under the cursor is
+ * found with a binary search.
+ *
+ * The index is built with a pass over the file the first time it is
+ * needed, then kept up to date by the row primitives: they report the
+ * content of a row before and after changing it, and only the identifiers
+ * whose number of occurrences in the row changed are updated. Typing in a
+ * row that already holds an identifier only changes its count there;
+ * identifiers left with no occurrence are removed. It is not used in paging
+ * mode, where rows are freed and loaded again. */
+
+/* Return the length of the first identifier at or after *at in the 'len'
+ * bytes at 's', and set *at to its offset, or return 0 if there is none.
+ * Words starting with a digit are numbers, and words longer than those
+ * editorGetWordAtCursor() returns are skipped. */
+int identNext(const char *s, int len, int *at) {
+  const char *p = s + *at, *end = s + len;
+
+  while (p < end) {
+    if (!isalnum((unsigned char)*p) && *p != '_') {
+      p++;
+      continue;
+    }
+    const char *w = p;
+    p = lexSkipWord(p, end);
+    if (!isdigit((unsigned char)*w) && p - w < 256) {
+      *at = w - s;
+      return p - w;
+    }
+  }
+  return 0;
+}
+
+int identCompare(const void *a, const void *b) {
+  const identToken *x = a, *y = b;
+  if (x->len != y->len)
+    return x->len - y->len;
+  return memcmp(x->s, y->s, x->len);
+}
+
+/* Append the identifiers of 's' to E.idents.toks from item 'n' on, sorted
+ * so that equal ones are adjacent. Returns the new number of items. */
+int identTokenize(const char *s, int len, int n) {
+  identIndex *ix = &E.idents;
+  int first = n, at = 0, l;
+
+  while ((l = identNext(s, len, &at)) != 0) {
+    if (n == ix->tokcap) {
+      ix->tokcap = ix->tokcap ? ix->tokcap * 2 : 64;
+      ix->toks = realloc(ix->toks, sizeof(identToken) * ix->tokcap);
+    }
+    ix->toks[n].s = s + at;
+    ix->toks[n].len = l;
+    n++;
+    at += l;
+  }
+  qsort(ix->toks + first, n - first, sizeof(identToken), identCompare);
+  return n;
+}
+
+/* Content of a row in a single piece: the gap buffer row is copied into
+ * '*buf', like any row if 'copy' is true. */
+const char *identRowText(erow *row, char **buf, int *cap, int copy) {
+  if (row != E.gaprow && !copy)
+    return row->chars;
+  if (row->size + 1 > *cap) {
+    *cap = row->size + 1;
+    *buf = realloc(*buf, *cap);
+  }
+  if (row == E.gaprow) {
+    memcpy(*buf, row->chars, E.gapstart);
+    memcpy(*buf + E.gapstart, row->chars + E.gapstart + E.gaplen,
+           row->size - E.gapstart);
+  } else {
+    memcpy(*buf, row->chars, row->size);
+  }
+  return *buf;
+}
+
+void identIndexGrow(void) {
+  identIndex *ix = &E.idents;
+  identEntry *old = ix->slots;
+  uint32_t oldsize = ix->mask + 1;
+
+  ix->mask = oldsize * 2 - 1;
+  ix->slots = calloc(ix->mask + 1, sizeof(identEntry));
+  for (uint32_t j = 0; j < oldsize; j++) {
+    if (old[j].word == NULL)
+      continue;
+    uint32_t i = keywordHash(0, old[j].word, old[j].len) & ix->mask;
+    while (ix->slots[i].word)
+      i = (i + 1) & ix->mask;
+    ix->slots[i] = old[j];
+  }
+  free(old);
+}
+
+/* Return the entry of the identifier of 'len' bytes at 's', or NULL if it
+ * is not there and 'create' is false. */
+identEntry *identIndexLookup(const char *s, int len, int create) {
+  identIndex *ix = &E.idents;
+
+  if (ix->slots == NULL) {
+    if (!create)
+      return NULL;
+    ix->mask = 1023;
+    ix->slots = calloc(ix->mask + 1, sizeof(identEntry));
+  }
+  uint32_t i = keywordHash(0, s, len) & ix->mask;
+  while (ix->slots[i].word) {
+    identEntry *e = ix->slots + i;
+    if (e->len == len && memcmp(e->word, s, len) == 0)
+      return e;
+    i = (i + 1) & ix->mask;
+  }
+  if (!create)
+    return NULL;
+  if ((ix->used + 1) * 2 > (int)ix->mask + 1) {
+    identIndexGrow();
+    return identIndexLookup(s, len, create);
+  }
+
+  identEntry *e = ix->slots + i;
+  e->word = malloc(len + 1);
+  memcpy(e->word, s, len);
+  e->word[len] = '\0';
+  e->len = len;
+  ix->used++;
+  return e;
+}
+
+/* Remove the entry 'e', that has no occurrences left. Entries after it in
+ * the same run of slots move back when their own slot is not after the
+ * hole, so that lookups still find them without tombstones. */
+void identIndexRemove(identEntry *e) {
+  identIndex *ix = &E.idents;
+  uint32_t hole = e - ix->slots, j = hole;
+
+  free(e->word);
+  free(e->occ);
+  while (ix->slots[j = (j + 1) & ix->mask].word) {
+    identEntry *m = ix->slots + j;
+    uint32_t home = keywordHash(0, m->word, m->len) & ix->mask;
+    /* Leave it if its slot is in (hole, j], cyclically. */
+    if (((j - home) & ix->mask) < ((j - hole) & ix->mask))
+      continue;
+    ix->slots[hole] = *m;
+    hole = j;
+  }
+  memset(ix->slots + hole, 0, sizeof(identEntry));
+  ix->used--;
+}
+
+/* Return the position of 'row' in e->occ, or of the first row after it if
+ * the identifier does not occur in it. */
+int identIndexPosition(identEntry *e, erow *row) {
+  int at = editorRowIndex(row);
+  int lo = 0, hi = e->count;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (editorRowIndex(e->occ[mid].row) < at)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Update the occurrences in 'row' from the identifiers of 'old', its
+ * content before a change, to the ones of 'cur'. */
+void identIndexUpdate(erow *row, const char *old, int oldlen,
+                      const char *cur, int curlen) {
+  identIndex *ix = &E.idents;
+  int n0 = identTokenize(old, oldlen, 0);
+  int n = identTokenize(cur, curlen, n0);
+  identToken *t = ix->toks;
+  int i = 0, j = n0;
+
+  while (i < n0 || j < n) {
+    int cmp = i == n0 ? 1 : j == n ? -1 : identCompare(t + i, t + j);
+    identToken *w = cmp <= 0 ? t + i : t + j;
+    int c0 = 0, c1 = 0;
+    while (i < n0 && identCompare(t + i, w) == 0)
+      i++, c0++;
+    while (j < n && identCompare(t + j, w) == 0)
+      j++, c1++;
+    if (c0 == c1)
+      continue;
+
+    identEntry *e = identIndexLookup(w->s, w->len, 1);
+    int at = identIndexPosition(e, row);
+    e->total += c1 - c0;
+    if (c0) {
+      /* The row is listed: only its count changes, unless it drops to 0. */
+      e->occ[at].n += c1 - c0;
+      if (e->occ[at].n)
+        continue;
+      memmove(e->occ + at, e->occ + at + 1,
+              sizeof(identOcc) * (e->count - at - 1));
+      e->count--;
+      if (e->total == 0)
+        identIndexRemove(e);
+      continue;
+    }
+    if (e->count == e->cap) {
+      e->cap = e->cap ? e->cap * 2 : 4;
+      e->occ = realloc(e->occ, sizeof(identOcc) * e->cap);
+    }
+    memmove(e->occ + at + 1, e->occ + at, sizeof(identOcc) * (e->count - at));
+    e->occ[at].row = row;
+    e->occ[at].n = c1;
+    e->count++;
+  }
+}
+
+/* Fill the index from the whole file, if not done yet. */
+void identIndexBuild(void) {
+  identIndex *ix = &E.idents;
+  rowIter it;
+  erow *row;
+
+  if (ix->built || E.paging)
+    return;
+  rowIterInit(&it, 0);
+  while ((row = rowIterNext(&it)) != NULL) {
+    const char *s = identRowText(row, &ix->after, &ix->aftercap, 0);
+    int n = identTokenize(s, row->size, 0);
+    for (int j = 0, k; j < n; j = k) {
+      for (k = j + 1; k < n && identCompare(ix->toks + j, ix->toks + k) == 0;
+           k++)
+        ;
+      identEntry *e = identIndexLookup(ix->toks[j].s, ix->toks[j].len, 1);
+      if (e->count == e->cap) {
+        e->cap = e->cap ? e->cap * 2 : 4;
+        e->occ = realloc(e->occ, sizeof(identOcc) * e->cap);
+      }
+      e->occ[e->count].row = row;
+      e->occ[e->count++].n = k - j;
+      e->total += k - j;
+    }
+  }
+  ix->built = 1;
+}
+
+void identIndexFree(void) {
+  identIndex *ix = &E.idents;
+
+  for (uint32_t j = 0; ix->slots && j <= ix->mask; j++) {
+    free(ix->slots[j].word);
+    free(ix->slots[j].occ);
+  }
+  free(ix->slots);
+  ix->slots = NULL;
+  ix->used = 0;
+  ix->built = 0;
+}
+
+/* The row primitives call identIndexRowBegin() before changing the content
+ * of a row and identIndexRowEnd() once done, identIndexRowAdded() once a
+ * new row is in the tree, and identIndexRowRemoved() before taking one out
+ * of it. */
+void identIndexRowBegin(erow *row) {
+  identIndex *ix = &E.idents;
+  if (!ix->built)
+    return;
+  identRowText(row, &ix->before, &ix->beforecap, 1);
+  ix->beforelen = row->size;
+}
+
+void identIndexRowEnd(erow *row) {
+  identIndex *ix = &E.idents;
+  if (!ix->built)
+    return;
+  const char *s = identRowText(row, &ix->after, &ix->aftercap, 0);
+  identIndexUpdate(row, ix->before, ix->beforelen, s, row->size);
+}
+
+void identIndexRowAdded(erow *row) {
+  identIndex *ix = &E.idents;
+  if (!ix->built)
+    return;
+  const char *s = identRowText(row, &ix->after, &ix->aftercap, 0);
+  identIndexUpdate(row, NULL, 0, s, row->size);
+}
+
+void identIndexRowRemoved(erow *row) {
+  identIndex *ix = &E.idents;
+  if (!ix->built)
+    return;
+  const char *s = identRowText(row, &ix->after, &ix->aftercap, 0);
+  identIndexUpdate(row, s, row->size, NULL, 0);
+}
+
+/* Move the cursor to the next (dir 1) or previous (dir -1) occurrence of
+ * the identifier under the cursor, wrapping around the file, and show
+ * which one it is. */
+void editorJumpToOccurrence(int dir) {
+  identIndex *ix = &E.idents;
+  char word[256];
+  int start, end, at = 0, l, k = 0;
+
+  if (E.paging) {
+    editorSetStatusMessage("Occurrences are not indexed in paging mode");
+    return;
+  }
+  if (!editorGetWordAtCursor(word, &start, &end) ||
+      isdigit((unsigned char)word[0]) || end - start > 255) {
+    editorSetStatusMessage("No identifier under the cursor");
+    return;
+  }
+  identIndexBuild();
+  int len = strlen(word);
+  identEntry *e = identIndexLookup(word, len, 0);
+  if (e == NULL)
+    return;
+
+  /* Which occurrence in its row is the one under the cursor. */
+  erow *row = editorRowAt(E.rowoff + E.cy);
+  const char *s = identRowText(row, &ix->after, &ix->aftercap, 0);
+  while ((l = identNext(s, row->size, &at)) != 0 && at < start) {
+    if (l == len && memcmp(s + at, word, len) == 0)
+      k++;
+    at += l;
+  }
+  /* Number it among all the occurrences, and find the row of the target
+   * one, adding up the occurrences of the rows before. */
+  int rowpos = identIndexPosition(e, row), pos = k, j;
+  for (j = 0; j < rowpos; j++)
+    pos += e->occ[j].n;
+  pos = (pos + dir + e->total) % e->total;
+  for (j = 0, k = pos; k >= e->occ[j].n; j++)
+    k -= e->occ[j].n;
+
+  /* Find the column of the target occurrence in its row. */
+  row = e->occ[j].row;
+  s = identRowText(row, &ix->after, &ix->aftercap, 0);
+  at = 0;
+  while ((l = identNext(s, row->size, &at)) != 0) {
+    if (l == len && memcmp(s + at, word, len) == 0 && k-- == 0)
+      break;
+    at += l;
+  }
+
+  int filerow = editorRowIndex(row);
+  if (filerow < E.rowoff || filerow >= E.rowoff + E.screenrows) {
+    E.rowoff = filerow - E.screenrows / 2;
+    if (E.rowoff < 0)
+      E.rowoff = 0;
+  }
+  E.cy = filerow - E.rowoff;
+  E.coloff = 0;
+  E.cx = at;
+  if (E.cx >= E.screencols) {
+    E.coloff = E.cx - E.screencols + 1;
+    E.cx = E.screencols - 1;
+  }
+  editorSetStatusMessage("occurrence %d/%d", pos + 1, e->total);
+}
+
+/* =============================== Undo functionality ====================== */
+
+/* Push an operation onto the undo stack */
+void pushUndoOp(enum undo_type type, int row, int col, char *data,
+                int data_len) {
+  /* Limit undo stack size */
+  if (E.undo_count >= MAX_UNDO_STACK) {
+    /* Remove oldest operation */
+    undo_op *oldest = E.undo_stack;
+    while (oldest && oldest->next && oldest->next->next) {
+      oldest = oldest->next;
+    }
+    if (oldest && oldest->next) {
+      undo_op *to_remove = oldest->next;
+      oldest->next = NULL;
+      free(to_remove->data);
+      free(to_remove);
+      E.undo_count--;
+    }
+  }
+
+  /* Create new undo operation */
+  undo_op *op = malloc(sizeof(undo_op));
+  op->type = type;
+  op->row = row;
+  op->col = col;
+  op->data_len = data_len;
+  if (data && data_len > 0) {
+    op->data = malloc(data_len + 1);
+    memcpy(op->data, data, data_len);
+    op->data[data_len] = '\0';
+  } else {
+    op->data = NULL;
+  }
+
+  /* Push to front of stack */
+  op->next = E.undo_stack;
+  E.undo_stack = op;
+  E.undo_count++;
+}
+
+/* Pop and execute an undo operation */
+void executeUndo(void) {
+  if (!E.undo_stack) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+
+  undo_op *op = E.undo_stack;
+  E.undo_stack = op->next;
+  E.undo_count--;
+
+  switch (op->type) {
+  case UNDO_DELETE_LINE:
+    /* Restore deleted line */
+    if (op->data) {
+      editorInsertRow(op->row, op->data, op->data_len);
+      /* Move cursor to the restored line */
+      E.cy = 0;
+      E.cx = 0;
+      E.rowoff = op->row;
+      E.coloff = 0;
+      if (op->row < E.screenrows) {
+        E.cy = op->row;
+        E.rowoff = 0;
+      }
+      editorSetStatusMessage("Line restored");
+    }
+    break;
+  case UNDO_DELETE_CHAR:
+    /* Restore deleted character */
+    if (op->data && op->row < E.numrows) {
+      erow *row = editorRowAt(op->row);
+      editorRowInsertChar(row, op->col, op->data[0]);
+      /* Move cursor to after the restored character */
+      E.cy = op->row - E.rowoff;
+      E.cx = op->col + 1;
+      if (E.cy < 0) {
+        E.rowoff += E.cy;
+        E.cy = 0;
+      } else if (E.cy >= E.screenrows) {
+        E.rowoff += E.cy - E.screenrows + 1;
+        E.cy = E.screenrows - 1;
+      }
+      editorSetStatusMessage("Character restored");
+    }
+    break;
+  case UNDO_INSERT_CHAR:
+    /* Remove inserted character */
+    if (op->row < E.numrows) {
+      erow *row = editorRowAt(op->row);
+      if (op->col < row->size) {
+        editorRowDelChar(row, op->col);
+        /* Move cursor to the deletion point */
+        E.cy = op->row - E.rowoff;
+        E.cx = op->col;
+        editorSetStatusMessage("Character insertion undone");
+      }
+    }
+    break;
+  case UNDO_INSERT_LINE:
+    /* Remove inserted line */
+    if (op->row < E.numrows) {
+      editorDelRow(op->row);
+      /* Adjust cursor position */
+      if (op->row <= E.rowoff + E.cy) {
+        if (E.cy > 0) {
+          E.cy--;
+        } else if (E.rowoff > 0) {
+          E.rowoff--;
+        }
+      }
+      editorSetStatusMessage("Line insertion undone");
+    }
+    break;
+  case UNDO_REPLACE: {
+    int count = editorUndoReplace(op->data, op->data_len);
+    if (count == -1)
+      editorSetStatusMessage("Can't undo the replace: the rows changed since");
+    else
+      editorSetStatusMessage("Replaced %d occurrences back", count);
+    break;
+  }
+  }
+
+  /* Clean up */
+  free(op->data);
+  free(op);
+}
+
+/* Clear all undo operations */
+void clearUndoStack(void) {
+  while (E.undo_stack) {
+    undo_op *op = E.undo_stack;
+    E.undo_stack = op->next;
+    free(op->data);
+    free(op);
+  }
+  E.undo_count = 0;
+}
+
+/* ============================= Substring search =========================== */
+
+/* Searches run over the content of the rows in bulk: rows untouched since
+ * the file was loaded still follow each other in E.orig, newlines
+ * included, and are searched as a single buffer, so the cost of finding
+ * a rare string in a large file is the cost of reading it. Patterns never
+ * contain newlines, so matches can't span rows.
+ *
+ * Short patterns are found comparing their first and last byte with 32 (or
+ * 16) windows at once, so only the windows matching both are compared in
+ * full. Longer ones use Horspool, that skips up to the pattern length at
+ * every step. */
+#define SEARCH_SIMD_MAX 64  /* Longer patterns use Horspool. */
+#define SEARCH_CHUNK (1 << 20) /* Bytes of rows searched at once. */
+
+void searchCompile(searchPattern *p, const char *s, int len) {
+  p->s = s;
+  p->len = len;
+  for (int j = 0; j < 256; j++)
+    p->shift[j] = len;
+  for (int j = 0; j < len - 1; j++)
+    p->shift[(unsigned char)s[j]] = len - 1 - j;
+}
+
+/* Return the first occurrence of the pattern in [hay, end), or NULL. */
+const char *searchFind(searchPattern *p, const char *hay, const char *end) {
+  const char *s = p->s;
+  int len = p->len;
+
+  if (end - hay < len)
+    return NULL;
+  if (len <= 1)
+    return len ? memchr(hay, s[0], end - hay) : hay;
+  const char *last = end - len; /* Last window. */
+
+#if defined(__AVX2__)
+  if (len <= SEARCH_SIMD_MAX) {
+    const __m256i first = _mm256_set1_epi8(s[0]);
+    const __m256i final = _mm256_set1_epi8(s[len - 1]);
+    for (; hay + 32 <= last + 1; hay += 32) {
+      __m256i a = _mm256_loadu_si256((const __m256i *)hay);
+      __m256i b = _mm256_loadu_si256((const __m256i *)(hay + len - 1));
+      unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(
+          _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, final)));
+      while (mask) {
+        int j = __builtin_ctz(mask);
+        if (memcmp(hay + j + 1, s + 1, len - 2) == 0)
+          return hay + j;
+        mask &= mask - 1;
+      }
+    }
+  }
+#elif defined(__SSE2__)
+  if (len <= SEARCH_SIMD_MAX) {
+    const __m128i first = _mm_set1_epi8(s[0]);
+    const __m128i final = _mm_set1_epi8(s[len - 1]);
+    for (; hay + 16 <= last + 1; hay += 16) {
+      __m128i a = _mm_loadu_si128((const __m128i *)hay);
+      __m128i b = _mm_loadu_si128((const __m128i *)(hay + len - 1));
+      unsigned int mask = (unsigned int)_mm_movemask_epi8(
+          _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, final)));
+      while (mask) {
+        int j = __builtin_ctz(mask);
+        if (memcmp(hay + j + 1, s + 1, len - 2) == 0)
+          return hay + j;
+        mask &= mask - 1;
+      }
+    }
+  }
+#endif
+  while (hay <= last) {
+    unsigned char c = hay[len - 1];
+    if (c == (unsigned char)s[len - 1] && memcmp(hay, s, len - 1) == 0)
+      return hay;
+    hay += p->shift[c];
+  }
+  return NULL;
+}
+
+/* Searches of the find prompt run on the whole file in the background, and
+ * give every match: the prompt shows how many there are, highlights the
+ * ones on screen, and moves between them in the list.
+ *
+ * A job first takes the content of the rows, on the main thread, as spans
+ * of consecutive rows separated by newlines: rows and pages still in E.orig
+ * are pointed to, whole leaves at once when unchanged, others are copied.
+ * Threads then search their share of the spans, counting the newlines
+ * before every match to know its row, and the lists they produce are joined
+ * once they are all done. A job is cancelled as soon as the query changes:
+ * threads check it between spans.
+ *
+ * Finished searches are kept in a stack while the prompt is open, since
+ * the file can't change meanwhile. When a text query grows, only the rows
+ * that matched the previous one can match, so the new job searches just
+ * those. When it shrinks back with Backspace, the search of that query is
+ * found again in the stack. */
+
+/* Add a span of 'len' bytes at 'buf', starting with the row 'row'. It
+ * extends the previous span instead if it follows it one newline apart,
+ * both in E.orig or both in the last chunk of copies. */
+void searchJobAddSpan(searchJob *j, const char *buf, size_t len, int row) {
+  if (j->nspans) {
+    searchSpan *last = j->spans + j->nspans - 1;
+    const char *end = last->buf + last->len;
+    int orig = last->buf >= E.orig.base && buf < E.orig.base + E.orig.len;
+    int copy = j->copy && last->buf > j->copy &&
+               buf < j->copy + j->copysize;
+    if (last->len < SEARCH_CHUNK &&
+        ((orig && buf == end + 1 + E.crlf) || (copy && buf == end + 1))) {
+      last->len = buf + len - last->buf;
+      return;
+    }
+  }
+  if (j->nspans == j->spancap) {
+    j->spancap = j->spancap ? j->spancap * 2 : 64;
+    j->spans = realloc(j->spans, sizeof(searchSpan) * j->spancap);
+  }
+  j->spans[j->nspans].buf = buf;
+  j->spans[j->nspans].len = len;
+  j->spans[j->nspans].row = row;
+  j->nspans++;
+}
+
+/* Add a copy of a row, followed by a newline so that the next copy can
+ * join its span. Copies are packed in chunks that are never moved. */
+void searchJobCopyRow(searchJob *j, erow *row, int at) {
+  size_t len = row->size + 1;
+
+  if (j->copy == NULL || j->copyused + len > j->copysize) {
+    size_t size = len + 16 > KILO_SAVE_CHUNK ? len + 16 : KILO_SAVE_CHUNK;
+    char *chunk = malloc(size);
+    /* The first bytes of a chunk link it to the previous one. */
+    *(char **)chunk = j->copy;
+    j->copy = chunk;
+    j->copyused = 16;
+    j->copysize = size;
+  }
+
+  char *p = j->copy + j->copyused;
+  memcpy(p, row->chars, row->size);
+  p[row->size] = '\n';
+  j->copyused += len;
+  searchJobAddSpan(j, p, row->size, at);
+}
+
+/* Take the content of every row for the job. */
+void searchJobSnapshot(searchJob *j) {
+  int at = 0;
+
+  editorRowGapClose();
+  for (rowNode *u = rowTreeFirstUnit(E.rows); u; u = rowTreeNextUnit(u)) {
+    if (!u->leaf) {
+      /* A page that is not loaded is still as it is in E.orig. Its last
+       * newline goes, as spans hold none after their last row. */
+      const char *buf = E.orig.base + u->page->off;
+      size_t len = u->page->len;
+      if (len && buf[len - 1] == '\n')
+        len -= 1 + (E.crlf && len > 1 && buf[len - 2] == '\r');
+      searchJobAddSpan(j, buf, len, at);
+      at += u->count;
+      continue;
+    }
+    if (u->pristine && u->n) {
+      erow *first = u->u.rows[0], *last = u->u.rows[u->n - 1];
+      searchJobAddSpan(j, first->chars, last->chars + last->size - first->chars,
+                       at);
+      at += u->n;
+      continue;
+    }
+    for (int k = 0; k < u->n; k++, at++) {
+      erow *row = u->u.rows[k];
+      if (row->flags & ROW_VIEW)
+        searchJobAddSpan(j, row->chars, row->size, at);
+      else
+        searchJobCopyRow(j, row, at);
+    }
+  }
+}
+
+void searchJobFree(searchJob *j) {
+  while (j->copy) {
+    char *prev = *(char **)j->copy;
+    free(j->copy);
+    j->copy = prev;
+  }
+  for (int k = 0; k < j->nparts; k++) {
+    free(j->parts[k].matches);
+    free(j->parts[k].lines);
+    reExecFree(&j->parts[k].exec);
+  }
+  if (j->re)
+    regexFree(j->re);
+  pthread_mutex_destroy(&j->lock);
+  free(j->spans);
+  free(j->lines);
+  free(j->matches);
+  free(j->query);
+  free(j);
+}
 
-        // Draw indent guides for empty line
-        while (source_col < indent_level && screen_col < E.screencols) {
-          if (source_col % TAB_SIZE == 0 && source_col > 0) {
-            abAppend(&ab, "\x1b[2m", 4); // dim
-            abAppend(&ab, "|", 1);
-            abAppend(&ab, "\x1b[0m", 4); // reset
-          } else {
-            abAppend(&ab, " ", 1);
-          }
-          source_col++;
-          screen_col++;
-        }
+void searchPartAdd(searchPart *part, int row, int col, int len) {
+  if (part->count == part->cap) {
+    part->cap = part->cap ? part->cap * 2 : 64;
+    part->matches = realloc(part->matches, sizeof(searchMatch) * part->cap);
+  }
+  part->matches[part->count].row = row;
+  part->matches[part->count].col = col;
+  part->matches[part->count].len = len;
+  part->count++;
+}
+
+/* Add the matches of the span to 'part', and the rows that hold them as
+ * spans of their own. Literal matches may overlap. */
+void searchLiteralSpan(searchPart *part, searchSpan *sp) {
+  searchPattern *pat = &part->job->pat;
+  const char *end = sp->buf + sp->len, *line = sp->buf, *m = sp->buf, *nl;
+  int row = sp->row;
+
+  while ((m = searchFind(pat, m, end)) != NULL) {
+    while ((nl = memchr(line, '\n', m - line)) != NULL) {
+      line = nl + 1;
+      row++;
+    }
+    if (part->nlines == 0 || part->lines[part->nlines - 1].row != row) {
+      if (part->nlines == part->linecap) {
+        part->linecap = part->linecap ? part->linecap * 2 : 64;
+        part->lines =
+            realloc(part->lines, sizeof(searchSpan) * part->linecap);
       }
+      if ((nl = memchr(m, '\n', end - m)) == NULL)
+        nl = end;
+      part->lines[part->nlines].buf = line;
+      part->lines[part->nlines].len = nl - line;
+      part->lines[part->nlines].row = row;
+      part->nlines++;
+    }
+    searchPartAdd(part, row, m - line, pat->len);
+    m++;
+  }
+}
 
-      // Fill remaining space and draw colorcolumn if visible
-      if ((E.screencols - lineno_width) >= 80) {
-        int pad = 80 - screen_col;
-        while (pad-- > 0) {
-          abAppend(&ab, " ", 1);
-          screen_col++;
-        }
-        abAppend(&ab, "\x1b[7m \x1b[0m", 9);
+/* Add the matches of the regex in the span to 'part'. When the regex has
+ * a literal prefix, only the lines holding it are looked at. Lines where
+ * finding the matches takes too long only get those found until then. */
+void searchRegexSpan(searchPart *part, searchSpan *sp) {
+  searchPattern *pat = &part->job->pat;
+  const char *end = sp->buf + sp->len, *line = sp->buf, *m, *nl;
+  int row = sp->row, start, stop;
+
+  while (1) {
+    if (pat->len) {
+      if ((m = searchFind(pat, line, end)) == NULL)
+        break;
+      while ((nl = memchr(line, '\n', m - line)) != NULL) {
+        line = nl + 1;
+        row++;
       }
     }
-    abAppend(&ab, "\x1b[39m", 5);
-    if (y == E.cy)
-      abAppend(&ab, "\x1b[0m", 4); // reset after active line
-    abAppend(&ab, "\x1b[0K", 4);
-    abAppend(&ab, "\r\n", 2);
+    if ((nl = memchr(line, '\n', end - line)) == NULL)
+      nl = end;
+    int len = nl - line, from = 0;
+    if (E.crlf && len && line[len - 1] == '\r')
+      len--;
+    if (reLineHasMatch(&part->exec, line, len)) {
+      part->exec.budget = (long)len * RE_LINE_STEPS + RE_LINE_STEPS_MIN;
+      while (from < len &&
+             reLineNext(&part->exec, line, len, from, &start, &stop)) {
+        searchPartAdd(part, row, start, stop - start);
+        from = stop;
+      }
+    }
+    if (nl == end)
+      break;
+    line = nl + 1;
+    row++;
   }
+}
 
-  /* Create a two rows status. First row: */
-  abAppend(&ab, "\x1b[0K", 4);
-  abAppend(&ab, "\x1b[7m", 4);
-  char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                     E.filename ? E.filename : "[No Name]", E.numrows,
-                     E.dirty ? "(modified)" : "");
-  snprintf(rstatus, sizeof(rstatus), "%d:%d", E.rowoff + E.cy + 1,
-           E.coloff + E.cx + 1);
-  if (len > E.screencols)
-    len = E.screencols;
-  abAppend(&ab, status, len);
-  while (len < E.screencols) {
-    if (E.screencols - len == (int)strlen(rstatus)) {
-      abAppend(&ab, rstatus, strlen(rstatus));
+void *searchWorker(void *arg) {
+  searchPart *part = arg;
+  searchJob *j = part->job;
+
+  for (int k = part->first; k < part->last; k++) {
+    pthread_mutex_lock(&j->lock);
+    int cancel = j->cancel;
+    pthread_mutex_unlock(&j->lock);
+    if (cancel)
       break;
+    if (j->re)
+      searchRegexSpan(part, j->spans + k);
+    else
+      searchLiteralSpan(part, j->spans + k);
+  }
+  pthread_mutex_lock(&j->lock);
+  part->finished = 1;
+  pthread_mutex_unlock(&j->lock);
+  return NULL;
+}
+
+/* Wait for the thread of a part, if it has one. */
+void searchPartJoin(searchPart *part) {
+  if (part->started && !part->joined) {
+    pthread_join(part->tid, NULL);
+    part->joined = 1;
+  }
+}
+
+/* Take as spans the rows holding the matches of 'below'. Rows that follow
+ * each other in the same buffer make a single span. */
+void searchJobNarrow(searchJob *j, searchJob *below) {
+  int lastrow = 0;
+
+  j->spans = malloc(sizeof(searchSpan) * (below->nlines + 1));
+  for (int k = 0; k < below->nlines; k++) {
+    searchSpan *line = below->lines + k, *last = j->spans + j->nspans - 1;
+    if (j->nspans && line->row == lastrow + 1 &&
+        line->buf == last->buf + last->len + 1 && last->len < SEARCH_CHUNK) {
+      last->len += line->len + 1;
     } else {
-      abAppend(&ab, " ", 1);
-      len++;
+      j->spans[j->nspans++] = *line;
     }
+    lastrow = line->row;
   }
-  abAppend(&ab, "\x1b[0m\r\n", 6);
+  j->spancap = below->nlines + 1;
+}
 
-  /* Second row depends on E.statusmsg and the status message update time. */
-  abAppend(&ab, "\x1b[0K", 4);
-  int msglen = strlen(E.statusmsg);
-  if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(&ab, E.statusmsg, msglen <= E.screencols ? msglen : E.screencols);
+/* Stop the search on top of the stack and drop it. */
+void searchJobPop(void) {
+  searchJob *j = E.search;
+
+  pthread_mutex_lock(&j->lock);
+  j->cancel = 1;
+  pthread_mutex_unlock(&j->lock);
+  for (int k = 0; k < j->nparts; k++)
+    searchPartJoin(j->parts + k);
+  E.search = j->prev;
+  searchJobFree(j);
+}
 
-  /* Put cursor at its current position. Note that the horizontal position
-   * at which the cursor is displayed may be different compared to 'E.cx'
-   * because of TABs. */
-  int j;
-  int cx = lineno_width + 1; // account for line number margin
-  int filerow = E.rowoff + E.cy;
-  erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
-  if (row) {
-    for (j = E.coloff; j < (E.cx + E.coloff); j++) {
-      if (j < row->size && row->chars[j] == TAB)
-        cx += 7 - ((cx) % 8);
-      cx++;
-    }
+/* Drop the oldest search if the stack is too deep. The copies of rows
+ * it made go to the search above, that may be reading them. */
+void searchJobTrim(void) {
+  searchJob *above = NULL, *j = E.search;
+  int depth = 1;
+
+  while (j->prev) {
+    above = j;
+    j = j->prev;
+    depth++;
   }
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy + 1, cx);
-  abAppend(&ab, buf, strlen(buf));
-  abAppend(&ab, "\x1b[?25h", 6); /* Show cursor. */
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+  if (depth <= KILO_SEARCH_STACK)
+    return;
+
+  char **tail = &above->copy;
+  while (*tail)
+    tail = (char **)*tail;
+  *tail = j->copy;
+  j->copy = NULL;
+  above->prev = NULL;
+  searchJobFree(j);
 }
 
-/* Set an editor status message for the second line of the status, at the
- * end of the screen. */
-void editorSetStatusMessage(const char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-  va_end(ap);
-  E.statusmsg_time = time(NULL);
+/* Start searching the whole file for the 'len' bytes of 'query'. Small
+ * files are searched on the spot. In regex mode the query is a regex: if
+ * it is not valid, the search is done at once with no matches and j->error
+ * set.
+ *
+ * The searches of the stack whose query is not the start of this one are
+ * dropped first. If the one left has the same query it is used again, else
+ * the new search goes on top, and when the query is text it only looks at
+ * the rows that matched the one below. */
+void editorSearchStart(const char *query, int len) {
+  searchJob *below;
+
+  if (E.search && !E.search->done)
+    searchJobPop();
+  while ((below = E.search) != NULL) {
+    int blen = strlen(below->query);
+    if (below->regex == E.findregex && blen <= len &&
+        memcmp(below->query, query, blen) == 0)
+      break;
+    searchJobPop();
+  }
+  if (len == 0)
+    return;
+  if (below && (int)strlen(below->query) == len) {
+    below->cur = -1;
+    return;
+  }
+
+  searchJob *j = calloc(1, sizeof(*j));
+  j->query = malloc(len + 1);
+  memcpy(j->query, query, len);
+  j->query[len] = '\0';
+  j->regex = E.findregex;
+  j->cur = -1;
+  j->prev = below;
+  pthread_mutex_init(&j->lock, NULL);
+  E.search = j;
+  searchJobTrim();
+  if (j->regex) {
+    j->re = regexCompile(j->query, len, &j->error);
+    if (j->re == NULL) {
+      j->done = 1;
+      return;
+    }
+    searchCompile(&j->pat, j->re->prefix, j->re->prefixlen);
+  } else {
+    searchCompile(&j->pat, j->query, len);
+  }
+  if (below && !j->regex && below->error == NULL) {
+    searchJobNarrow(j, below);
+  } else {
+    searchJobSnapshot(j);
+  }
+
+  /* Give every thread about the same number of bytes. */
+  size_t total = 0, done = 0;
+  for (int k = 0; k < j->nspans; k++)
+    total += j->spans[k].len;
+  int nthreads = editorThreadCount(total, KILO_SEARCH_THREADED_MIN);
+  int k = 0;
+  for (int n = 0; n < nthreads && k < j->nspans; n++) {
+    searchPart *part = j->parts + j->nparts++;
+    part->job = j;
+    part->first = k;
+    if (j->re)
+      reExecInit(&part->exec, j->re);
+    while (k < j->nspans &&
+           (n == nthreads - 1 || done < total / nthreads * (n + 1)))
+      done += j->spans[k++].len;
+    part->last = k;
+  }
+  for (int n = 0; n < j->nparts; n++) {
+    searchPart *part = j->parts + n;
+    part->started = nthreads > 1 &&
+                    pthread_create(&part->tid, NULL, searchWorker, part) == 0;
+    if (!part->started)
+      searchWorker(part);
+  }
+  if (nthreads == 1)
+    editorSearchPoll(1);
 }
 
-/* =============================== Word highlighting ======================= */
+/* Stop the search, dropping its results and the stack of earlier ones. */
+void editorSearchStop(void) {
+  while (E.search)
+    searchJobPop();
+}
 
-/* Get the word under the cursor. Returns 1 if a word is found, 0 otherwise. */
-int editorGetWordAtCursor(char *word, int *start_pos, int *end_pos) {
-  int filerow = E.rowoff + E.cy;
-  int filecol = E.coloff + E.cx;
+/* Join the matches of every part once they are all done, or right away
+ * waiting for them if 'wait' is set. Returns 1 if the search just got
+ * done, after showing its results. */
+int editorSearchPoll(int wait) {
+  searchJob *j = E.search;
 
-  if (filerow >= E.numrows)
+  if (j == NULL || j->done)
     return 0;
+  if (!wait) {
+    int finished = 1;
+    pthread_mutex_lock(&j->lock);
+    for (int k = 0; k < j->nparts; k++)
+      finished &= j->parts[k].finished;
+    pthread_mutex_unlock(&j->lock);
+    if (!finished)
+      return 0;
+  }
+  j->count = j->nlines = 0;
+  for (int k = 0; k < j->nparts; k++) {
+    searchPartJoin(j->parts + k);
+    j->count += j->parts[k].count;
+    j->nlines += j->parts[k].nlines;
+  }
+  j->matches = malloc(sizeof(searchMatch) * (j->count + 1));
+  j->lines = malloc(sizeof(searchSpan) * (j->nlines + 1));
+  j->count = j->nlines = 0;
+  for (int k = 0; k < j->nparts; k++) {
+    searchPart *part = j->parts + k;
+    if (part->count == 0)
+      continue;
+    memcpy(j->matches + j->count, part->matches,
+           sizeof(searchMatch) * part->count);
+    if (part->nlines)
+      memcpy(j->lines + j->nlines, part->lines,
+             sizeof(searchSpan) * part->nlines);
+    j->count += part->count;
+    j->nlines += part->nlines;
+    free(part->matches);
+    free(part->lines);
+    part->matches = NULL;
+    part->lines = NULL;
+  }
+  j->done = 1;
+  editorSearchShow(j->query);
+  return 1;
+}
 
-  erow *row = &E.row[filerow];
-  if (filecol >= row->size)
+/* Make the first match of the file the current one, waiting for the part
+ * of the search that has it. Returns 0 if there is no match. */
+int editorSearchFirst(void) {
+  searchJob *j = E.search;
+
+  if (j == NULL)
     return 0;
+  if (j->done) {
+    if (j->count == 0)
+      return 0;
+    j->current = j->matches[0];
+  } else {
+    int k;
+    for (k = 0; k < j->nparts; k++) {
+      searchPartJoin(j->parts + k);
+      if (j->parts[k].count)
+        break;
+    }
+    if (k == j->nparts)
+      return 0;
+    j->current = j->parts[k].matches[0];
+  }
+  j->cur = 0;
+  return 1;
+}
 
-  /* Check if cursor is on a word character */
-  if (!isalnum(row->chars[filecol]) && row->chars[filecol] != '_')
+/* Return the index of the first match at or after the column 'col' of the
+ * row 'row', or j->count if there is none. */
+int editorSearchLocate(searchJob *j, int row, int col) {
+  int lo = 0, hi = j->count;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    searchMatch *m = j->matches + mid;
+    if (m->row < row || (m->row == row && m->col < col))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Write 'n' with a comma every three digits. */
+char *editorFormatCount(char *buf, int n) {
+  char digits[16];
+  int len = snprintf(digits, sizeof(digits), "%d", n), j = 0;
+
+  for (int k = 0; k < len; k++) {
+    if (k && (len - k) % 3 == 0)
+      buf[j++] = ',';
+    buf[j++] = digits[k];
+  }
+  buf[j] = '\0';
+  return buf;
+}
+
+/* Show the state of the search for 'query' in the status, and highlight
+ * the matches on screen, or just the current one until all are known. */
+void editorSearchShow(const char *query) {
+  searchJob *j = E.search;
+  const char *mode = E.findregex ? "Regex search" : "Search";
+  char cur[16], count[16];
+
+  editorOverlayClear(OVERLAY_MATCH);
+  if (j == NULL) {
+    editorSetStatusMessage("%s: %s (Use ESC/Arrows/Enter, Tab for %s)", mode,
+                           query, E.findregex ? "text" : "regex");
+    return;
+  }
+  if (j->error) {
+    editorSetStatusMessage("%s: %s (%s)", mode, query, j->error);
+    return;
+  } else if (!j->done) {
+    editorSetStatusMessage("%s: %s (searching...)", mode, query);
+  } else if (j->count == 0) {
+    editorSetStatusMessage("%s: %s (no matches)", mode, query);
+    return;
+  } else {
+    editorSetStatusMessage("%s: %s (match %s of %s)", mode, query,
+                           editorFormatCount(cur, j->cur + 1),
+                           editorFormatCount(count, j->count));
+  }
+
+  int first = j->cur, last = j->cur + 1;
+  if (j->done) {
+    first = editorSearchLocate(j, E.rowoff, 0);
+    last = editorSearchLocate(j, E.rowoff + E.screenrows, 0);
+  }
+  for (int k = first; k < last && k >= 0; k++) {
+    searchMatch *m = j->done ? j->matches + k : &j->current;
+    erow *row = editorRowAt(m->row);
+    int col = editorRowRenderCol(row, m->col);
+    editorOverlayAdd(OVERLAY_MATCH, m->row, col,
+                     editorRowRenderCol(row, m->col + m->len) - col);
+  }
+}
+
+/* ========================== Regular expressions =========================== */
+
+/* Patterns are parsed to a tree, then compiled to the program of a
+ * Thompson NFA. The syntax is the usual one, matching inside a line:
+ *
+ *   .  [abc] [^a-z]  \d \w \s \D \W \S  \t   bytes, classes of bytes
+ *   ^ $                                   start and end of the line
+ *   * + ? {n} {n,} {n,m}                  repetitions
+ *   a|b (...)                             alternatives, groups
+ *
+ * Any other escaped byte stands for itself. Of the matches starting at
+ * the same offset, the longest one wins, and matches are never empty. */
+enum reNodeType {
+  RN_EMPTY,
+  RN_CLASS,
+  RN_BOL,
+  RN_EOL,
+  RN_CAT,
+  RN_ALT,
+  RN_REPEAT
+};
+
+typedef struct reNode {
+  int type;
+  int a, b;     /* Children, or the class of RN_CLASS in 'a'. */
+  int min, max; /* Bounds of RN_REPEAT, max -1 for no bound. */
+} reNode;
+
+typedef struct reParser {
+  const char *p, *end; /* Pattern left to parse. */
+  reNode *nodes;
+  int n;
+  regex *re;
+  const char *error;
+} reParser;
+
+int reNewNode(reParser *ps, int type, int a, int b) {
+  reNode *node = ps->nodes + ps->n;
+  node->type = type;
+  node->a = a;
+  node->b = b;
+  node->min = node->max = 0;
+  return ps->n++;
+}
+
+/* Add a class of no bytes to the regex, returning its index. */
+int reNewClass(regex *re) {
+  re->classes = realloc(re->classes, sizeof(re->classes[0]) *
+                                         (re->nclasses + 1));
+  memset(re->classes[re->nclasses], 0, sizeof(re->classes[0]));
+  return re->nclasses++;
+}
+
+void reClassSet(unsigned char *cls, int c) { cls[c >> 3] |= 1 << (c & 7); }
+
+int reClassHas(const unsigned char *cls, int c) {
+  return cls[c >> 3] & (1 << (c & 7));
+}
+
+/* Add to 'cls' the bytes of the escape \c, if it is a class. Returns 0 if
+ * it is not. */
+int reClassEscape(unsigned char *cls, int c) {
+  int neg = isupper(c);
+
+  if (strchr("dDwWsS", c) == NULL)
     return 0;
+  for (int k = 0; k < 256; k++) {
+    int in;
+    switch (tolower(c)) {
+    case 'd': in = isdigit(k); break;
+    case 'w': in = isalnum(k) || k == '_'; break;
+    default: in = k == ' ' || (k >= '\t' && k <= '\r'); break;
+    }
+    if (!in != !neg && k != '\n')
+      reClassSet(cls, k);
+  }
+  return 1;
+}
 
-  /* Find start of word */
-  int start = filecol;
-  while (start > 0 &&
-         (isalnum(row->chars[start - 1]) || row->chars[start - 1] == '_')) {
-    start--;
+/* Parse the byte of an escape that is not a class. */
+int reParseEscape(reParser *ps, int c) {
+  if (c == 't')
+    return '\t';
+  if (isalnum(c)) {
+    ps->error = "unknown escape";
+    return -1;
   }
+  return c;
+}
 
-  /* Find end of word */
-  int end = filecol;
-  while (end < row->size &&
-         (isalnum(row->chars[end]) || row->chars[end] == '_')) {
-    end++;
+/* Parse a bracket expression, the '[' already read. */
+int reParseBracket(reParser *ps) {
+  int cls = reNewClass(ps->re), neg = 0, first = 1;
+  unsigned char *set = ps->re->classes[cls];
+
+  if (ps->p < ps->end && *ps->p == '^') {
+    neg = 1;
+    ps->p++;
+  }
+  while (ps->p < ps->end && (*ps->p != ']' || first)) {
+    int lo = (unsigned char)*ps->p++;
+    first = 0;
+    if (lo == '\\' && ps->p < ps->end) {
+      lo = (unsigned char)*ps->p++;
+      if (reClassEscape(set, lo))
+        continue;
+      if ((lo = reParseEscape(ps, lo)) < 0)
+        return -1;
+    }
+    int hi = lo;
+    if (ps->end - ps->p >= 2 && ps->p[0] == '-' && ps->p[1] != ']') {
+      hi = (unsigned char)ps->p[1];
+      ps->p += 2;
+      if (hi == '\\' && ps->p < ps->end &&
+          (hi = reParseEscape(ps, (unsigned char)*ps->p++)) < 0)
+        return -1;
+      if (hi < lo) {
+        ps->error = "bad range";
+        return -1;
+      }
+    }
+    for (int k = lo; k <= hi; k++)
+      reClassSet(set, k);
   }
+  if (ps->p == ps->end) {
+    ps->error = "missing ]";
+    return -1;
+  }
+  ps->p++;
+  if (neg) {
+    for (int k = 0; k < 32; k++)
+      set[k] = ~set[k];
+    set['\n' >> 3] &= ~(1 << ('\n' & 7));
+  }
+  return reNewNode(ps, RN_CLASS, cls, 0);
+}
 
-  /* Extract word */
-  int word_len = end - start;
-  if (word_len > 255)
-    word_len = 255; /* Limit word length */
+int reParseAlt(reParser *ps);
 
-  strncpy(word, row->chars + start, word_len);
-  word[word_len] = '\0';
+int reParseAtom(reParser *ps) {
+  int c = (unsigned char)*ps->p++, cls;
 
-  *start_pos = start;
-  *end_pos = end;
+  switch (c) {
+  case '(': {
+    int node = reParseAlt(ps);
+    if (node < 0)
+      return -1;
+    if (ps->p == ps->end || *ps->p != ')') {
+      ps->error = "missing )";
+      return -1;
+    }
+    ps->p++;
+    return node;
+  }
+  case '[':
+    return reParseBracket(ps);
+  case '^':
+    return reNewNode(ps, RN_BOL, 0, 0);
+  case '$':
+    return reNewNode(ps, RN_EOL, 0, 0);
+  case '*':
+  case '+':
+  case '?':
+  case '{':
+    ps->error = "nothing to repeat";
+    return -1;
+  case '.':
+    cls = reNewClass(ps->re);
+    for (int k = 0; k < 256; k++)
+      if (k != '\n')
+        reClassSet(ps->re->classes[cls], k);
+    return reNewNode(ps, RN_CLASS, cls, 0);
+  case '\\':
+    if (ps->p == ps->end) {
+      ps->error = "trailing \\";
+      return -1;
+    }
+    c = (unsigned char)*ps->p++;
+    cls = reNewClass(ps->re);
+    if (reClassEscape(ps->re->classes[cls], c))
+      return reNewNode(ps, RN_CLASS, cls, 0);
+    if ((c = reParseEscape(ps, c)) < 0)
+      return -1;
+    /* Fall through. */
+  default:
+    cls = reNewClass(ps->re);
+    reClassSet(ps->re->classes[cls], c);
+    return reNewNode(ps, RN_CLASS, cls, 0);
+  }
+}
 
-  return word_len > 0 ? 1 : 0;
+/* Parse a number of a {n,m} repetition. */
+int reParseCount(reParser *ps) {
+  int n = 0, digits = 0;
+
+  while (ps->p < ps->end && isdigit((unsigned char)*ps->p) && n < 1000) {
+    n = n * 10 + *ps->p++ - '0';
+    digits++;
+  }
+  return digits ? n : -1;
+}
+
+int reParseRepeat(reParser *ps) {
+  int node = reParseAtom(ps);
+
+  while (node >= 0 && ps->p < ps->end && strchr("*+?{", *ps->p)) {
+    int min = 0, max = -1, c = *ps->p++;
+    if (c == '+') {
+      min = 1;
+    } else if (c == '?') {
+      max = 1;
+    } else if (c == '{') {
+      min = max = reParseCount(ps);
+      if (ps->p < ps->end && *ps->p == ',') {
+        ps->p++;
+        if (ps->p < ps->end && *ps->p == '}')
+          max = -1;
+        else if ((max = reParseCount(ps)) == -1)
+          min = -1;
+      }
+      if (min < 0 || ps->p == ps->end || *ps->p != '}' ||
+          (max != -1 && max < min)) {
+        ps->error = "bad repetition";
+        return -1;
+      }
+      ps->p++;
+    }
+    node = reNewNode(ps, RN_REPEAT, node, 0);
+    ps->nodes[node].min = min;
+    ps->nodes[node].max = max;
+  }
+  return node;
+}
+
+int reParseCat(reParser *ps) {
+  int node = -1;
+
+  while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+    int next = reParseRepeat(ps);
+    if (next < 0)
+      return -1;
+    node = node < 0 ? next : reNewNode(ps, RN_CAT, node, next);
+  }
+  return node < 0 ? reNewNode(ps, RN_EMPTY, 0, 0) : node;
+}
+
+int reParseAlt(reParser *ps) {
+  int node = reParseCat(ps);
+
+  while (node >= 0 && ps->p < ps->end && *ps->p == '|') {
+    ps->p++;
+    int next = reParseCat(ps);
+    if (next < 0)
+      return -1;
+    node = reNewNode(ps, RN_ALT, node, next);
+  }
+  return node;
+}
+
+/* Append an instruction to the program, returning its address. */
+int reEmit(reParser *ps, int op, int x, int y) {
+  regex *re = ps->re;
+
+  if (re->len == RE_MAX_INSTS) {
+    ps->error = "pattern too large";
+    return -1;
+  }
+  re->prog[re->len].op = op;
+  re->prog[re->len].x = x;
+  re->prog[re->len].y = y;
+  return re->len++;
+}
+
+/* Compile the tree at 'node'. Returns -1 if the program gets too long. */
+int reCompileNode(reParser *ps, int node) {
+  reNode *nd = ps->nodes + node;
+  regex *re = ps->re;
+  int split, jmp, k;
+
+  switch (nd->type) {
+  case RN_EMPTY:
+    return 0;
+  case RN_CLASS:
+    return reEmit(ps, RE_CLASS, nd->a, 0) < 0 ? -1 : 0;
+  case RN_BOL:
+    return reEmit(ps, RE_BOL, 0, 0) < 0 ? -1 : 0;
+  case RN_EOL:
+    return reEmit(ps, RE_EOL, 0, 0) < 0 ? -1 : 0;
+  case RN_CAT:
+    if (reCompileNode(ps, nd->a) < 0)
+      return -1;
+    return reCompileNode(ps, nd->b);
+  case RN_ALT:
+    if ((split = reEmit(ps, RE_SPLIT, 0, 0)) < 0)
+      return -1;
+    re->prog[split].x = re->len;
+    if (reCompileNode(ps, nd->a) < 0 || (jmp = reEmit(ps, RE_JMP, 0, 0)) < 0)
+      return -1;
+    re->prog[split].y = re->len;
+    if (reCompileNode(ps, nd->b) < 0)
+      return -1;
+    re->prog[jmp].x = re->len;
+    return 0;
+  default: /* RN_REPEAT */
+    for (k = 0; k < nd->min; k++) {
+      /* The last copy loops if there is no bound. */
+      int start = re->len;
+      if (reCompileNode(ps, nd->a) < 0)
+        return -1;
+      if (k == nd->min - 1 && nd->max == -1)
+        return reEmit(ps, RE_SPLIT, start, re->len + 1) < 0 ? -1 : 0;
+    }
+    if (nd->max == -1) {
+      if ((split = reEmit(ps, RE_SPLIT, re->len + 1, 0)) < 0 ||
+          reCompileNode(ps, nd->a) < 0 || reEmit(ps, RE_JMP, split, 0) < 0)
+        return -1;
+      re->prog[split].y = re->len;
+      return 0;
+    }
+    /* Optional copies: a(a(a)?)? as a?a?a? where every split skips to the
+     * end, patched once it is known. */
+    int first = re->len;
+    for (; k < nd->max; k++) {
+      if (reEmit(ps, RE_SPLIT, re->len + 1, -1) < 0 ||
+          reCompileNode(ps, nd->a) < 0)
+        return -1;
+    }
+    for (k = first; k < re->len; k++)
+      if (re->prog[k].op == RE_SPLIT && re->prog[k].y == -1)
+        re->prog[k].y = re->len;
+    return 0;
+  }
 }
 
-/* Highlight all occurrences of the word under cursor */
-void editorHighlightWordUnderCursor(void) {
-  char word[256];
-  int start_pos, end_pos;
-
-  /* Clear existing underline highlights */
-  for (int i = 0; i < E.numrows; i++) {
-    erow *row = &E.row[i];
-    if (row->hl) {
-      for (int j = 0; j < row->rsize; j++) {
-        if (row->hl[j] == HL_UNDERLINE) {
-          row->hl[j] = HL_NORMAL;
-        }
-      }
+/* Append to the prefix of the regex the literal bytes the tree at 'node'
+ * starts with. Returns 1 if they are all of its matches, 0 if matches of
+ * the tree may go on with something else. */
+int rePrefixNode(reParser *ps, int node) {
+  reNode *nd = ps->nodes + node;
+  regex *re = ps->re;
+  int byte = -1;
+
+  switch (nd->type) {
+  case RN_EMPTY:
+  case RN_BOL:
+    return 1;
+  case RN_CLASS:
+    for (int k = 0; k < 256; k++) {
+      if (!reClassHas(re->classes[nd->a], k))
+        continue;
+      if (byte != -1)
+        return 0;
+      byte = k;
     }
+    if (byte == -1)
+      return 0;
+    re->prefix[re->prefixlen++] = byte;
+    return 1;
+  case RN_CAT:
+    return rePrefixNode(ps, nd->a) && rePrefixNode(ps, nd->b);
+  case RN_REPEAT:
+    if (nd->min > 0)
+      rePrefixNode(ps, nd->a);
+    return 0;
+  default:
+    return 0;
   }
+}
 
-  /* Get word under cursor */
-  if (!editorGetWordAtCursor(word, &start_pos, &end_pos)) {
-    return; /* No word under cursor */
+/* Compile the 'len' bytes of 'pattern'. Returns NULL setting '*error' to
+ * a description of the problem if the pattern is not valid. */
+regex *regexCompile(const char *pattern, int len, const char **error) {
+  reParser ps;
+  regex *re = calloc(1, sizeof(*re));
+
+  ps.p = pattern;
+  ps.end = pattern + len;
+  ps.nodes = malloc(sizeof(reNode) * (len + 1) * 3);
+  ps.n = 0;
+  ps.re = re;
+  ps.error = NULL;
+  re->prog = malloc(sizeof(reInst) * RE_MAX_INSTS);
+  re->prefix = malloc(len + 1);
+
+  int root = reParseAlt(&ps);
+  if (root >= 0 && ps.p != ps.end)
+    ps.error = "unmatched )";
+  if (ps.error == NULL && reCompileNode(&ps, root) == 0 &&
+      reEmit(&ps, RE_MATCH, 0, 0) >= 0)
+    rePrefixNode(&ps, root);
+  free(ps.nodes);
+  if (ps.error) {
+    *error = ps.error;
+    regexFree(re);
+    return NULL;
   }
+  return re;
+}
 
-  /* Highlight all matching words in all rows */
-  for (int i = 0; i < E.numrows; i++) {
-    erow *row = &E.row[i];
-    if (!row->render)
-      continue;
+void regexFree(regex *re) {
+  free(re->prog);
+  free(re->classes);
+  free(re->prefix);
+  free(re);
+}
 
-    char *match = row->render;
-    while ((match = strstr(match, word)) != NULL) {
-      /* Check if this is a whole word match */
-      int match_start = match - row->render;
-      int match_end = match_start + strlen(word);
+/* The DFA and the NFA threads both follow the program the same way: a
+ * thread runs the jumps at once, and waits at the instructions that
+ * consume a byte or end a match. It also waits at an EOL that is not at
+ * the end of the line: the DFA finds out later whether the line ends
+ * there. */
+
+void reExecInit(reExec *x, const regex *re) {
+  memset(x, 0, sizeof(*x));
+  x->re = re;
+  x->start = -1;
+  x->budget = -1;
+  for (int k = 0; k < 2; k++) {
+    x->list[k] = malloc(sizeof(int) * re->len);
+    x->from[k] = malloc(sizeof(int) * re->len);
+  }
+  x->seen = calloc(re->len, sizeof(unsigned int));
+  x->stack = malloc(sizeof(int) * re->len);
+}
 
-      /* Check boundaries */
-      int is_word_start =
-          (match_start == 0 || (!isalnum(row->render[match_start - 1]) &&
-                                row->render[match_start - 1] != '_'));
-      int is_word_end =
-          (match_end >= row->rsize ||
-           (!isalnum(row->render[match_end]) && row->render[match_end] != '_'));
+void reExecFlush(reExec *x) {
+  for (int k = 0; k < x->nstates; k++)
+    free(x->states[k].pcs);
+  x->nstates = 0;
+  x->start = -1;
+  x->epoch++;
+  if (x->slots)
+    memset(x->slots, 0, sizeof(int) * RE_MAX_STATES * 2);
+}
 
-      if (is_word_start && is_word_end && row->hl) {
-        /* Highlight this match */
-        for (int j = 0; j < (int)strlen(word) && match_start + j < row->rsize;
-             j++) {
-          /* Only highlight if it's not already a search match or special syntax
-           */
-          if (row->hl[match_start + j] != HL_MATCH &&
-              row->hl[match_start + j] != HL_COMMENT &&
-              row->hl[match_start + j] != HL_MLCOMMENT &&
-              row->hl[match_start + j] != HL_STRING) {
-            row->hl[match_start + j] = HL_UNDERLINE;
-          }
-        }
-      }
+void reExecFree(reExec *x) {
+  if (x->re == NULL)
+    return;
+  reExecFlush(x);
+  for (int k = 0; k < 2; k++) {
+    free(x->list[k]);
+    free(x->from[k]);
+  }
+  free(x->seen);
+  free(x->stack);
+  free(x->states);
+  free(x->slots);
+  x->re = NULL;
+}
 
-      match++; /* Move to next position */
-    }
+/* Start a new generation of x->seen. When the counter wraps, every pc
+ * is marked as not seen again, as 0 is never a generation. */
+void reNextGen(reExec *x) {
+  if (++x->gen == 0) {
+    memset(x->seen, 0, sizeof(unsigned int) * x->re->len);
+    x->gen = 1;
   }
 }
 
-/* =============================== Undo functionality ====================== */
+/* Add to the list 'k', that has '*n' threads, the threads that the one at
+ * 'pc' turns into, making a match starting at 'from'. Threads already in
+ * the list since x->gen last changed are not added again. */
+void reAddThread(reExec *x, int k, int *n, int pc, int from, int bol,
+                 int eol) {
+  const reInst *prog = x->re->prog;
+  int sp = 0;
 
-/* Push an operation onto the undo stack */
-void pushUndoOp(enum undo_type type, int row, int col, char *data,
-                int data_len) {
-  /* Limit undo stack size */
-  if (E.undo_count >= MAX_UNDO_STACK) {
-    /* Remove oldest operation */
-    undo_op *oldest = E.undo_stack;
-    while (oldest && oldest->next && oldest->next->next) {
-      oldest = oldest->next;
+  if (x->seen[pc] == x->gen)
+    return;
+  x->seen[pc] = x->gen;
+  x->stack[sp++] = pc;
+  while (sp) {
+    pc = x->stack[--sp];
+    int next[2], nnext = 0;
+    switch (prog[pc].op) {
+    case RE_JMP:
+      next[nnext++] = prog[pc].x;
+      break;
+    case RE_SPLIT:
+      /* 'y' first on the stack, so that 'x' is followed first. */
+      next[nnext++] = prog[pc].y;
+      next[nnext++] = prog[pc].x;
+      break;
+    case RE_BOL:
+      if (bol)
+        next[nnext++] = pc + 1;
+      break;
+    case RE_EOL:
+      if (eol) {
+        next[nnext++] = pc + 1;
+        break;
+      }
+      /* Fall through. */
+    default:
+      x->list[k][*n] = pc;
+      x->from[k][*n] = from;
+      (*n)++;
+      break;
     }
-    if (oldest && oldest->next) {
-      undo_op *to_remove = oldest->next;
-      oldest->next = NULL;
-      free(to_remove->data);
-      free(to_remove);
-      E.undo_count--;
+    for (int j = 0; j < nnext; j++) {
+      if (x->seen[next[j]] != x->gen) {
+        x->seen[next[j]] = x->gen;
+        x->stack[sp++] = next[j];
+      }
     }
   }
+}
 
-  /* Create new undo operation */
-  undo_op *op = malloc(sizeof(undo_op));
-  op->type = type;
-  op->row = row;
-  op->col = col;
-  op->data_len = data_len;
-  if (data && data_len > 0) {
-    op->data = malloc(data_len + 1);
-    memcpy(op->data, data, data_len);
-    op->data[data_len] = '\0';
-  } else {
-    op->data = NULL;
+int reCompareInt(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+/* Return the DFA state of the 'n' threads in x->list[0], sorted, creating
+ * it if needed. Returns -1 if there is no room left for it. */
+int reStateFind(reExec *x, int n) {
+  int *pcs = x->list[0], mask = RE_MAX_STATES * 2 - 1;
+  uint32_t h = 2166136261u;
+
+  if (x->states == NULL) {
+    x->states = malloc(sizeof(reState) * RE_MAX_STATES);
+    x->slots = calloc(RE_MAX_STATES * 2, sizeof(int));
   }
+  for (int k = 0; k < n; k++)
+    h = (h ^ (uint32_t)pcs[k]) * 16777619u;
+  int slot = h & mask;
+  for (; x->slots[slot]; slot = (slot + 1) & mask) {
+    reState *st = x->states + x->slots[slot] - 1;
+    if (st->n == n && memcmp(st->pcs, pcs, sizeof(int) * n) == 0)
+      return x->slots[slot] - 1;
+  }
+  if (x->nstates == RE_MAX_STATES)
+    return -1;
 
-  /* Push to front of stack */
-  op->next = E.undo_stack;
-  E.undo_stack = op;
-  E.undo_count++;
+  reState *st = x->states + x->nstates;
+  st->pcs = malloc(sizeof(int) * (n + 1));
+  memcpy(st->pcs, pcs, sizeof(int) * n);
+  st->n = n;
+  st->match = st->eolmatch = 0;
+  for (int k = 0; k < 256; k++)
+    st->next[k] = -1;
+  /* Threads waiting at EOL may lead to a match at the end of the line. */
+  int m = 0;
+  reNextGen(x);
+  for (int k = 0; k < n; k++) {
+    int op = x->re->prog[pcs[k]].op;
+    if (op == RE_MATCH)
+      st->match = 1;
+    else if (op == RE_EOL)
+      reAddThread(x, 1, &m, pcs[k] + 1, 0, 0, 1);
+  }
+  for (int k = 0; k < m; k++)
+    if (x->re->prog[x->list[1][k]].op == RE_MATCH)
+      st->eolmatch = 1;
+  x->slots[slot] = ++x->nstates;
+  return x->nstates - 1;
 }
 
-/* Pop and execute an undo operation */
-void executeUndo(void) {
-  if (!E.undo_stack) {
-    editorSetStatusMessage("Nothing to undo");
-    return;
+/* Return the DFA state made of the threads in x->list[0], starting over
+ * with no states if there is no room left. */
+int reStateGet(reExec *x, int n) {
+  qsort(x->list[0], n, sizeof(int), reCompareInt);
+  int st = reStateFind(x, n);
+  if (st == -1) {
+    reExecFlush(x);
+    st = reStateFind(x, n);
   }
+  return st;
+}
 
-  undo_op *op = E.undo_stack;
-  E.undo_stack = op->next;
-  E.undo_count--;
+/* Return the DFA state following 'st' on the byte 'c'. A thread starting
+ * a match is added at every byte, so a match may start anywhere. */
+int reStep(reExec *x, int st, int c) {
+  const reInst *prog = x->re->prog;
+  reState *from = x->states + st;
+  int n = 0, epoch = x->epoch;
+
+  reNextGen(x);
+  for (int k = 0; k < from->n; k++) {
+    const reInst *in = prog + from->pcs[k];
+    if (in->op == RE_CLASS && reClassHas(x->re->classes[in->x], c))
+      reAddThread(x, 0, &n, from->pcs[k] + 1, 0, 0, 0);
+  }
+  reAddThread(x, 0, &n, 0, 0, 0, 0);
+  int next = reStateGet(x, n);
+  /* Unless the states were dropped, 'st' is still there. */
+  if (x->epoch == epoch)
+    x->states[st].next[c] = next;
+  return next;
+}
 
-  switch (op->type) {
-  case UNDO_DELETE_LINE:
-    /* Restore deleted line */
-    if (op->data) {
-      editorInsertRow(op->row, op->data, op->data_len);
-      /* Move cursor to the restored line */
-      E.cy = 0;
-      E.cx = 0;
-      E.rowoff = op->row;
-      E.coloff = 0;
-      if (op->row < E.screenrows) {
-        E.cy = op->row;
-        E.rowoff = 0;
-      }
-      editorSetStatusMessage("Line restored");
-    }
-    break;
-  case UNDO_DELETE_CHAR:
-    /* Restore deleted character */
-    if (op->data && op->row < E.numrows) {
-      erow *row = &E.row[op->row];
-      editorRowInsertChar(row, op->col, op->data[0]);
-      /* Move cursor to after the restored character */
-      E.cy = op->row - E.rowoff;
-      E.cx = op->col + 1;
-      if (E.cy < 0) {
-        E.rowoff += E.cy;
-        E.cy = 0;
-      } else if (E.cy >= E.screenrows) {
-        E.rowoff += E.cy - E.screenrows + 1;
-        E.cy = E.screenrows - 1;
-      }
-      editorSetStatusMessage("Character restored");
-    }
-    break;
-  case UNDO_INSERT_CHAR:
-    /* Remove inserted character */
-    if (op->row < E.numrows) {
-      erow *row = &E.row[op->row];
-      if (op->col < row->size) {
-        editorRowDelChar(row, op->col);
-        /* Move cursor to the deletion point */
-        E.cy = op->row - E.rowoff;
-        E.cx = op->col;
-        editorSetStatusMessage("Character insertion undone");
-      }
-    }
-    break;
-  case UNDO_INSERT_LINE:
-    /* Remove inserted line */
-    if (op->row < E.numrows) {
-      editorDelRow(op->row);
-      /* Adjust cursor position */
-      if (op->row <= E.rowoff + E.cy) {
-        if (E.cy > 0) {
-          E.cy--;
-        } else if (E.rowoff > 0) {
-          E.rowoff--;
-        }
-      }
-      editorSetStatusMessage("Line insertion undone");
-    }
-    break;
+/* Return 1 if the regex matches somewhere in the line of 'len' bytes at
+ * 's'. Only the DFA runs, one table lookup per byte once it has seen
+ * similar text. */
+int reLineHasMatch(reExec *x, const char *s, int len) {
+  if (x->start == -1) {
+    int n = 0;
+    reNextGen(x);
+    reAddThread(x, 0, &n, 0, 0, 1, 0);
+    x->start = reStateGet(x, n);
   }
 
-  /* Clean up */
-  free(op->data);
-  free(op);
+  int st = x->start;
+  for (int k = 0; k < len; k++) {
+    if (x->states[st].match)
+      return 1;
+    int next = x->states[st].next[(unsigned char)s[k]];
+    st = next != -1 ? next : reStep(x, st, (unsigned char)s[k]);
+  }
+  return x->states[st].match || x->states[st].eolmatch;
 }
 
-/* Clear all undo operations */
-void clearUndoStack(void) {
-  while (E.undo_stack) {
-    undo_op *op = E.undo_stack;
-    E.undo_stack = op->next;
-    free(op->data);
-    free(op);
+/* Find the first match of the regex in the line of 'len' bytes at 's'
+ * that starts at or after 'from', the longest of those starting there.
+ * Returns 0 if there is none, else 1 setting its start and end offsets.
+ *
+ * The NFA runs a thread per instruction, each knowing where its match
+ * started: threads that started earlier are first in the list, so when
+ * two meet at the same instruction the leftmost one is kept. Also returns
+ * 0 once x->budget bytes were stepped over, if it is not -1. */
+int reLineNext(reExec *x, const char *s, int len, int from, int *start,
+               int *end) {
+  const reInst *prog = x->re->prog;
+  int cur = 0, n = 0, best = -1, bestend = -1;
+
+  reNextGen(x);
+  reAddThread(x, cur, &n, 0, from, from == 0, from == len);
+  for (int pos = from;; pos++) {
+    for (int k = 0; k < n; k++) {
+      int f = x->from[cur][k];
+      if (prog[x->list[cur][k]].op != RE_MATCH || f == pos)
+        continue;
+      if (best == -1 || f < best || (f == best && pos > bestend)) {
+        best = f;
+        bestend = pos;
+      }
+    }
+    if (pos == len || (n == 0 && best != -1))
+      break;
+    if (x->budget == 0)
+      return 0;
+    if (x->budget > 0)
+      x->budget--;
+
+    /* Step every thread over the byte, dropping those that can only make
+     * a match starting after the one found. */
+    int c = (unsigned char)s[pos], next = 0;
+    reNextGen(x);
+    for (int k = 0; k < n; k++) {
+      int pc = x->list[cur][k], f = x->from[cur][k];
+      if ((best == -1 || f <= best) && prog[pc].op == RE_CLASS &&
+          reClassHas(x->re->classes[prog[pc].x], c))
+        reAddThread(x, !cur, &next, pc + 1, f, 0, pos + 1 == len);
+    }
+    if (best == -1)
+      reAddThread(x, !cur, &next, 0, pos + 1, 0, pos + 1 == len);
+    cur = !cur;
+    n = next;
   }
-  E.undo_count = 0;
+  if (best == -1)
+    return 0;
+  *start = best;
+  *end = bestend;
+  return 1;
 }
 
 /* =============================== Find mode ================================ */
@@ -1407,7 +6018,8 @@ void editorDeleteCurrentLine(void) {
     return;
 
   /* Save the line content for undo */
-  erow *row = &E.row[filerow];
+  erow *row = editorRowAt(filerow);
+  editorRowGapClose();
   pushUndoOp(UNDO_DELETE_LINE, filerow, 0, row->chars, row->size);
 
   /* Delete the row */
@@ -1502,36 +6114,45 @@ void editorGoTo(int fd) {
   }
 }
 
-void editorFind(int fd) {
-  char query[KILO_QUERY_LEN + 1] = {0};
+/* Put the cursor on the current match of the search. */
+void editorFindJump(void) {
+  searchMatch *m = &E.search->current;
+  erow *row = editorRowAt(m->row);
+
+  E.cy = 0;
+  E.cx = editorRowRenderCol(row, m->col);
+  E.rowoff = m->row;
+  E.coloff = 0;
+  /* Scroll horizontally as needed. */
+  if (E.cx > E.screencols) {
+    int diff = E.cx - E.screencols;
+    E.cx -= diff;
+    E.coloff += diff;
+  }
+}
+
+/* Run the find prompt until ESC or Enter is pressed, returning which one.
+ * The search is left in E.search, with 'query' holding its text. ESC puts
+ * the cursor back where it was. */
+int editorFindPrompt(int fd, char *query) {
   int qlen = 0;
-  int last_match = -1;    /* Last line where a match was found. -1 for none. */
-  int find_next = 0;      /* if 1 search next, if -1 search prev. */
-  int saved_hl_line = -1; /* No saved HL */
-  char *saved_hl = NULL;
-
-#define FIND_RESTORE_HL                                                        \
-  do {                                                                         \
-    if (saved_hl) {                                                            \
-      memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);   \
-      free(saved_hl);                                                          \
-      saved_hl = NULL;                                                         \
-    }                                                                          \
-  } while (0)
+  int changed = 0; /* The query changed since the last search. */
+  int find_next = 0; /* if 1 search next, if -1 search prev. */
 
   /* Save the cursor position in order to restore it later. */
   int saved_cx = E.cx, saved_cy = E.cy;
   int saved_coloff = E.coloff, saved_rowoff = E.rowoff;
 
+  query[0] = '\0';
   while (1) {
-    editorSetStatusMessage("Search: %s (Use ESC/Arrows/Enter)", query);
+    editorSearchShow(query);
     editorRefreshScreen();
 
     int c = editorReadKey(fd);
     if (c == DEL_KEY || c == CTRL_H || c == BACKSPACE) {
       if (qlen != 0)
         query[--qlen] = '\0';
-      last_match = -1;
+      changed = 1;
     } else if (c == ESC || c == ENTER) {
       if (c == ESC) {
         E.cx = saved_cx;
@@ -1539,9 +6160,10 @@ void editorFind(int fd) {
         E.coloff = saved_coloff;
         E.rowoff = saved_rowoff;
       }
-      FIND_RESTORE_HL;
-      editorSetStatusMessage("");
-      return;
+      return c;
+    } else if (c == TAB) {
+      E.findregex = !E.findregex;
+      changed = 1;
     } else if (c == ARROW_RIGHT || c == ARROW_DOWN) {
       find_next = 1;
     } else if (c == ARROW_LEFT || c == ARROW_UP) {
@@ -1550,56 +6172,257 @@ void editorFind(int fd) {
       if (qlen < KILO_QUERY_LEN) {
         query[qlen++] = c;
         query[qlen] = '\0';
-        last_match = -1;
+        changed = 1;
       }
     }
 
-    /* Search occurrence. */
-    if (last_match == -1)
-      find_next = 1;
-    if (find_next) {
-      char *match = NULL;
-      int match_offset = 0;
-      int i, current = last_match;
-
-      for (i = 0; i < E.numrows; i++) {
-        current += find_next;
-        if (current == -1)
-          current = E.numrows - 1;
-        else if (current == E.numrows)
-          current = 0;
-        match = strstr(E.row[current].render, query);
-        if (match) {
-          match_offset = match - E.row[current].render;
-          break;
-        }
+    if (changed) {
+      /* Search again, going to the first match as soon as it is known. */
+      editorSearchStart(query, qlen);
+      if (editorSearchFirst())
+        editorFindJump();
+      changed = find_next = 0;
+    } else if (find_next && E.search) {
+      /* Moving between matches needs them all. */
+      searchJob *j = E.search;
+      editorSearchPoll(1);
+      if (j->count) {
+        j->cur = (j->cur + find_next + j->count) % j->count;
+        j->current = j->matches[j->cur];
+        editorFindJump();
       }
       find_next = 0;
+    }
+  }
+}
 
-      /* Highlight */
-      FIND_RESTORE_HL;
-
-      if (match) {
-        erow *row = &E.row[current];
-        last_match = current;
-        if (row->hl) {
-          saved_hl_line = current;
-          saved_hl = malloc(row->rsize);
-          memcpy(saved_hl, row->hl, row->rsize);
-          memset(row->hl + match_offset, HL_MATCH, qlen);
-        }
-        E.cy = 0;
-        E.cx = match_offset;
-        E.rowoff = current;
-        E.coloff = 0;
-        /* Scroll horizontally as needed. */
-        if (E.cx > E.screencols) {
-          int diff = E.cx - E.screencols;
-          E.cx -= diff;
-          E.coloff += diff;
-        }
+void editorFind(int fd) {
+  char query[KILO_QUERY_LEN + 1];
+
+  editorFindPrompt(fd, query);
+  editorSearchStop();
+  editorOverlayClear(OVERLAY_MATCH);
+  editorSetStatusMessage("");
+}
+
+/* ================================ Replace ================================= */
+
+/* Replace all rewrites every row holding matches of the search once, and
+ * records the whole change as a single undo entry. The entry lists, for
+ * every match replaced, where the replacement is in the row after the
+ * change and the text it replaced. That text is the query itself for text
+ * searches, stored once. Numbers are varints, as in the journal:
+ *
+ *   <replacement len> <replacement>
+ *   <query len + 1, or 0 for regexes> [<query>]
+ *   then for every match:
+ *   <rows since the previous match> <offset> [<replaced len> <replaced>]
+ */
+typedef struct replaceLog {
+  char *buf;
+  size_t len, cap;
+} replaceLog;
+
+void replaceLogPut(replaceLog *l, const char *s, size_t len) {
+  if (len == 0)
+    return;
+  if (l->len + len > l->cap) {
+    l->cap = l->len + len > l->cap * 2 ? l->len + len : l->cap * 2;
+    l->buf = realloc(l->buf, l->cap);
+  }
+  memcpy(l->buf + l->len, s, len);
+  l->len += len;
+}
+
+void replaceLogPutInt(replaceLog *l, size_t v) {
+  char b[10];
+  int n = 0;
+
+  do {
+    b[n] = v & 0x7f;
+    v >>= 7;
+    if (v)
+      b[n] |= 0x80;
+    n++;
+  } while (v);
+  replaceLogPut(l, b, n);
+}
+
+/* Replace every match of the search with the 'len' bytes of 'with', then
+ * drop the search. Overlapping text matches are replaced only where they
+ * start after the previous one ends. Returns the number of replaces. */
+int editorReplaceAll(const char *with, int len) {
+  searchJob *j = E.search;
+  replaceLog log = {NULL, 0, 0}, row = {NULL, 0, 0};
+  int replaced = 0, last = 0;
+
+  if (j == NULL)
+    return 0;
+  editorSearchPoll(1);
+  if (j->count == 0) {
+    editorSearchStop();
+    return 0;
+  }
+
+  editorRowGapClose();
+  replaceLogPutInt(&log, len);
+  replaceLogPut(&log, with, len);
+  replaceLogPutInt(&log, j->regex ? 0 : strlen(j->query) + 1);
+  if (!j->regex)
+    replaceLogPut(&log, j->query, strlen(j->query));
+  for (int k = 0; k < j->count;) {
+    int at = j->matches[k].row, from = 0;
+    erow *r = editorRowAt(at);
+
+    row.len = 0;
+    for (; k < j->count && j->matches[k].row == at; k++) {
+      searchMatch *m = j->matches + k;
+      if (m->col < from)
+        continue;
+      replaceLogPut(&row, r->chars + from, m->col - from);
+      replaceLogPutInt(&log, at - last);
+      replaceLogPutInt(&log, row.len);
+      if (j->regex) {
+        replaceLogPutInt(&log, m->len);
+        replaceLogPut(&log, r->chars + m->col, m->len);
       }
+      replaceLogPut(&row, with, len);
+      from = m->col + m->len;
+      last = at;
+      replaced++;
     }
+    replaceLogPut(&row, r->chars + from, r->size - from);
+    editorRowSetChars(r, row.buf, row.len);
+  }
+  pushUndoOp(UNDO_REPLACE, 0, 0, log.buf, log.len);
+  free(log.buf);
+  free(row.buf);
+  editorSearchStop();
+  return replaced;
+}
+
+/* Go through a replace all, as recorded by editorReplaceAll(). Unless
+ * 'apply' is set the rows are left alone, and only checked to still hold
+ * every replacement where the record says. Returns the number of replaces,
+ * or -1 if the record does not fit the rows. */
+int replaceLogRun(const char *data, int len, int apply) {
+  const unsigned char *p = (const unsigned char *)data, *end = p + len;
+  const char *with, *query;
+  size_t withlen, querylen, delta;
+  replaceLog row = {NULL, 0, 0};
+  int at = 0, count = 0;
+
+  if (editorJournalGetInt(&p, end, &withlen) == -1 ||
+      (size_t)(end - p) < withlen)
+    return -1;
+  with = (const char *)p;
+  p += withlen;
+  if (editorJournalGetInt(&p, end, &querylen) == -1)
+    return -1;
+  int regex = querylen == 0;
+  query = (const char *)p;
+  if (!regex && (size_t)(end - p) < --querylen)
+    return -1;
+  if (!regex)
+    p += querylen;
+
+  editorRowGapClose();
+  int more = editorJournalGetInt(&p, end, &delta) == 0;
+  while (more) {
+    size_t from = 0, col, oldlen = querylen;
+    const char *old = query;
+
+    if ((size_t)at + delta >= (size_t)E.numrows)
+      goto unfit;
+    at += delta;
+    erow *r = editorRowAt(at);
+    row.len = 0;
+    do {
+      if (editorJournalGetInt(&p, end, &col) == -1)
+        goto unfit;
+      if (regex) {
+        if (editorJournalGetInt(&p, end, &oldlen) == -1 ||
+            (size_t)(end - p) < oldlen)
+          goto unfit;
+        old = (const char *)p;
+        p += oldlen;
+      }
+      /* The replacement must still be there, after the previous one. */
+      if (col < from || col > (size_t)r->size ||
+          withlen > (size_t)r->size - col ||
+          memcmp(r->chars + col, with, withlen) != 0)
+        goto unfit;
+      if (apply) {
+        replaceLogPut(&row, r->chars + from, col - from);
+        replaceLogPut(&row, old, oldlen);
+      }
+      from = col + withlen;
+      count++;
+      more = p < end && editorJournalGetInt(&p, end, &delta) == 0;
+    } while (more && delta == 0);
+    if (apply) {
+      replaceLogPut(&row, r->chars + from, r->size - from);
+      editorRowSetChars(r, row.buf, row.len);
+    }
+  }
+  free(row.buf);
+  return count;
+
+unfit:
+  free(row.buf);
+  return -1;
+}
+
+/* Undo a replace all, as recorded by editorReplaceAll(). Returns the number
+ * of replaces undone, or -1 leaving the rows alone if they were changed
+ * since in a way that does not fit the record. */
+int editorUndoReplace(const char *data, int len) {
+  if (replaceLogRun(data, len, 0) == -1)
+    return -1;
+  return replaceLogRun(data, len, 1);
+}
+
+/* Replace all the matches of a search, asking for the replacement once the
+ * search is done. */
+void editorReplace(int fd) {
+  char query[KILO_QUERY_LEN + 1], with[KILO_QUERY_LEN + 1] = {0};
+  int wlen = 0, replaced = -1;
+
+  int key = editorFindPrompt(fd, query);
+  if (key == ENTER)
+    editorSearchPoll(1);
+  if (key == ENTER && E.search && E.search->count) {
+    char count[16];
+    editorFormatCount(count, E.search->count);
+    while (1) {
+      editorSetStatusMessage("Replace %s matches of %s with: %s "
+                             "(Use ESC/Enter)",
+                             count, query, with);
+      editorRefreshScreen();
+
+      int c = editorReadKey(fd);
+      if (c == DEL_KEY || c == CTRL_H || c == BACKSPACE) {
+        if (wlen != 0)
+          with[--wlen] = '\0';
+      } else if (c == ESC) {
+        break;
+      } else if (c == ENTER) {
+        replaced = editorReplaceAll(with, wlen);
+        break;
+      } else if (isprint(c) && wlen < KILO_QUERY_LEN) {
+        with[wlen++] = c;
+        with[wlen] = '\0';
+      }
+    }
+  }
+  editorSearchStop();
+  editorOverlayClear(OVERLAY_MATCH);
+  if (replaced >= 0) {
+    char count[16];
+    editorSetStatusMessage("Replaced %s occurrences",
+                           editorFormatCount(count, replaced));
+  } else {
+    editorSetStatusMessage("");
   }
 }
 
@@ -1610,7 +6433,7 @@ void editorMoveCursor(int key) {
   int filerow = E.rowoff + E.cy;
   int filecol = E.coloff + E.cx;
   int rowlen;
-  erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
+  erow *row = editorRowAt(filerow);
 
   switch (key) {
   case ARROW_LEFT:
@@ -1620,7 +6443,7 @@ void editorMoveCursor(int key) {
       } else {
         if (filerow > 0) {
           E.cy--;
-          E.cx = E.row[filerow - 1].size;
+          E.cx = editorRowAt(filerow - 1)->size;
           if (E.cx > E.screencols - 1) {
             E.coloff = E.cx - E.screencols + 1;
             E.cx = E.screencols - 1;
@@ -1669,7 +6492,7 @@ void editorMoveCursor(int key) {
   /* Fix cx if the current line has not enough chars. */
   filerow = E.rowoff + E.cy;
   filecol = E.coloff + E.cx;
-  row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
+  row = editorRowAt(filerow);
   rowlen = row ? row->size : 0;
   if (filecol > rowlen) {
     E.cx -= filecol - rowlen;
@@ -1699,7 +6522,8 @@ void editorProcessKeypress(int fd) {
      * to the edited file. */
     break;
   case CTRL_Q: /* Ctrl-q */
-    /* Quit if the file was already saved. */
+    /* Quit if the file was already saved, once a save in progress is. */
+    editorSavePoll(1);
     if (E.dirty && quit_times) {
       editorSetStatusMessage("WARNING!!! File has unsaved changes. "
                              "Press Ctrl-Q %d more times to quit.",
@@ -1707,14 +6531,18 @@ void editorProcessKeypress(int fd) {
       quit_times--;
       return;
     }
+    editorJournalDiscard();
     exit(0);
     break;
   case CTRL_S:
-    editorSave();
+    editorSaveBackground();
     break;
   case CTRL_F:
     editorFind(fd);
     break;
+  case CTRL_R:
+    editorReplace(fd);
+    break;
   case BACKSPACE: /* Backspace */
   case CTRL_H:    /* Ctrl-h */
     editorDelChar();
@@ -1758,7 +6586,8 @@ void editorProcessKeypress(int fd) {
   case END_KEY: {
     int filerow = E.rowoff + E.cy;
     if (filerow < E.numrows) {
-      erow *row = &E.row[filerow];
+      erow *row = editorRowAt(filerow);
+      editorRowMaterialize(row);
       int end = row->rsize; // use rendered size for cursor position
       // If end is before current coloff, reset coloff/cx
       if (end < E.coloff) {
@@ -1776,10 +6605,11 @@ void editorProcessKeypress(int fd) {
   case HOME_KEY: {
     int filerow = E.rowoff + E.cy;
     if (filerow < E.numrows) {
-      erow *row = &E.row[filerow];
+      erow *row = editorRowAt(filerow);
       int first_nonspace = 0;
-      while (first_nonspace < row->size && (row->chars[first_nonspace] == ' ' ||
-                                            row->chars[first_nonspace] == '\t'))
+      while (first_nonspace < row->size &&
+             (editorRowCharAt(row, first_nonspace) == ' ' ||
+              editorRowCharAt(row, first_nonspace) == '\t'))
         first_nonspace++;
       if (first_nonspace >= E.coloff + E.screencols) {
         E.coloff = first_nonspace - E.screencols + 1;
@@ -1803,6 +6633,10 @@ void editorProcessKeypress(int fd) {
     E.d_pressed = 0;
     executeUndo();
     break;
+  case NEXT_WORD_KEY:
+  case PREV_WORD_KEY:
+    editorJumpToOccurrence(c == NEXT_WORD_KEY ? 1 : -1);
+    break;
   case 'd':
     if (E.d_pressed && (time(NULL) - E.d_press_time) <= 1) {
       /* Second 'd' pressed within 1 second - delete the 'd' we just inserted
@@ -1825,6 +6659,10 @@ void editorProcessKeypress(int fd) {
     break;
   }
 
+  /* Once the cursor left the row being edited, flatten it again. */
+  if (E.gaprow && E.gaprow != editorRowAt(E.rowoff + E.cy))
+    editorRowGapClose();
+
   quit_times = KILO_QUIT_TIMES; /* Reset it to the original value. */
 }
 
@@ -1858,8 +6696,7 @@ void initEditor(void) {
   E.cy = 0;
   E.rowoff = 0;
   E.coloff = 0;
-  E.numrows = 0;
-  E.row = NULL;
+  editorFreeRows();
   E.dirty = 0;
   E.filename = NULL;
   E.syntax = NULL;
@@ -1867,8 +6704,46 @@ void initEditor(void) {
   E.d_pressed = 0;
   E.undo_stack = NULL;
   E.undo_count = 0;
+  E.indexthreads = KILO_INDEX_THREADS;
+  E.indexmin = KILO_INDEX_THREADED_MIN;
+  if (getenv("KILO_INDEX_THREADS"))
+    E.indexthreads = atoi(getenv("KILO_INDEX_THREADS"));
+  if (getenv("KILO_INDEX_THREADED_MIN"))
+    E.indexmin = strtoul(getenv("KILO_INDEX_THREADED_MIN"), NULL, 10);
+  E.saving = NULL;
+  E.hljob = NULL;
+  E.search = NULL;
+  editorOverlayClear(OVERLAY_WORD);
+  editorOverlayClear(OVERLAY_MATCH);
+  E.wordhl.valid = 0;
+  memset(&E.journal, 0, sizeof(E.journal));
+  E.journal.fd = -1;
+  E.paging = 0;
+  E.pagingmin = KILO_PAGING_MIN;
+  E.pagemax = KILO_PAGING_RESIDENT;
+  E.maxrows = INT_MAX;
+  if (getenv("KILO_PAGING_MIN")) {
+    /* Anything but a number keeps the default, 0 pages every file but the
+     * empty ones. */
+    char *env = getenv("KILO_PAGING_MIN"), *end;
+    unsigned long min = strtoul(env, &end, 10);
+    if (isdigit((unsigned char)*env) && *end == '\0')
+      E.pagingmin = min ? min : 1;
+  }
+  if (getenv("KILO_PAGING_RESIDENT")) {
+    /* Rows of two pages may be in use at once, as when joining lines. */
+    E.pagemax = atoi(getenv("KILO_PAGING_RESIDENT"));
+    if (E.pagemax < 2)
+      E.pagemax = 2;
+  }
   updateWindowSize();
   signal(SIGWINCH, handleSigWinCh);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = handleSigBus;
+  sa.sa_flags = SA_SIGINFO;
+  sigaction(SIGBUS, &sa, NULL);
 }
 
 #ifndef TEST_BUILD
@@ -1879,12 +6754,15 @@ int main(int argc, char **argv) {
   }
 
   initEditor();
+  E.journal.enabled = 1;
   editorSelectSyntaxHighlight(argv[1]);
-  editorOpen(argv[1]);
-  enableRawMode(STDIN_FILENO);
   editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find "
                          "| Ctrl-G = go to line");
+  /* Replaces the help with what it recovered from a journal, if anything. */
+  editorOpen(argv[1]);
+  enableRawMode(STDIN_FILENO);
   while (1) {
+    editorOrigCheck();
     editorRefreshScreen();
     editorProcessKeypress(STDIN_FILENO);
   }
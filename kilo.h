@@ -2,8 +2,11 @@
 #define KILO_H
 
 #include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
@@ -11,12 +14,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /* Syntax highlight types */
 #define HL_NORMAL 0
 #define HL_NONPRINT 1
@@ -26,8 +38,8 @@
 #define HL_KEYWORD2 5
 #define HL_STRING 6
 #define HL_NUMBER 7
-#define HL_MATCH 8     /* Search match. */
-#define HL_UNDERLINE 9 /* Word under cursor match. */
+#define HL_MATCH 8     /* Search match, only in overlays. */
+#define HL_UNDERLINE 9 /* Word under cursor match, only in overlays. */
 
 #define HL_HIGHLIGHT_STRINGS (1 << 0)
 #define HL_HIGHLIGHT_NUMBERS (1 << 1)
@@ -39,7 +51,8 @@ enum undo_type {
   UNDO_DELETE_LINE,
   UNDO_DELETE_CHAR,
   UNDO_INSERT_CHAR,
-  UNDO_INSERT_LINE
+  UNDO_INSERT_LINE,
+  UNDO_REPLACE /* Replace all, data as built by editorReplaceAll(). */
 };
 
 /* Undo operation structure */
@@ -54,27 +67,449 @@ typedef struct undo_op {
 
 #define MAX_UNDO_STACK 100
 
+/* Keywords of a syntax compiled for lookup, see editorSyntaxCompile(). */
+typedef struct keywordSlot {
+  const char *word; /* Keyword, not null terminated for HL_KEYWORD2 ones. */
+  int len;          /* Length of 'word', 0 for empty slots. */
+  int type;         /* HL_KEYWORD1 or HL_KEYWORD2. */
+} keywordSlot;
+
+typedef struct keywordTable {
+  keywordSlot *slots; /* mask + 1 slots, indexed by keywordHash(). */
+  uint32_t mask;
+  uint32_t seed;      /* Seed giving every keyword its own slot. */
+  int minlen, maxlen; /* Words of other lengths are not keywords. */
+} keywordTable;
+
+/* The lexer is a state machine driven by a table compiled from the syntax,
+ * see editorSyntaxCompile(). */
+#define LEX_MAX_QUOTES 4 /* String delimiters a syntax can have. */
+#define LEX_MAX_DELIM 3  /* Longest comment delimiter. */
+
+enum lexState {
+  LS_START,     /* Code, at the start of a word. */
+  LS_WORD,      /* Code, inside a word. */
+  LS_NUMBER,    /* Inside a number. */
+  LS_MLCOMMENT, /* Inside a multi line comment. */
+  LS_STRING,    /* Inside a string, one state per delimiter. */
+  LEX_STATES = LS_STRING + LEX_MAX_QUOTES
+};
+
+enum lexClassId {
+  LC_SEP,      /* Anything printable not listed below. */
+  LC_WORD,     /* Letters and '_', and digits without number highlight. */
+  LC_DIGIT,
+  LC_DOT,      /* Part of numbers. */
+  LC_NONPRINT,
+  LC_ESC,      /* Escapes the next byte in strings. */
+  LC_DELIM,    /* First bytes of comment delimiters. */
+  LC_QUOTE = LC_DELIM + 3,
+  LEX_CLASSES = LC_QUOTE + LEX_MAX_QUOTES
+};
+
+enum lexAction {
+  LA_NONE,
+  LA_WORD,   /* A word starts: look it up in the keywords. */
+  LA_OPEN,   /* A comment may start. */
+  LA_CLOSE,  /* A multi line comment may end. */
+  LA_ESCAPE  /* The next byte is part of the string, whatever it is. */
+};
+
+typedef struct lexTrans {
+  unsigned char next;   /* State after the byte. */
+  unsigned char hl;     /* HL_* of the byte. */
+  unsigned char action; /* LA_*, if the byte alone does not decide. */
+} lexTrans;
+
+typedef struct lexTable {
+  unsigned char cls[256];                  /* LC_* of every byte. */
+  lexTrans trans[LEX_STATES][LEX_CLASSES]; /* Transitions. */
+  char quote[LEX_MAX_QUOTES];              /* Delimiter of LS_STRING + n. */
+  int scslen, mcslen, mcelen;              /* Comment delimiter lengths. */
+  int wordskip; /* [A-Za-z0-9_] are all plain inside words. */
+} lexTable;
+
 struct editorSyntax {
   char **filematch;
   char **keywords;
-  char singleline_comment_start[2];
-  char multiline_comment_start[3];
-  char multiline_comment_end[3];
+  char singleline_comment_start[LEX_MAX_DELIM + 1];
+  char multiline_comment_start[LEX_MAX_DELIM + 1];
+  char multiline_comment_end[LEX_MAX_DELIM + 1];
   int flags;
+  char *quotes;          /* String delimiters. */
+  char *name;
+  keywordTable *kwtable; /* 'keywords' compiled, once selected. */
+  lexTable *lex;         /* Lexer table, once selected. */
 };
 
+struct rowNode;
+
 /* This structure represents a single line of the file we are editing. */
 typedef struct erow {
-  int idx;           /* Row index in the file, zero-based. */
-  int size;          /* Size of the row, excluding the null term. */
-  int rsize;         /* Size of the rendered row. */
-  char *chars;       /* Row content. */
-  char *render;      /* Row content "rendered" for screen (for TABs). */
-  unsigned char *hl; /* Syntax highlight type for each character in render.*/
-  int hl_oc;         /* Row had open comment at end in last syntax highlight
-                        check. */
+  struct rowNode *leaf; /* Row tree leaf holding this row. */
+  int size;             /* Size of the row, excluding the null term. */
+  int rsize;            /* Size of the rendered row. */
+  char *chars;          /* Row content. */
+  char *render;         /* Row content "rendered" for screen (for TABs). */
+  unsigned char *hl;    /* Syntax highlight type for each character in
+                           render.*/
+  int hl_oc;            /* Row had open comment at end in last syntax
+                           highlight check. */
+  int flags;            /* ROW_* flags. */
 } erow;
 
+/* Row flags */
+#define ROW_VIEW (1 << 0)     /* chars points inside E.orig and is not owned
+                                 nor null terminated. */
+#define ROW_HL_STATE (1 << 1) /* hl_oc is known. */
+
+/* The file as it was loaded. Kilo keeps a line-granular piece table: every
+ * row is a single piece that either points into this read-only buffer, for
+ * rows untouched since loading, or into storage owned by the row, which is
+ * created the first time the row is modified. */
+typedef struct origFile {
+  char *base; /* File content, mapped or in heap. */
+  size_t len; /* Length of the content. */
+  int mapped; /* Set if 'base' comes from mmap() instead of malloc(). */
+  int fd;     /* File 'base' is a mapping of, if mapped. */
+  struct stat st;              /* Its status when mapped. */
+  volatile sig_atomic_t lost;  /* Pages past its end were read as zeros. */
+} origFile;
+
+/* Rows are kept in a counted B+tree: leaves hold pointers to rows, inner
+ * nodes hold pointers to other nodes, and every node knows how many rows
+ * live below it. Inserting, deleting and looking up a row by index are
+ * O(log n), and the index of a row is derived by walking from its leaf up to
+ * the root instead of being stored in the row. */
+#define ROWTREE_FANOUT 64
+
+/* Files of at least KILO_PAGING_MIN bytes are opened in paging mode: the
+ * tree does not get a row per line, but a node per page of at most
+ * KILO_PAGE_LINES lines, that only knows where the page is in the file and
+ * how many lines it has. The rows of a page are created the first time one
+ * of them is looked up, becoming the children of the page node, and are
+ * dropped again, least recently used page first, when more than
+ * KILO_PAGING_RESIDENT pages are loaded. A page whose rows are modified is
+ * pinned: its node becomes a regular part of the tree and stays in memory,
+ * as the overlay of the edits over the file.
+ *
+ * The comment state used by syntax highlight does not cross pages that are
+ * not loaded: a page starts with the state it last ended with, if ever. */
+#define KILO_PAGE_LINES (ROWTREE_FANOUT * ROWTREE_FANOUT)
+#define KILO_PAGING_MIN ((size_t)1 << 30)
+#define KILO_PAGING_RESIDENT 64
+
+typedef struct rowPage {
+  struct rowNode *node;        /* Node the rows of the page hang from. */
+  struct rowPage *prev, *next; /* Loaded pages, most recently used first. */
+  size_t off, len;             /* Content of the page inside E.orig. */
+  int loaded;                  /* The rows of the page are in memory. */
+  int hl_oc;                   /* Open comment at the end of the page. */
+} rowPage;
+
+typedef struct rowNode {
+  struct rowNode *parent;
+  struct rowNode *prev, *next; /* Neighbour leaves, for sequential walks. */
+  int leaf;                    /* Children are rows instead of nodes. */
+  int n;                       /* Number of children. */
+  int count;                   /* Number of rows in this subtree. */
+  int pristine;                /* Leaf of rows viewing consecutive lines of
+                                  E.orig, unchanged since loaded. */
+  rowPage *page;               /* Page this node stands for, if any. */
+  union {
+    struct rowNode *nodes[ROWTREE_FANOUT];
+    erow *rows[ROWTREE_FANOUT];
+  } u;
+} rowNode;
+
+/* Cursor for walking rows in file order without a lookup per row. */
+typedef struct rowIter {
+  rowNode *leaf;
+  int slot;
+  int at; /* Index of the next row. */
+} rowIter;
+
+/* Files of at least KILO_INDEX_THREADED_MIN bytes are indexed by
+ * KILO_INDEX_THREADS threads (0 means one per online CPU). Both can be
+ * overridden with environment variables of the same name. */
+#define KILO_INDEX_THREADS 0
+#define KILO_INDEX_MAX_THREADS 64
+#define KILO_INDEX_THREADED_MIN (64 * 1024 * 1024)
+
+/* Offsets of the newlines of a buffer, see lineIndexScan(). */
+typedef struct lineIndex {
+  size_t *nl;     /* Newline offsets, in order. */
+  size_t count;   /* Number of offsets stored. */
+  size_t cap;     /* Allocated entries. */
+  size_t stride;  /* If > 1, store only one newline every 'stride'. */
+  size_t skip;    /* Newlines to skip before storing the next one. */
+  size_t lines;   /* Number of newlines found, stored or not. */
+  size_t last;    /* Offset of the last newline found. */
+  size_t crlf;    /* Number of newlines found after a \r. */
+} lineIndex;
+
+/* Snapshot of the content taken when saving: the file as a list of
+ * buffers, pointing into E.orig for rows and pages that were not modified,
+ * and into copies made when the snapshot was taken for the others. It does
+ * not change while editing goes on, so it can be written from a background
+ * thread, see editorSaveBackground(). */
+typedef struct saveSnapshot {
+  struct iovec *iov;     /* Content of the file, in order. */
+  int n, cap;            /* Buffers used and allocated. */
+  char *copy;            /* Chunk holding copies, linked to older ones. */
+  size_t copyused;       /* Bytes used in the chunk. */
+  size_t copysize;       /* Size of the chunk. */
+  size_t len;            /* Total length of the content. */
+  int dirty;             /* E.dirty when the snapshot was taken. */
+  size_t journalpos;     /* Journal records up to the snapshot. */
+  char *filename;        /* File to save. */
+  origFile orig;         /* E.orig when the snapshot was taken, with its
+                            own descriptor. */
+  int nocopy;            /* Don't use copy_file_range(). */
+  char *target;          /* The file itself, symlinks resolved. */
+  char *tmp;             /* Temporary file renamed over it once written. */
+  int inplace;           /* Copy it over the file instead, see
+                            saveSnapshotWrite(). */
+  int fd;                /* Temporary file, open until the save is over. */
+  int err;               /* errno of the failure, or 0. */
+  int shown;             /* Progress shown in the status bar. */
+  pthread_t tid;         /* Thread writing the snapshot. */
+  pthread_mutex_t lock;  /* Protects the fields below. */
+  size_t written;        /* Bytes written so far. */
+  int done;              /* The thread is done. */
+} saveSnapshot;
+
+/* Rows given to the background highlighter, see editorHighlightStart(). */
+typedef struct hlJob {
+  pthread_t tid;
+  struct editorSyntax *syntax; /* E.syntax when the job was taken. */
+  unsigned int version;        /* E.hlversion when the job was taken. */
+  int from, count;             /* Rows from..from+count-1. */
+  int in;                      /* State at the end of row from-1. */
+  const char **chars;          /* Content of every row, */
+  int *size;                   /* and its size. */
+  char *copy;                  /* Content of the rows not in E.orig. */
+  unsigned char *oc;           /* Computed state at the end of every row. */
+  pthread_mutex_t lock;        /* Protects the fields below. */
+  int cancel;                  /* Stop as soon as possible. */
+  int done;                    /* The thread is done. */
+} hlJob;
+
+/* Journal of the edits not saved yet, see editorJournalRecord(). */
+enum journalOp {
+  JOURNAL_INSERT_ROW = 1,
+  JOURNAL_DEL_ROW,
+  JOURNAL_INSERT_CHAR,
+  JOURNAL_DEL_CHAR,
+  JOURNAL_APPEND,
+  JOURNAL_TRUNCATE,
+  JOURNAL_SET_ROW
+};
+
+typedef struct editJournal {
+  int enabled;      /* Journal the edits of the files opened. */
+  int replaying;    /* Edits come from the journal itself. */
+  char *path;       /* Journal of the current file. */
+  int fd;           /* Journal file, -1 until there is something in it. */
+  char *buf;        /* Records not written yet. */
+  size_t len, cap;  /* Used and allocated bytes of 'buf'. */
+  size_t written;   /* Bytes of records in the file. */
+  int unsynced;     /* Some of them are not synced to disk yet. */
+  struct stat filest; /* Version of the file the edits apply to. */
+  int filemissing;  /* The file does not exist yet. */
+} editJournal;
+
+/* Row storage allocator, see rowAlloc(). */
+#define ROWALLOC_CLASSES 18
+#define ROWALLOC_CHUNK (1024 * 1024)
+
+typedef struct rowArena {
+  void *freelist[ROWALLOC_CLASSES]; /* Free blocks of every size class. */
+  char *chunk;                      /* Chunk blocks are carved from. */
+  size_t used;                      /* Bytes already used in 'chunk'. */
+  struct rowBigBlock *big;          /* Blocks too big for any class. */
+} rowArena;
+
+/* Decorations drawn over the syntax highlight of the rows, see
+ * editorOverlayApply(). Layers are drawn in order, the last one on top. */
+enum overlayLayer { OVERLAY_WORD, OVERLAY_MATCH, OVERLAY_LAYERS };
+
+typedef struct hlSpan {
+  int row;   /* File row. */
+  int start; /* First render column. */
+  int len;   /* Columns covered. */
+} hlSpan;
+
+typedef struct hlOverlay {
+  hlSpan *spans;  /* Sorted by row, then by column. */
+  int count, cap; /* Used and allocated spans. */
+} hlOverlay;
+
+/* Word under the cursor the overlay was computed for, see
+ * editorHighlightWordUnderCursor(). */
+typedef struct wordCache {
+  int valid;
+  char word[256];         /* Word under the cursor, empty for none. */
+  int rowoff, screenrows; /* Rows searched for it. */
+  unsigned int version;   /* E.rowversion at that time. */
+} wordCache;
+
+/* Occurrences of the identifiers of the file, see identIndexBuild(). */
+typedef struct identOcc {
+  erow *row;
+  int n;          /* Occurrences in the row. */
+} identOcc;
+
+typedef struct identEntry {
+  char *word;     /* NULL for empty slots. */
+  int len;        /* Length of 'word'. */
+  identOcc *occ;  /* Rows it occurs in, in file order. */
+  int count, cap; /* Used and allocated items of 'occ'. */
+  int total;      /* Occurrences in all the rows. */
+} identEntry;
+
+typedef struct identToken {
+  const char *s; /* Identifier inside a row. */
+  int len;
+} identToken;
+
+typedef struct identIndex {
+  int built;             /* Filled, and kept up to date since. */
+  identEntry *slots;     /* Hash table of the identifiers. */
+  uint32_t mask;         /* Slots - 1, a power of two minus one. */
+  int used;              /* Slots holding an identifier. */
+  char *before;          /* Row content before the change in progress. */
+  int beforelen, beforecap;
+  char *after;           /* Gap buffer row content made contiguous. */
+  int aftercap;
+  identToken *toks;      /* Identifiers of the rows compared. */
+  int tokcap;
+} identIndex;
+
+/* Pattern compiled for searchFind(). */
+typedef struct searchPattern {
+  const char *s; /* Pattern, not null terminated. */
+  int len;
+  int shift[256]; /* Horspool shift for every last byte of a window. */
+} searchPattern;
+
+/* Regular expressions are compiled to the program of a Thompson NFA, see
+ * regexCompile(). The program is never backtracked: lines are first run
+ * through a DFA built lazily from it, and only those holding a match are
+ * run through the NFA itself to know where the matches are. */
+#define RE_MAX_INSTS 4096  /* Longest program, repetitions expanded. */
+#define RE_MAX_STATES 512  /* DFA states cached before starting over. */
+
+enum reOp {
+  RE_CLASS, /* Consume a byte of class 'x'. */
+  RE_SPLIT, /* Go on at both 'x' and 'y', 'x' first. */
+  RE_JMP,   /* Go on at 'x'. */
+  RE_BOL,   /* Go on if at the start of the line. */
+  RE_EOL,   /* Go on if at the end of the line. */
+  RE_MATCH  /* A match ends here. */
+};
+
+typedef struct reInst {
+  int op;
+  int x, y;
+} reInst;
+
+typedef struct regex {
+  reInst *prog;                /* Instructions, starting at 0. */
+  int len;
+  unsigned char (*classes)[32]; /* Bitmaps of the bytes of every class. */
+  int nclasses;
+  char *prefix;                /* Literal every match starts with. */
+  int prefixlen;
+} regex;
+
+typedef struct reState {
+  int *pcs;      /* Threads of the NFA, at CLASS, EOL or MATCH. */
+  int n;
+  int match;     /* A match ends here. */
+  int eolmatch;  /* A match ends here if the line does. */
+  int next[256]; /* State after every byte, -1 if not known yet. */
+} reState;
+
+/* What a thread needs to run a regex: the DFA states it built so far, and
+ * room for the NFA threads. */
+typedef struct reExec {
+  const regex *re;
+  reState *states;
+  int nstates;
+  int *slots;          /* Hash table of the states by their threads. */
+  int start;           /* State at the start of a line, -1 if not known. */
+  int epoch;           /* Times the states were dropped. */
+  int *list[2];        /* Threads at this and the next byte: pc... */
+  int *from[2];        /* ...and offset of the match they make. */
+  unsigned int *seen;  /* Generation in which a pc was last added. */
+  unsigned int gen;    /* Never 0 once started, see reNextGen(). */
+  int *stack;
+  long budget;         /* Bytes the NFA may still step over, -1 if any. */
+} reExec;
+
+/* Finding every match in a line may take time quadratic in its length, as
+ * with "a|a.*b" on a line of 'a': a search gives up on the rest of a line
+ * after stepping the NFA over this many bytes per byte of it. */
+#define RE_LINE_STEPS 16
+#define RE_LINE_STEPS_MIN 4096
+
+/* Search of the whole file in the background, see editorSearchStart().
+ * Files of at least KILO_SEARCH_THREADED_MIN bytes are split between
+ * threads as for line indexing. */
+#define KILO_SEARCH_THREADED_MIN (4 * 1024 * 1024)
+#define KILO_SEARCH_STACK 16 /* Earlier searches kept for Backspace. */
+
+typedef struct searchMatch {
+  int row; /* Row of the match. */
+  int col; /* Offset of the match in the row. */
+  int len; /* Bytes of the match. */
+} searchMatch;
+
+typedef struct searchSpan {
+  const char *buf; /* Consecutive rows, separated by newlines. */
+  size_t len;      /* Bytes of 'buf'. */
+  int row;         /* Index of the first row. */
+} searchSpan;
+
+typedef struct searchPart {
+  struct searchJob *job;
+  pthread_t tid;
+  int started, joined;  /* State of the thread, if any. */
+  int finished;         /* Set by the worker when done, under the lock. */
+  int first, last;      /* Spans to search. */
+  searchMatch *matches; /* Matches found, in file order. */
+  int count, cap;       /* Used and allocated items of 'matches'. */
+  reExec exec;          /* Run of the regex, if searching for one. */
+  searchSpan *lines;    /* Rows holding the matches, searching for text. */
+  int nlines, linecap;
+} searchPart;
+
+typedef struct searchJob {
+  char *query;            /* Text searched for. */
+  int regex;              /* 'query' is a regex. */
+  searchPattern pat;      /* 'query' compiled, or the regex prefix. */
+  regex *re;              /* 'query' compiled, in regex mode. */
+  const char *error;      /* Why 'query' is not a valid regex. */
+  searchSpan *spans;      /* Content of the file. */
+  int nspans, spancap;
+  char *copy;             /* Chunks holding the rows not in E.orig. */
+  size_t copyused, copysize;
+  searchPart parts[KILO_INDEX_MAX_THREADS];
+  int nparts;
+  pthread_mutex_t lock;   /* Protects 'cancel' and 'finished'. */
+  int cancel;             /* Stop as soon as possible. */
+  int done;               /* All parts are merged in 'matches'. */
+  searchMatch *matches;   /* Every match in file order, once done. */
+  int count;              /* Number of matches, once done. */
+  int cur;                /* Index of the current match, -1 for none. */
+  searchMatch current;    /* The current match. */
+  searchSpan *lines;      /* Rows holding the matches, once done. */
+  int nlines;
+  struct searchJob *prev; /* Earlier search of the stack, for a shorter
+                             query. */
+} searchJob;
+
 typedef struct hlcolor {
   int r, g, b;
 } hlcolor;
@@ -86,8 +521,39 @@ struct editorConfig {
   int screenrows; /* Number of rows that we can show */
   int screencols; /* Number of cols that we can show */
   int numrows;    /* Number of rows */
+  int hlstale;    /* First row whose syntax state may be outdated. */
   int rawmode;    /* Is terminal raw mode enabled? */
-  erow *row;      /* Rows */
+  rowNode *rows;  /* Rows, see the row tree. */
+  origFile orig;  /* Original file content rows may point into. */
+  int crlf;       /* Lines end with \r\n instead of \n. */
+  int indexthreads; /* Threads used to index large files. */
+  size_t indexmin;  /* Smaller files are indexed on a single thread. */
+  int paging;       /* The file is loaded a page at a time. */
+  size_t pagingmin; /* Smaller files are loaded at once. */
+  int pagemax;      /* Maximum number of loaded pages. */
+  int maxrows;      /* Files with more lines are not opened. */
+  int pageloaded;   /* Number of loaded pages. */
+  rowPage *pagelru, *pagetail; /* Loaded pages, most recently used first. */
+  saveSnapshot *saving;        /* Save in progress in the background. */
+  hlJob *hljob;                /* Highlighting in the background. */
+  unsigned int hlversion;      /* Bumped when rows are added or removed. */
+  struct editorSyntax **syntaxdb; /* Syntaxes loaded from files, */
+  int syntaxcount;                /* how many, */
+  int syntaxloaded;               /* and if they were. */
+  editJournal journal;         /* Edits not saved yet. */
+  hlOverlay overlay[OVERLAY_LAYERS]; /* Search and word highlights. */
+  wordCache wordhl;            /* Word highlighted in OVERLAY_WORD. */
+  unsigned int rowversion;     /* Bumped when rendered rows change. */
+  identIndex idents;           /* Where identifiers occur. */
+  searchJob *search;           /* Search of the find prompt. */
+  int findregex;               /* The find prompt searches for regexes. */
+  rowArena arena; /* Storage for rows and their buffers. */
+  erow *gaprow;   /* Row being edited, kept as a gap buffer. */
+  int gapstart;   /* Offset of the gap inside gaprow->chars. */
+  int gaplen;     /* Length of the gap. */
+  erow *rxrow;    /* Row whose render column at offset rxat is known: */
+  int rxat, rxcol; /* it is rxcol, */
+  int rxtab;       /* and chars[rxtab..rxat) holds no tab. */
   int dirty;      /* File modified but not saved. */
   char *filename; /* Currently open filename */
   char statusmsg[80];
@@ -113,6 +579,7 @@ enum KEY_ACTION {
   CTRL_L = 12,     /* Ctrl+l */
   ENTER = 13,      /* Enter */
   CTRL_Q = 17,     /* Ctrl-q */
+  CTRL_R = 18,     /* Ctrl-r */
   CTRL_S = 19,     /* Ctrl-s */
   CTRL_U = 21,     /* Ctrl-u */
   ESC = 27,        /* Escape */
@@ -129,15 +596,118 @@ enum KEY_ACTION {
   END_KEY,
   PAGE_UP,
   PAGE_DOWN,
-  UNDO_KEY /* ESC+u for undo */
+  UNDO_KEY,      /* ESC+u for undo */
+  NEXT_WORD_KEY, /* ESC+n for next occurrence of the word */
+  PREV_WORD_KEY  /* ESC+p for previous occurrence of the word */
 };
 
 void editorSetStatusMessage(const char *fmt, ...);
+void editorRefreshScreen(void);
+
+/* Row storage function declarations */
+void *rowAlloc(size_t size);
+void rowFree(void *p, size_t size);
+void *rowRealloc(void *p, size_t oldsize, size_t newsize);
+void rowAllocReset(void);
+
+/* Row tree function declarations */
+void editorUpdateRow(erow *row);
+void editorUpdateRowFrom(erow *row, int at);
+void editorUpdateSyntax(erow *row);
+void editorSyntaxCompile(struct editorSyntax *syn);
+struct editorSyntax *editorSyntaxLoad(const char *path);
+void editorSyntaxFree(struct editorSyntax *syn);
+void editorSyntaxUnload(void);
+void editorSyntaxLoadDir(const char *dir);
+int keywordLookup(keywordTable *t, const char *s, int len);
+void editorFreeRow(erow *row);
+void editorFreeRows(void);
+void editorRowMakeOwned(erow *row);
+char editorRowCharAt(erow *row, int at);
+int editorRowRenderCol(erow *row, int at);
+void editorRowMaterialize(erow *row);
+int editorRowUpdateState(erow *row);
+void editorSyntaxPropagate(int at, int last);
+void editorSyntaxChanged(int at);
+void editorSyntaxCatchUp(int upto);
+int editorLexRow(struct editorSyntax *syn, char *render, int rsize,
+                 unsigned char *hl, int in_comment);
+void editorHighlightStart(void);
+void editorHighlightStop(void);
+int editorHighlightPoll(int wait);
+void editorRowEnsureState(erow *row);
+void editorRowGapClose(void);
+erow *editorRowAt(int at);
+erow *editorRowPeek(int at);
+rowNode *rowTreeLookup(int at, int *slot, int load);
+int editorRowIndex(erow *row);
+void rowIterInit(rowIter *it, int at);
+erow *rowIterNext(rowIter *it);
+
+/* Line indexing function declarations */
+void lineIndexScan(lineIndex *li, const char *buf, size_t from, size_t to);
+void lineIndexBuild(lineIndex *li, const char *buf, size_t len);
+int editorThreadCount(size_t len, size_t min);
+int editorLoadLeaves(lineIndex *li, size_t start, size_t end,
+                     rowNode **leaves);
+
+/* Saving function declarations */
+int editorSave(void);
+void editorSaveBackground(void);
+int editorSavePoll(int wait);
+
+/* Journal function declarations */
+void editorJournalRecord(int op, int row, int col, const char *s,
+                         size_t len);
+void editorJournalFlush(int sync);
+void editorJournalDiscard(void);
+void editorJournalOpen(void);
+void editorJournalSaved(struct stat *st, size_t pos, int clean);
+
+/* Paging function declarations */
+void rowPageLoad(rowNode *n);
+void rowPageEvict(rowNode *n);
+void rowPageTouch(rowPage *pg);
+void rowPagePin(rowNode *n);
+size_t rowPageSavedLen(rowPage *pg, int *addnl);
 
 /* Word highlighting function declarations */
+void editorOverlayClear(int layer);
+void editorOverlayAdd(int layer, int row, int start, int len);
+void editorOverlayApply(int row, int from, int len, unsigned char *hl);
 void editorHighlightWordUnderCursor(void);
 int editorGetWordAtCursor(char *word, int *start_pos, int *end_pos);
 
+/* Identifier index function declarations */
+void identIndexBuild(void);
+void identIndexFree(void);
+identEntry *identIndexLookup(const char *s, int len, int create);
+void identIndexRowBegin(erow *row);
+void identIndexRowEnd(erow *row);
+void identIndexRowAdded(erow *row);
+void identIndexRowRemoved(erow *row);
+int identIndexPosition(identEntry *e, erow *row);
+void editorJumpToOccurrence(int dir);
+
+/* Search function declarations */
+void searchCompile(searchPattern *p, const char *s, int len);
+const char *searchFind(searchPattern *p, const char *hay, const char *end);
+regex *regexCompile(const char *pattern, int len, const char **error);
+void regexFree(regex *re);
+void reExecInit(reExec *x, const regex *re);
+void reExecFree(reExec *x);
+int reLineHasMatch(reExec *x, const char *s, int len);
+int reLineNext(reExec *x, const char *s, int len, int from, int *start,
+               int *end);
+void editorSearchStart(const char *query, int len);
+void editorSearchStop(void);
+int editorSearchPoll(int wait);
+int editorSearchFirst(void);
+int editorSearchLocate(searchJob *j, int row, int col);
+void editorSearchShow(const char *query);
+int editorReplaceAll(const char *with, int len);
+int editorUndoReplace(const char *data, int len);
+
 /* Undo function declarations */
 void pushUndoOp(enum undo_type type, int row, int col, char *data,
                 int data_len);
@@ -17,9 +17,10 @@ void test_del_key_middle_of_line() {
     E.cy = 0;
 
     editorForwardDelChar();
+    editorRowGapClose();
 
     assert(E.numrows == 1);
-    assert(strcmp(E.row[0].chars, "hello orld") == 0);
+    assert(strcmp(editorRowAt(0)->chars, "hello orld") == 0);
     assert(E.cx == 6); // Cursor should not move
 }
 
@@ -32,9 +33,10 @@ void test_del_key_end_of_line_merge() {
     E.cy = 0;
 
     editorForwardDelChar();
+    editorRowGapClose();
 
     assert(E.numrows == 1);
-    assert(strcmp(E.row[0].chars, "helloworld") == 0);
+    assert(strcmp(editorRowAt(0)->chars, "helloworld") == 0);
     assert(E.cx == 5);
 }
 
@@ -45,8 +47,9 @@ void test_del_key_at_end_of_file() {
     E.cy = 0;
 
     editorForwardDelChar();
+    editorRowGapClose();
 
     assert(E.numrows == 1);
-    assert(strcmp(E.row[0].chars, "hello") == 0); // Nothing should change
+    assert(strcmp(editorRowAt(0)->chars, "hello") == 0); // Nothing should change
     assert(E.cx == 5);
 }
\ No newline at end of file
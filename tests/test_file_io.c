@@ -0,0 +1,403 @@
+#define _POSIX_C_SOURCE 200809L /* For symlink(), lstat() and truncate(). */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include "../kilo.h"
+
+void initEditor(void);
+int editorOpen(char *filename);
+int editorSave(void);
+void editorRowInsertChar(erow *row, int at, int c);
+void editorSelectSyntaxHighlight(char *filename);
+void editorDelRow(int at);
+int editorOrigCheck(void);
+
+#define TEST_FILE "/tmp/kilo_test_file_io.txt"
+
+static void write_file(const char *content) {
+    FILE *fp = fopen(TEST_FILE, "w");
+    assert(fp != NULL);
+    fputs(content, fp);
+    fclose(fp);
+}
+
+static void check_file(const char *content) {
+    char buf[256];
+    FILE *fp = fopen(TEST_FILE, "r");
+    assert(fp != NULL);
+    size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+    buf[len] = '\0';
+    fclose(fp);
+    assert(strcmp(buf, content) == 0);
+}
+
+void test_open_rows_are_views(void) {
+    initEditor();
+    write_file("first\nsecond\n\nlast");
+    assert(editorOpen(TEST_FILE) == 0);
+    assert(E.numrows == 4);
+    assert(editorRowAt(0)->flags & ROW_VIEW);
+    assert(editorRowAt(1)->size == 6);
+    assert(memcmp(editorRowAt(1)->chars, "second", 6) == 0);
+    assert(editorRowAt(2)->size == 0);
+    assert(memcmp(editorRowAt(3)->chars, "last", 4) == 0);
+    assert(E.dirty == 0);
+}
+
+void test_save_after_edit(void) {
+    initEditor();
+    write_file("one\ntwo\nthree\n");
+    assert(editorOpen(TEST_FILE) == 0);
+
+    erow *row = editorRowAt(1);
+    editorRowInsertChar(row, 3, 's');
+    assert(!(row->flags & ROW_VIEW));
+    editorRowGapClose();
+    assert(strcmp(row->chars, "twos") == 0);
+
+    assert(editorSave() == 0);
+    check_file("one\ntwos\nthree\n");
+    assert(E.dirty == 0);
+
+    /* Rows still read correctly once the file changed under them. */
+    assert(memcmp(editorRowAt(0)->chars, "one", 3) == 0);
+    assert(memcmp(editorRowAt(1)->chars, "twos", 4) == 0);
+    assert(memcmp(editorRowAt(2)->chars, "three", 5) == 0);
+
+    editorRowInsertChar(editorRowAt(0), 0, '>');
+    assert(editorSave() == 0);
+    check_file(">one\ntwos\nthree\n");
+    remove(TEST_FILE);
+}
+
+void test_open_is_lazy(void) {
+    char *path = "/tmp/kilo_test_lazy.c";
+    FILE *fp = fopen(path, "w");
+    assert(fp != NULL);
+    fputs("int a;\n/* open\nstill\n*/ int b;\nint c;\n", fp);
+    fclose(fp);
+
+    initEditor();
+    editorSelectSyntaxHighlight(path);
+    assert(editorOpen(path) == 0);
+    for (int j = 0; j < E.numrows; j++)
+        assert(editorRowAt(j)->render == NULL);
+
+    /* Highlighting a row computes the comment state of the rows above it,
+     * without materializing them. */
+    erow *row = editorRowAt(2);
+    editorRowMaterialize(row);
+    assert(row->hl[0] == HL_MLCOMMENT);
+    assert(editorRowAt(1)->render == NULL);
+    assert(editorRowAt(1)->flags & ROW_HL_STATE);
+    assert(editorRowAt(1)->hl_oc == 1);
+
+    /* Deleting the comment start re-highlights the rows below. */
+    editorDelRow(1);
+    assert(row->hl[0] == HL_NORMAL);
+    editorRowMaterialize(editorRowAt(2));
+    assert(editorRowAt(2)->hl[4] == HL_KEYWORD2);
+
+    E.syntax = NULL;
+    remove(path);
+}
+
+void test_line_index_scan(void) {
+    char buf[1000];
+    lineIndex li = {0};
+    size_t expect = 0;
+
+    srand(6);
+    for (size_t j = 0; j < sizeof(buf); j++) {
+        buf[j] = rand() % 8 ? 'a' + rand() % 26 : '\n';
+        if (j >= 3 && buf[j] == '\n')
+            expect++;
+    }
+    lineIndexScan(&li, buf, 3, sizeof(buf));
+    assert(li.count == expect);
+    for (size_t j = 0, k = 0; j < sizeof(buf); j++) {
+        if (j >= 3 && buf[j] == '\n')
+            assert(li.nl[k++] == j);
+    }
+    free(li.nl);
+}
+
+void test_open_crlf(void) {
+    initEditor();
+    write_file("one\r\ntwo\r\n\r\nlast\r");
+    assert(editorOpen(TEST_FILE) == 0);
+    assert(E.crlf);
+    assert(E.numrows == 4);
+    assert(editorRowAt(0)->size == 3);
+    assert(editorRowAt(2)->size == 0);
+    assert(editorRowAt(3)->size == 4);
+
+    editorRowInsertChar(editorRowAt(1), 3, 's');
+    assert(editorSave() == 0);
+    check_file("one\r\ntwos\r\n\r\nlast\r\n");
+    assert(memcmp(editorRowAt(3)->chars, "last", 4) == 0);
+    remove(TEST_FILE);
+    E.crlf = 0;
+}
+
+/* With some lines ending with \n only, every \r stays in its row, so
+ * that saving gives the lines back as they were. */
+void test_open_mixed_endings(void) {
+    initEditor();
+    write_file("one\r\ntwo\nthree\r");
+    assert(editorOpen(TEST_FILE) == 0);
+    assert(!E.crlf);
+    assert(E.numrows == 3);
+    assert(editorRowAt(0)->size == 4);
+    assert(editorRowAt(1)->size == 3);
+    assert(editorRowAt(2)->size == 6);
+
+    editorRowInsertChar(editorRowAt(1), 3, 's');
+    assert(editorSave() == 0);
+    check_file("one\r\ntwos\nthree\r\n");
+
+    /* The same when the file is loaded in pages. */
+    initEditor();
+    E.pagingmin = 1;
+    assert(editorOpen(TEST_FILE) == 0);
+    assert(E.paging && !E.crlf);
+    assert(editorRowAt(0)->size == 4);
+    editorRowInsertChar(editorRowAt(1), 0, '>');
+    assert(editorSave() == 0);
+    check_file("one\r\n>twos\nthree\r\n");
+    E.pagingmin = KILO_PAGING_MIN;
+    remove(TEST_FILE);
+}
+
+/* Files with more lines than rows can be counted are refused. */
+void test_open_too_many_lines(void) {
+    write_file("one\ntwo\nthree\n");
+    for (int paging = 0; paging <= 1; paging++) {
+        pid_t pid = fork();
+        assert(pid != -1);
+        if (pid == 0) {
+            initEditor();
+            E.maxrows = 3;
+            E.pagingmin = paging ? 1 : KILO_PAGING_MIN;
+            freopen("/dev/null", "w", stderr);
+            editorOpen(TEST_FILE);
+            _exit(0);
+        }
+        int status;
+        assert(waitpid(pid, &status, 0) == pid);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+    }
+
+    write_file("one\ntwo\n");
+    initEditor();
+    E.maxrows = 3;
+    assert(editorOpen(TEST_FILE) == 0 && E.numrows == 2);
+    initEditor();
+    remove(TEST_FILE);
+}
+
+void test_line_index_threads(void) {
+    static char buf[100000];
+    lineIndex one = {0}, many = {0};
+
+    srand(7);
+    for (size_t j = 0; j < sizeof(buf); j++)
+        buf[j] = rand() % 40 ? 'x' : '\n';
+    lineIndexScan(&one, buf, 0, sizeof(buf));
+
+    int threads = E.indexthreads;
+    size_t min = E.indexmin;
+    E.indexthreads = 7;
+    E.indexmin = 0;
+    lineIndexBuild(&many, buf, sizeof(buf));
+    E.indexthreads = threads;
+    E.indexmin = min;
+
+    assert(many.count == one.count);
+    assert(memcmp(many.nl, one.nl, sizeof(size_t) * one.count) == 0);
+    free(one.nl);
+    free(many.nl);
+}
+
+void test_save_replaces_file(void) {
+    struct stat before, after;
+
+    initEditor();
+    write_file("keep\nthese\nlines\n");
+    assert(chmod(TEST_FILE, 0600) == 0);
+    assert(stat(TEST_FILE, &before) == 0);
+    assert(editorOpen(TEST_FILE) == 0);
+    editorRowInsertChar(editorRowAt(2), 5, 's');
+    assert(editorSave() == 0);
+
+    /* The file was replaced by a new one with the same permissions. */
+    assert(stat(TEST_FILE, &after) == 0);
+    assert(after.st_ino != before.st_ino);
+    assert((after.st_mode & 0777) == 0600);
+    check_file("keep\nthese\nliness\n");
+    remove(TEST_FILE);
+}
+
+void test_save_keeps_links(void) {
+    const char *link_file = "/tmp/kilo_test_file_io.link";
+    struct stat before, after;
+
+    /* Saving through a symlink replaces the file it points to. */
+    initEditor();
+    write_file("one\ntwo\n");
+    unlink(link_file);
+    assert(symlink(TEST_FILE, link_file) == 0);
+    assert(editorOpen((char *)link_file) == 0);
+    editorRowInsertChar(editorRowAt(0), 3, '!');
+    assert(editorSave() == 0);
+    assert(lstat(link_file, &after) == 0 && S_ISLNK(after.st_mode));
+    check_file("one!\ntwo\n");
+    unlink(link_file);
+
+    /* A file with other names is written in place, also while rows are
+     * still views of it. */
+    initEditor();
+    assert(link(TEST_FILE, link_file) == 0);
+    assert(stat(TEST_FILE, &before) == 0);
+    assert(editorOpen(TEST_FILE) == 0);
+    editorRowInsertChar(editorRowAt(1), 0, '>');
+    editorSaveBackground();
+    editorRowInsertChar(editorRowAt(0), 0, '<');
+    editorSavePoll(1);
+    check_file("one!\n>two\n");
+    assert(stat(link_file, &after) == 0);
+    assert(after.st_ino == before.st_ino && after.st_nlink == 2);
+    editorRowGapClose();
+    assert(memcmp(editorRowAt(0)->chars, "<one!", 5) == 0);
+    assert(memcmp(editorRowAt(1)->chars, ">two", 4) == 0);
+    assert(editorSave() == 0);
+    check_file("<one!\n>two\n");
+    assert(stat(TEST_FILE, &after) == 0 && after.st_ino == before.st_ino);
+    unlink(link_file);
+    remove(TEST_FILE);
+}
+
+/* A file in a directory that takes no new files is still saved, in
+ * place. Root can create files there anyway, and saves as usual. */
+void test_save_readonly_dir(void) {
+    const char *dir = "/tmp/kilo_test_ro_dir";
+    const char *file = "/tmp/kilo_test_ro_dir/file.txt";
+    struct stat before, after;
+
+    mkdir(dir, 0755);
+    FILE *fp = fopen(file, "w");
+    fputs("one\n", fp);
+    fclose(fp);
+    assert(chmod(dir, 0555) == 0);
+    assert(stat(file, &before) == 0);
+
+    initEditor();
+    assert(editorOpen((char *)file) == 0);
+    editorRowInsertChar(editorRowAt(0), 3, '!');
+    assert(editorSave() == 0);
+    assert(stat(file, &after) == 0);
+    if (geteuid() != 0)
+        assert(after.st_ino == before.st_ino);
+    fp = fopen(file, "r");
+    char buf[16] = {0};
+    assert(fread(buf, 1, sizeof(buf), fp) == 5 && strcmp(buf, "one!\n") == 0);
+    fclose(fp);
+
+    initEditor();
+    chmod(dir, 0755);
+    remove(file);
+    rmdir(dir);
+}
+
+/* Another program truncating the file under the rows viewing it. */
+void test_file_truncated(void) {
+    struct stat st;
+    FILE *fp = fopen(TEST_FILE, "w");
+    for (int i = 0; i < 4000; i++)
+        fprintf(fp, "line %04d\n", i);
+    fclose(fp);
+
+    initEditor();
+    assert(editorOpen(TEST_FILE) == 0);
+    assert(E.orig.mapped && E.numrows == 4000);
+    assert(truncate(TEST_FILE, 0) == 0);
+
+    /* Past the end of the file, the rows read as zeros. */
+    assert(editorRowAt(3000)->chars[0] == '\0');
+    assert(editorOrigCheck() == 1);
+    assert(strstr(E.statusmsg, "truncated") != NULL);
+    assert(editorOrigCheck() == 0);
+
+    /* Saving warns first, then overwrites the file. */
+    assert(truncate(TEST_FILE, 5) == 0);
+    assert(editorSave() == 1);
+    assert(strstr(E.statusmsg, "save again") != NULL);
+    assert(editorSave() == 0);
+    assert(stat(TEST_FILE, &st) == 0 && st.st_size == 40000);
+
+    initEditor();
+    remove(TEST_FILE);
+}
+
+void test_save_background(void) {
+    initEditor();
+    write_file("alpha\nbeta\n");
+    assert(editorOpen(TEST_FILE) == 0);
+
+    /* Edits made while saving are not part of the save, and keep the file
+     * dirty. */
+    editorRowInsertChar(editorRowAt(0), 5, '1');
+    editorSaveBackground();
+    editorRowInsertChar(editorRowAt(1), 4, '2');
+    editorSavePoll(1);
+    assert(E.saving == NULL);
+    check_file("alpha1\nbeta\n");
+    assert(E.dirty == 1);
+
+    assert(editorSave() == 0);
+    check_file("alpha1\nbeta2\n");
+    assert(E.dirty == 0);
+
+    /* A failing save keeps the edits. */
+    char *filename = E.filename;
+    E.filename = "/nonexistent/dir/file";
+    editorRowInsertChar(editorRowAt(0), 0, '>');
+    assert(editorSave() == 1);
+    assert(E.dirty == 1);
+    editorRowGapClose();
+    assert(memcmp(editorRowAt(0)->chars, ">alpha1", 7) == 0);
+    E.filename = filename;
+    remove(TEST_FILE);
+}
+
+void test_save_large_unchanged_spans(void) {
+    FILE *fp = fopen(TEST_FILE, "w");
+    assert(fp != NULL);
+    for (int j = 0; j < 20000; j++)
+        fprintf(fp, "row %d\n", j);
+    fclose(fp);
+
+    /* Unchanged spans before and after the edit are copied from the old
+     * file, the edited row is written. */
+    initEditor();
+    assert(editorOpen(TEST_FILE) == 0);
+    editorRowInsertChar(editorRowAt(10000), 0, '>');
+    assert(editorSave() == 0);
+    editorRowInsertChar(editorRowAt(15000), 0, '<');
+    assert(editorSave() == 0);
+
+    fp = fopen(TEST_FILE, "r");
+    char buf[32], expected[32];
+    for (int j = 0; j < 20000; j++) {
+        assert(fgets(buf, sizeof(buf), fp) != NULL);
+        snprintf(expected, sizeof(expected), "%srow %d\n",
+                 j == 10000 ? ">" : j == 15000 ? "<" : "", j);
+        assert(strcmp(buf, expected) == 0);
+    }
+    assert(fgets(buf, sizeof(buf), fp) == NULL);
+    fclose(fp);
+    remove(TEST_FILE);
+}
@@ -0,0 +1,102 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../kilo.h"
+
+void initEditor(void);
+void editorInsertRow(int at, char *s, size_t len);
+void editorRowInsertChar(erow *row, int at, int c);
+void editorRowDelChar(erow *row, int at);
+void editorRowAppendString(erow *row, char *s, size_t len);
+void editorRowTruncate(erow *row, int at);
+
+void test_gap_buffer_edits(void) {
+    initEditor();
+    editorInsertRow(0, "hello world", 11);
+    erow *row = editorRowAt(0);
+
+    /* Type in the middle of the row, then move backward and delete. */
+    editorRowInsertChar(row, 5, ',');
+    editorRowInsertChar(row, 6, '!');
+    assert(E.gaprow == row);
+    assert(row->size == 13);
+    assert(editorRowCharAt(row, 5) == ',');
+    assert(editorRowCharAt(row, 7) == ' ');
+    assert(strcmp(row->render, "hello,! world") == 0);
+
+    editorRowDelChar(row, 0);
+    editorRowInsertChar(row, 0, 'H');
+    editorRowDelChar(row, 12);
+    assert(strcmp(row->render, "Hello,! worl") == 0);
+
+    /* Insert past the end pads with spaces. */
+    editorRowInsertChar(row, 14, 'x');
+    editorRowAppendString(row, "yz", 2);
+    assert(row->size == 17);
+    assert(strcmp(row->render, "Hello,! worl  xyz") == 0);
+
+    editorRowGapClose();
+    assert(E.gaprow == NULL);
+    assert(strcmp(row->chars, "Hello,! worl  xyz") == 0);
+}
+
+void test_gap_buffer_switch_rows(void) {
+    initEditor();
+    editorInsertRow(0, "abc", 3);
+    editorInsertRow(1, "def", 3);
+    erow *a = editorRowAt(0), *b = editorRowAt(1);
+
+    for (int j = 0; j < 1000; j++)
+        editorRowInsertChar(a, 1 + j, 'x');
+    editorRowInsertChar(b, 0, '>');
+    /* Editing another row flattens the previous one. */
+    assert(E.gaprow == b);
+    assert(a->size == 1003 && a->chars[1003] == '\0');
+    assert(a->chars[0] == 'a' && a->chars[1000] == 'x');
+    assert(a->chars[1001] == 'b' && a->chars[1002] == 'c');
+    editorRowGapClose();
+    assert(strcmp(b->chars, ">def") == 0);
+}
+
+/* Edits render the row again from the edited column only: the render is
+ * the same as rendering the whole row, tabs included. */
+void test_gap_buffer_render_from(void) {
+    char want[256];
+
+    initEditor();
+    editorInsertRow(0, "\tab\tc", 6);
+    erow *row = editorRowAt(0);
+    srand(11);
+    for (int k = 0, cur = 0; k < 2000; k++) {
+        /* Mostly typing and deleting around the same column, as with the
+         * cursor, where the render column of the gap start is reused. */
+        int op = rand() % 8, at = row->size ? rand() % (row->size + 2) : 0;
+        if (k % 4 && cur <= row->size)
+            at = op < 4 || cur == 0 ? cur : cur - 1;
+        if (op < 4 && row->size < 100) {
+            editorRowInsertChar(row, at, "\tab "[rand() % 4]);
+            cur = at + 1;
+        } else if (op < 6) {
+            editorRowDelChar(row, at);
+            cur = at;
+        } else if (op == 6 && row->size < 100) {
+            editorRowAppendString(row, "\tx", 2);
+        } else {
+            editorRowTruncate(row, row->size - row->size / 8);
+        }
+
+        int idx = 0;
+        for (int j = 0; j < row->size; j++) {
+            char c = editorRowCharAt(row, j);
+            if (c == TAB) {
+                do
+                    want[idx++] = ' ';
+                while (idx % TAB_SIZE != 0);
+            } else {
+                want[idx++] = c;
+            }
+        }
+        want[idx] = '\0';
+        assert(row->rsize == idx && strcmp(row->render, want) == 0);
+    }
+}
@@ -0,0 +1,144 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "../kilo.h"
+
+void initEditor(void);
+void editorRowInsertChar(erow *row, int at, int c);
+void editorRowDelChar(erow *row, int at);
+void editorInsertRow(int at, char *s, size_t len);
+void editorDelRow(int at);
+void editorRowAppendString(erow *row, char *s, size_t len);
+void editorRowTruncate(erow *row, int at);
+
+/* Occurrences of 'word' as row numbers, like "0 0 2". */
+static void check_occ(const char *word, const char *expect) {
+    char buf[256] = "";
+    identEntry *e = identIndexLookup(word, strlen(word), 0);
+    for (int j = 0; e && j < e->count; j++) {
+        assert(e->occ[j].n > 0);
+        for (int k = 0; k < e->occ[j].n; k++)
+            sprintf(buf + strlen(buf), "%s%d", *buf ? " " : "",
+                    editorRowIndex(e->occ[j].row));
+    }
+    /* Identifiers that no longer occur are gone. */
+    assert(e == NULL || e->total > 0);
+    assert(strcmp(buf, expect) == 0);
+}
+
+static void check_rebuilt(const char **words, int n) {
+    int counts[16];
+    for (int j = 0; j < n; j++) {
+        identEntry *e = identIndexLookup(words[j], strlen(words[j]), 0);
+        counts[j] = e ? e->total : 0;
+    }
+    identIndexFree();
+    identIndexBuild();
+    for (int j = 0; j < n; j++) {
+        identEntry *e = identIndexLookup(words[j], strlen(words[j]), 0);
+        assert(counts[j] == (e ? e->total : 0));
+    }
+}
+
+void test_ident_index(void) {
+    initEditor();
+    char *rows[] = {"int foo = foo + 1;", "bar(foo_x, 42)", "foo bar 7foo",
+                    "x1 = foo;"};
+    for (int j = 0; j < 4; j++)
+        editorInsertRow(j, rows[j], strlen(rows[j]));
+
+    /* Built on demand from the whole file. */
+    assert(identIndexLookup("foo", 3, 0) == NULL);
+    identIndexBuild();
+    check_occ("foo", "0 0 2 3");
+    check_occ("bar", "1 2");
+    check_occ("foo_x", "1");
+    check_occ("x1", "3");
+    assert(identIndexLookup("42", 2, 0) == NULL);
+    assert(identIndexLookup("7foo", 4, 0) == NULL);
+
+    /* Kept up to date by the row primitives. */
+    editorInsertRow(1, "foo", 3);
+    check_occ("foo", "0 0 1 3 4");
+    check_occ("bar", "2 3");
+    editorRowInsertChar(editorRowAt(1), 3, 'd');
+    check_occ("foo", "0 0 3 4");
+    check_occ("food", "1");
+    editorRowInsertChar(editorRowAt(0), 7, ' ');
+    check_occ("foo", "0 0 3 4");
+    editorRowDelChar(editorRowAt(0), 4);
+    check_occ("foo", "0 3 4");
+    check_occ("oo", "0");
+    editorRowAppendString(editorRowAt(2), " foo foo", 8);
+    check_occ("foo", "0 2 2 3 4");
+    editorRowTruncate(editorRowAt(3), 3);
+    check_occ("foo", "0 2 2 3 4");
+    check_occ("bar", "2");
+    editorDelRow(0);
+    check_occ("foo", "1 1 2 3");
+    check_occ("oo", "");
+    assert(identIndexLookup("oo", 2, 0) == NULL);
+    const char *words[] = {"foo", "bar", "food", "oo", "foo_x", "x1", "int"};
+    check_rebuilt(words, 7);
+
+    /* Jumping from occurrence to occurrence, wrapping around. */
+    int screenrows = E.screenrows, screencols = E.screencols;
+    E.screenrows = 2;
+    E.screencols = 80;
+    E.rowoff = 0;
+    E.cy = 1;
+    E.cx = 16;
+    editorJumpToOccurrence(1);
+    assert(E.rowoff + E.cy == 1 && E.cx == 19);
+    assert(strcmp(E.statusmsg, "occurrence 2/4") == 0);
+    editorJumpToOccurrence(1);
+    assert(E.rowoff + E.cy == 2 && E.cx == 0);
+    editorJumpToOccurrence(1);
+    assert(E.rowoff + E.cy == 3 && E.cx == 5);
+    assert(strcmp(E.statusmsg, "occurrence 4/4") == 0);
+    editorJumpToOccurrence(1);
+    assert(E.rowoff + E.cy == 1 && E.cx == 15);
+    editorJumpToOccurrence(-1);
+    assert(E.rowoff + E.cy == 3 && E.cx == 5);
+    assert(strcmp(E.statusmsg, "occurrence 4/4") == 0);
+    E.cx = 0;
+    editorJumpToOccurrence(1);
+    assert(strcmp(E.statusmsg, "occurrence 1/1") == 0);
+    E.cx = 3;
+    editorJumpToOccurrence(1);
+    assert(strcmp(E.statusmsg, "No identifier under the cursor") == 0);
+    E.screenrows = screenrows;
+    E.screencols = screencols;
+    initEditor();
+    assert(identIndexLookup("foo", 3, 0) == NULL);
+}
+
+/* Removing identifiers keeps the others reachable in the hash table. */
+void test_ident_index_remove(void) {
+    char row[8000] = "", word[16];
+    int len = 0;
+
+    initEditor();
+    for (int j = 0; j < 1000; j++)
+        len += sprintf(row + len, "w%d ", j);
+    editorInsertRow(0, row, len);
+    editorInsertRow(1, "w1 w1", 5);
+    identIndexBuild();
+    int used = E.idents.used;
+
+    /* Truncate after "w499 ". */
+    editorRowTruncate(editorRowAt(0), strstr(row, "w500 ") - row);
+    assert(E.idents.used == used - 500);
+    for (int j = 0; j < 1000; j++) {
+        sprintf(word, "w%d", j);
+        identEntry *e = identIndexLookup(word, strlen(word), 0);
+        assert(j < 500 ? e != NULL && e->total == (j == 1 ? 3 : 1)
+                       : e == NULL);
+    }
+    check_occ("w1", "0 1 1");
+    editorDelRow(1);
+    check_occ("w1", "0");
+    editorDelRow(0);
+    assert(E.idents.used == 0);
+    initEditor();
+}
@@ -0,0 +1,214 @@
+#define _POSIX_C_SOURCE 200809L /* For symlink() and truncate(). */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../kilo.h"
+
+void initEditor(void);
+int editorOpen(char *filename);
+int editorSave(void);
+void editorRowInsertChar(erow *row, int at, int c);
+void editorRowDelChar(erow *row, int at);
+void editorInsertRow(int at, char *s, size_t len);
+void editorDelRow(int at);
+void editorRowAppendString(erow *row, char *s, size_t len);
+void editorRowTruncate(erow *row, int at);
+void editorRowSetChars(erow *row, const char *s, size_t len);
+void editorSaveBackground(void);
+int editorSavePoll(int wait);
+
+#define TEST_FILE "/tmp/kilo_test_journal.txt"
+#define TEST_JOURNAL "/tmp/.kilo_test_journal.txt.kjournal"
+
+static void check_row(int at, const char *s) {
+    erow *row = editorRowAt(at);
+    editorRowGapClose();
+    assert(row->size == (int)strlen(s));
+    assert(memcmp(row->chars, s, row->size) == 0);
+}
+
+/* Leave the journal behind, as if kilo had crashed. */
+static void crash(void) {
+    editorJournalFlush(1);
+    close(E.journal.fd);
+    E.journal.fd = -1;
+    initEditor();
+    E.journal.enabled = 1;
+}
+
+void test_journal_recovers_edits(void) {
+    FILE *fp = fopen(TEST_FILE, "w");
+    assert(fp != NULL);
+    fputs("first\nsecond\nthird\n", fp);
+    fclose(fp);
+    remove(TEST_JOURNAL);
+
+    initEditor();
+    E.journal.enabled = 1;
+    assert(editorOpen(TEST_FILE) == 0);
+    assert(access(TEST_JOURNAL, F_OK) == -1);
+    editorRowInsertChar(editorRowAt(0), 5, '!');
+    editorRowDelChar(editorRowAt(1), 0);
+    editorInsertRow(3, "4", 1);
+    editorRowSetChars(editorRowAt(3), "fourth", 6);
+    editorDelRow(2);
+    editorRowTruncate(editorRowAt(0), 3);
+    editorRowAppendString(editorRowAt(0), "-x", 2);
+    crash();
+
+    /* Reopening replays the edits over the file. */
+    assert(editorOpen(TEST_FILE) == 0);
+    assert(E.dirty > 0);
+    assert(E.numrows == 3);
+    check_row(0, "fir-x");
+    check_row(1, "econd");
+    check_row(2, "fourth");
+
+    /* Edits after the recovery go on in the same journal. */
+    editorRowInsertChar(editorRowAt(1), 0, 's');
+    crash();
+    assert(editorOpen(TEST_FILE) == 0);
+    check_row(1, "second");
+
+    /* A save keeps the edits made after its snapshot only. */
+    assert(editorSave() == 0);
+    assert(access(TEST_JOURNAL, F_OK) == -1);
+    editorDelRow(0);
+    crash();
+    assert(editorOpen(TEST_FILE) == 0);
+    assert(E.numrows == 2);
+    check_row(0, "second");
+
+    /* A journal for another version of the file is not replayed. */
+    crash();
+    fp = fopen(TEST_FILE, "a");
+    fputs("more\n", fp);
+    fclose(fp);
+    assert(editorOpen(TEST_FILE) == 0);
+    assert(E.numrows == 4);
+    check_row(0, "fir-x");
+    assert(access(TEST_JOURNAL ".old", F_OK) == 0);
+
+    initEditor();
+    remove(TEST_FILE);
+    remove(TEST_JOURNAL);
+    remove(TEST_JOURNAL ".old");
+}
+
+/* Edits made while saving in the background are kept in the journal, as
+ * edits of the saved file, along with the ones made after. */
+void test_journal_background_save(void) {
+    FILE *fp = fopen(TEST_FILE, "w");
+    fputs("a\nb\nc\n", fp);
+    fclose(fp);
+    remove(TEST_JOURNAL);
+
+    initEditor();
+    E.journal.enabled = 1;
+    assert(editorOpen(TEST_FILE) == 0);
+    editorRowInsertChar(editorRowAt(0), 1, '1');
+    editorSaveBackground();
+    editorRowInsertChar(editorRowAt(1), 1, '2');
+    editorSavePoll(1);
+    assert(E.journal.path != NULL);
+    editorRowInsertChar(editorRowAt(2), 1, '3');
+    crash();
+
+    assert(editorOpen(TEST_FILE) == 0);
+    assert(access(TEST_JOURNAL ".old", F_OK) == -1);
+    check_row(0, "a1");
+    check_row(1, "b2");
+    check_row(2, "c3");
+
+    initEditor();
+    remove(TEST_FILE);
+    remove(TEST_JOURNAL);
+}
+
+/* A record cut short by a crash is dropped when recovering, and the next
+ * records don't get mixed with it. */
+void test_journal_truncated(void) {
+    FILE *fp = fopen(TEST_FILE, "w");
+    fputs("a\nb\n", fp);
+    fclose(fp);
+    remove(TEST_JOURNAL);
+
+    initEditor();
+    E.journal.enabled = 1;
+    assert(editorOpen(TEST_FILE) == 0);
+    editorRowInsertChar(editorRowAt(0), 1, '1');
+    editorRowAppendString(editorRowAt(1), "LONGTEXT", 8);
+    crash();
+    struct stat st;
+    assert(stat(TEST_JOURNAL, &st) == 0);
+    assert(truncate(TEST_JOURNAL, st.st_size - 3) == 0);
+
+    assert(editorOpen(TEST_FILE) == 0);
+    check_row(0, "a1");
+    check_row(1, "b");
+    editorRowInsertChar(editorRowAt(1), 1, '2');
+    crash();
+    assert(editorOpen(TEST_FILE) == 0);
+    check_row(0, "a1");
+    check_row(1, "b2");
+
+    initEditor();
+    remove(TEST_FILE);
+    remove(TEST_JOURNAL);
+}
+
+void test_journal_open(void) {
+    const char *target = "/tmp/kilo_test_journal.target";
+    FILE *fp = fopen(TEST_FILE, "w");
+    fputs("first\n", fp);
+    fclose(fp);
+    fp = fopen(target, "w");
+    fputs("keep", fp);
+    fclose(fp);
+    remove(TEST_JOURNAL);
+
+    /* A link in place of the journal is not written through: there is no
+     * journal for the file then. */
+    assert(symlink(target, TEST_JOURNAL) == 0);
+    initEditor();
+    E.journal.enabled = 1;
+    assert(editorOpen(TEST_FILE) == 0);
+    editorRowInsertChar(editorRowAt(0), 0, '>');
+    editorJournalFlush(1);
+    assert(E.journal.path == NULL);
+    fp = fopen(target, "r");
+    char buf[16] = {0};
+    assert(fread(buf, 1, sizeof(buf), fp) == 4 && strcmp(buf, "keep") == 0);
+    fclose(fp);
+    remove(TEST_JOURNAL);
+
+    /* Records written without syncing are synced by the next flush that
+     * asks for it, even with no new records. */
+    initEditor();
+    E.journal.enabled = 1;
+    assert(editorOpen(TEST_FILE) == 0);
+    editorRowInsertChar(editorRowAt(0), 0, '>');
+    editorJournalFlush(0);
+    assert(E.journal.len == 0 && E.journal.unsynced);
+    editorJournalFlush(1);
+    assert(!E.journal.unsynced);
+
+    /* A journal that can't be written is dropped, rather than kept with
+     * records missing. */
+    int fd = open("/dev/null", O_RDONLY);
+    assert(dup2(fd, E.journal.fd) != -1);
+    close(fd);
+    editorRowInsertChar(editorRowAt(0), 0, '>');
+    editorJournalFlush(0);
+    assert(E.journal.path == NULL && E.journal.fd == -1);
+    assert(access(TEST_JOURNAL, F_OK) == -1);
+    assert(strstr(E.statusmsg, "Can't write the journal") != NULL);
+
+    initEditor();
+    remove(TEST_FILE);
+    remove(TEST_JOURNAL);
+    remove(target);
+}
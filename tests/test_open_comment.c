@@ -1,12 +1,19 @@
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 #include "../kilo.h"
 
 int editorRowHasOpenComment(erow *row);
 
 void test_editorRowHasOpenComment(void) {
+    struct editorSyntax c, html;
     erow row;
     row.hl = NULL;
     row.rsize = 0;
+    row.flags = 0;
+    memset(&c, 0, sizeof(c));
+    strcpy(c.multiline_comment_end, "*/");
+    E.syntax = &c;
     assert(editorRowHasOpenComment(&row) == 0);
 
     row.rsize = 10;
@@ -24,6 +31,107 @@ void test_editorRowHasOpenComment(void) {
     row.render[row.rsize - 1] = '/';
     assert(editorRowHasOpenComment(&row) == 0);
 
+    /* The comment end is the one of the syntax. */
+    memset(&html, 0, sizeof(html));
+    strcpy(html.multiline_comment_end, "-->");
+    E.syntax = &html;
+    assert(editorRowHasOpenComment(&row) == 1);
+    memcpy(row.render + row.rsize - 3, "-->", 3);
+    assert(editorRowHasOpenComment(&row) == 0);
+
+    /* Once the lexer went over the row, its state says it. */
+    row.flags = ROW_HL_STATE;
+    row.hl_oc = 1;
+    assert(editorRowHasOpenComment(&row) == 1);
+    E.syntax = NULL;
+
     free(row.hl);
     free(row.render);
 }
+
+void initEditor(void);
+void editorInsertRow(int at, char *s, size_t len);
+void editorRowInsertChar(erow *row, int at, int c);
+void editorRowDelChar(erow *row, int at);
+void editorSelectSyntaxHighlight(char *filename);
+
+void test_open_comment_propagation_is_bounded(void) {
+    initEditor();
+    editorSelectSyntaxHighlight("test.c");
+    for (int j = 0; j < 1000; j++)
+        editorInsertRow(j, "int x;", 6);
+    editorRowEnsureState(editorRowAt(999));
+    E.rowoff = 0;
+    E.screenrows = 10;
+
+    /* Opening a comment highlights the rows on screen only. */
+    editorRowInsertChar(editorRowAt(0), 0, '*');
+    editorRowInsertChar(editorRowAt(0), 0, '/');
+    assert(editorRowAt(9)->hl_oc == 1);
+    assert(E.hlstale == 10);
+    assert(editorRowAt(500)->flags & ROW_HL_STATE);
+
+    /* Stale rows catch up once needed, and stop being stale. */
+    editorRowEnsureState(editorRowAt(999));
+    assert(editorRowAt(999)->hl_oc == 1);
+    assert(E.hlstale == INT_MAX);
+
+    /* Closing it again ends the same way. */
+    editorRowDelChar(editorRowAt(0), 0);
+    assert(E.hlstale == 10);
+    editorRowEnsureState(editorRowAt(700));
+    assert(editorRowAt(700)->hl_oc == 0);
+    assert(E.hlstale == 701);
+    editorRowEnsureState(editorRowAt(999));
+    assert(editorRowAt(999)->hl_oc == 0);
+    initEditor();
+}
+
+int editorOpen(char *filename);
+
+#define HL_TEST_FILE "/tmp/kilo_test_hl_worker.c"
+#define HL_TEST_ROWS 200000
+
+static void highlight_in_background(void) {
+    do {
+        editorHighlightPoll(1);
+    } while (E.hljob);
+}
+
+void test_background_highlighting(void) {
+    FILE *fp = fopen(HL_TEST_FILE, "w");
+    assert(fp != NULL);
+    for (int j = 0; j < HL_TEST_ROWS; j++)
+        fputs(j == 10 ? "/* open\n" : j == 150000 ? "close */\n" : "int x;\n",
+              fp);
+    fclose(fp);
+
+    initEditor();
+    editorSelectSyntaxHighlight(HL_TEST_FILE);
+    assert(editorOpen(HL_TEST_FILE) == 0);
+    E.rowoff = 0;
+    E.screenrows = 10;
+
+    /* Rows added meanwhile make the job useless, but not the next ones. */
+    editorHighlightStart();
+    assert(E.hljob != NULL);
+    editorInsertRow(0, "int y;", 6);
+    highlight_in_background();
+    assert(editorRowAt(HL_TEST_ROWS)->flags & ROW_HL_STATE);
+    assert(editorRowAt(10)->hl_oc == 0);
+    assert(editorRowAt(11)->hl_oc == 1);
+    assert(editorRowAt(150000)->hl_oc == 1);
+    assert(editorRowAt(150001)->hl_oc == 0);
+
+    /* Stale rows are computed again in the background too. */
+    editorRowDelChar(editorRowAt(11), 0);
+    assert(E.hlstale == 12);
+    highlight_in_background();
+    assert(E.hlstale == INT_MAX);
+    assert(editorRowAt(11)->hl_oc == 0);
+    assert(editorRowAt(150001)->hl_oc == 0);
+    assert(editorRowAt(HL_TEST_ROWS)->hl_oc == 0);
+
+    initEditor();
+    remove(HL_TEST_FILE);
+}
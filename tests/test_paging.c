@@ -0,0 +1,126 @@
+#define _POSIX_C_SOURCE 200809L /* For setenv(). */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../kilo.h"
+
+void initEditor(void);
+int editorOpen(char *filename);
+int editorSave(void);
+void editorRowInsertChar(erow *row, int at, int c);
+void editorInsertRow(int at, char *s, size_t len);
+void editorDelRow(int at);
+
+#define TEST_FILE "/tmp/kilo_test_paging.txt"
+#define TEST_LINES (KILO_PAGE_LINES * 3 + 100)
+
+/* Expected content of every row. */
+static char lines[TEST_LINES + 1][16];
+
+static void check_rows(int numrows) {
+    rowIter it;
+    erow *row;
+    int j = 0;
+
+    editorRowGapClose();
+    assert(E.numrows == numrows);
+    rowIterInit(&it, 0);
+    while ((row = rowIterNext(&it)) != NULL) {
+        assert(row->size == (int)strlen(lines[j]));
+        assert(memcmp(row->chars, lines[j], row->size) == 0);
+        assert(E.pageloaded <= E.pagemax);
+        j++;
+    }
+    assert(j == numrows);
+}
+
+static void check_file(int numrows) {
+    FILE *fp = fopen(TEST_FILE, "r");
+    char buf[32];
+    int j = 0;
+
+    assert(fp != NULL);
+    while (fgets(buf, sizeof(buf), fp)) {
+        assert(j < numrows);
+        buf[strlen(buf) - 1] = '\0';
+        assert(strcmp(buf, lines[j]) == 0);
+        j++;
+    }
+    assert(j == numrows);
+    fclose(fp);
+}
+
+void test_paging_open_edit_save(void) {
+    FILE *fp = fopen(TEST_FILE, "w");
+    assert(fp != NULL);
+    for (int j = 0; j < TEST_LINES; j++) {
+        snprintf(lines[j], sizeof(lines[j]), "line %d", j);
+        fprintf(fp, j == TEST_LINES - 1 ? "%s" : "%s\n", lines[j]);
+    }
+    fclose(fp);
+
+    initEditor();
+    E.pagingmin = 1;
+    E.pagemax = 2;
+    assert(editorOpen(TEST_FILE) == 0);
+    assert(E.paging);
+    assert(E.numrows == TEST_LINES);
+    assert(E.pageloaded == 0);
+
+    /* Looking rows up loads their page only. */
+    assert(memcmp(editorRowAt(KILO_PAGE_LINES + 5)->chars, "line 4101", 9) == 0);
+    assert(E.pageloaded == 1);
+    assert(editorRowPeek(0) == NULL);
+    check_rows(TEST_LINES);
+
+    /* Edits pin their pages, which survive walking the whole file. */
+    editorRowInsertChar(editorRowAt(10), 0, '>');
+    memmove(lines[10] + 1, lines[10], strlen(lines[10]) + 1);
+    lines[10][0] = '>';
+    editorInsertRow(KILO_PAGE_LINES * 2, "new", 3);
+    memmove(lines[KILO_PAGE_LINES * 2 + 1], lines[KILO_PAGE_LINES * 2],
+            sizeof(lines[0]) * (TEST_LINES - KILO_PAGE_LINES * 2));
+    strcpy(lines[KILO_PAGE_LINES * 2], "new");
+    check_rows(TEST_LINES + 1);
+    assert(E.pageloaded <= 2);
+
+    assert(editorSave() == 0);
+    check_file(TEST_LINES + 1);
+    check_rows(TEST_LINES + 1);
+
+    /* Saving again works from the new content. */
+    editorDelRow(KILO_PAGE_LINES);
+    memmove(lines[KILO_PAGE_LINES], lines[KILO_PAGE_LINES + 1],
+            sizeof(lines[0]) * (TEST_LINES - KILO_PAGE_LINES));
+    assert(editorSave() == 0);
+    check_file(TEST_LINES);
+    check_rows(TEST_LINES);
+
+    E.pagingmin = KILO_PAGING_MIN;
+    E.pagemax = KILO_PAGING_RESIDENT;
+    remove(TEST_FILE);
+}
+
+void test_paging_settings(void) {
+    setenv("KILO_PAGING_RESIDENT", "0", 1);
+    setenv("KILO_PAGING_MIN", "-1", 1);
+    initEditor();
+    assert(E.pagemax == 2);
+    assert(E.pagingmin == KILO_PAGING_MIN);
+
+    setenv("KILO_PAGING_RESIDENT", "16", 1);
+    setenv("KILO_PAGING_MIN", "0", 1);
+    initEditor();
+    assert(E.pagemax == 16);
+    assert(E.pagingmin == 1);
+
+    setenv("KILO_PAGING_MIN", "4k", 1);
+    initEditor();
+    assert(E.pagingmin == KILO_PAGING_MIN);
+
+    unsetenv("KILO_PAGING_RESIDENT");
+    unsetenv("KILO_PAGING_MIN");
+    initEditor();
+}
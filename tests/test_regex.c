@@ -0,0 +1,232 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../kilo.h"
+
+void initEditor(void);
+int editorOpen(char *filename);
+void editorInsertRow(int at, char *s, size_t len);
+
+#define TEST_FILE "/tmp/kilo_test_regex.txt"
+
+/* Find every match of 'pattern' in 'line', as "start-end" pairs. */
+static void matches(const char *pattern, const char *line, char *out) {
+    const char *error = NULL;
+    regex *re = regexCompile(pattern, strlen(pattern), &error);
+    assert(re && error == NULL);
+    reExec x;
+    reExecInit(&x, re);
+    int len = strlen(line), from = 0, start, end;
+    int any = reLineHasMatch(&x, line, len);
+
+    out[0] = '\0';
+    while (reLineNext(&x, line, len, from, &start, &end)) {
+        assert(end > start && start >= from);
+        sprintf(out + strlen(out), "%s%d-%d", *out ? " " : "", start, end);
+        from = end;
+    }
+    /* The DFA agrees, save for the empty matches it also sees. */
+    if (*out)
+        assert(any);
+    reExecFree(&x);
+    regexFree(re);
+}
+
+static void check(const char *pattern, const char *line, const char *want) {
+    char got[256];
+    matches(pattern, line, got);
+    if (strcmp(got, want) != 0) {
+        fprintf(stderr, "regex '%s' on '%s': got '%s', want '%s'\n",
+                pattern, line, got, want);
+        assert(0);
+    }
+}
+
+void test_regex_match(void) {
+    check("abc", "xabcabc", "1-4 4-7");
+    check("a.c", "abc a\tc ac", "0-3 4-7");
+    check("ab*", "a abbb b", "0-1 2-6");
+    check("ab+", "a abbb b", "2-6");
+    check("colou?r", "color colour colouur", "0-5 6-12");
+    check("\\d{4}-\\d{2}-\\d{2}", "on 2024-01-31 or 24-01-31", "3-13");
+    check("x{2,3}", "x xx xxxx xxxxx", "2-4 5-8 10-13 13-15");
+    check("x{2,}", "x xx xxxxx", "2-4 5-10");
+    check("[a-c]+", "abcd cab", "0-3 5-8");
+    check("[^a-c ]+", "abcd cab", "3-4");
+    check("[]x]", "a]x", "1-2 2-3");
+    check("[a-]", "-b-a", "0-1 2-3 3-4");
+    check("\\w+", "foo_1, bar!", "0-5 7-10");
+    check("\\s", "a b\tc", "1-2 3-4");
+    check("\\S+", " ab  c ", "1-3 5-6");
+    check("\\.", "a.b", "1-2");
+    check("^ab", "abab", "0-2");
+    check("ab$", "abab", "2-4");
+    check("^$", "", "");
+    check("^a|b$", "ab", "0-1 1-2");
+    check("cat|category", "category", "0-8");
+    check("(ab|a)(bc|c)", "abc", "0-3");
+    check("a(b|c)*d", "abcbd ad", "0-5 6-8");
+    check("x*", "aaa", "");
+    check("(a*)*b", "aaab", "0-4");
+    check("req-[0-9a-f]+", "id=req-00af1 req-", "3-12");
+    check("(a|b)*a(a|b)(a|b)(a|b)", "bbbbabbbaabbba", "0-13");
+
+    /* Invalid patterns are refused with a reason. */
+    const char *bad[] = {"(ab", "ab)", "[ab", "*a", "a{2", "a{3,2}", "\\q",
+                         "a\\", "[b-a]"};
+    for (size_t k = 0; k < sizeof(bad) / sizeof(bad[0]); k++) {
+        const char *error = NULL;
+        assert(regexCompile(bad[k], strlen(bad[k]), &error) == NULL);
+        assert(error != NULL);
+    }
+    const char *error = NULL;
+    assert(regexCompile("(a{100}){100}", 13, &error) == NULL);
+    assert(strcmp(error, "pattern too large") == 0);
+}
+
+void test_regex_prefix(void) {
+    struct { const char *pattern, *prefix; } cases[] = {
+        {"req-\\d+", "req-"}, {"^GET /", "GET /"}, {"ab*c", "a"},
+        {"ab+c", "ab"},       {"a|b", ""},         {"[x]y.z", "xy"},
+        {"(ab)c", "abc"},     {"x?y", ""},         {"\\.txt", ".txt"}};
+    for (size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+        const char *error;
+        regex *re = regexCompile(cases[k].pattern, strlen(cases[k].pattern),
+                                 &error);
+        assert(re->prefixlen == (int)strlen(cases[k].prefix));
+        assert(memcmp(re->prefix, cases[k].prefix, re->prefixlen) == 0);
+        regexFree(re);
+    }
+}
+
+/* A regex whose DFA has more states than are kept: the cache is dropped
+ * and built again while scanning, with the same answers. */
+void test_regex_dfa_flush(void) {
+    const char *pattern = "a[ab]{9}c";
+    const char *error;
+    regex *re = regexCompile(pattern, strlen(pattern), &error);
+    reExec x;
+    char line[64];
+    reExecInit(&x, re);
+    srand(5);
+    for (int k = 0; k < 3000; k++) {
+        int len = rand() % 40;
+        for (int j = 0; j < len; j++)
+            line[j] = "abc"[rand() % 3];
+        int start, end;
+        assert(reLineHasMatch(&x, line, len) ==
+               reLineNext(&x, line, len, 0, &start, &end));
+    }
+    assert(x.epoch > 0);
+    reExecFree(&x);
+    regexFree(re);
+}
+
+/* Generations of the NFA wrap around without losing threads. */
+void test_regex_gen_wrap(void) {
+    const char *pattern = "a+b";
+    const char *error;
+    regex *re = regexCompile(pattern, strlen(pattern), &error);
+    reExec x;
+    int start, end;
+
+    reExecInit(&x, re);
+    for (int k = 0; k < 6; k++) {
+        /* The first generations after wrapping were used before. */
+        if (k == 1)
+            x.gen = UINT_MAX;
+        assert(reLineNext(&x, "xaab", 4, 0, &start, &end));
+        assert(start == 1 && end == 4);
+    }
+    assert(x.gen > 0 && x.gen < UINT_MAX);
+    reExecFree(&x);
+    regexFree(re);
+}
+
+/* A pattern for which finding every match on a line is quadratic: the
+ * search gives up on the line instead of taking minutes over it. */
+void test_regex_budget(void) {
+    const char *pattern = "a|a.*b";
+    const char *error;
+    regex *re = regexCompile(pattern, strlen(pattern), &error);
+    int len = 200000, from = 0, start, end, count = 0;
+    char *line = malloc(len);
+    reExec x;
+
+    memset(line, 'a', len);
+    reExecInit(&x, re);
+    x.budget = (long)len * RE_LINE_STEPS + RE_LINE_STEPS_MIN;
+    while (reLineNext(&x, line, len, from, &start, &end)) {
+        assert(start == from && end == from + 1);
+        from = end;
+        count++;
+    }
+    assert(count > 0 && count < len && x.budget == 0);
+    reExecFree(&x);
+    regexFree(re);
+
+    /* The same through a search, that goes on with the next lines. */
+    FILE *fp = fopen(TEST_FILE, "w");
+    fwrite(line, 1, len, fp);
+    fputs("\nxa b\n", fp);
+    fclose(fp);
+    free(line);
+    initEditor();
+    assert(editorOpen(TEST_FILE) == 0);
+    E.findregex = 1;
+    editorSearchStart(pattern, strlen(pattern));
+    editorSearchPoll(1);
+    searchJob *j = E.search;
+    assert(j->done && j->count == count + 1);
+    assert(j->matches[count].row == 1 && j->matches[count].col == 1 &&
+           j->matches[count].len == 3);
+    editorSearchStop();
+    E.findregex = 0;
+    initEditor();
+    remove(TEST_FILE);
+}
+
+void test_search_regex(void) {
+    FILE *fp = fopen(TEST_FILE, "w");
+    for (int j = 0; j < 1000; j++)
+        fprintf(fp, "%02d:%02d request req-%x done\r\n", j / 60, j % 60,
+                j * 7919);
+    fclose(fp);
+    initEditor();
+    assert(editorOpen(TEST_FILE) == 0);
+    E.findregex = 1;
+
+    /* Matches come with their length. */
+    editorSearchStart("req-[0-9a-f]*7", 14);
+    editorSearchPoll(1);
+    searchJob *j = E.search;
+    assert(j->done && j->error == NULL && j->count > 0);
+    for (int k = 0; k < j->count; k++) {
+        erow *row = editorRowAt(j->matches[k].row);
+        assert(j->matches[k].col == 14);
+        assert(row->chars[j->matches[k].col + j->matches[k].len - 1] == '7');
+    }
+
+    /* Without a prefix every line is looked at, and $ ignores the \r. */
+    editorSearchStart("^1[0-5]:\\d+ .*done$", 19);
+    editorSearchPoll(1);
+    assert(E.search->count == 360);
+    assert(E.search->matches[0].row == 600);
+    assert(E.search->matches[0].len == (int)editorRowAt(600)->size);
+
+    /* And in rows changed since loading. */
+    editorInsertRow(3, "10:00 x done", 12);
+    editorSearchStop();
+    editorSearchStart("^1[0-5]:\\d+ .*done$", 19);
+    editorSearchPoll(1);
+    assert(E.search->count == 361 && E.search->matches[0].row == 3);
+
+    /* An invalid regex ends the search at once. */
+    editorSearchStart("req-(", 5);
+    assert(E.search->done && E.search->error && !editorSearchFirst());
+    editorSearchStop();
+    E.findregex = 0;
+    initEditor();
+    remove(TEST_FILE);
+}
@@ -0,0 +1,141 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../kilo.h"
+
+void initEditor(void);
+int editorOpen(char *filename);
+void editorInsertRow(int at, char *s, size_t len);
+void editorRowInsertChar(erow *row, int at, int c);
+void editorRowTruncate(erow *row, int at);
+void editorDelRow(int at);
+
+#define TEST_FILE "/tmp/kilo_test_replace.txt"
+
+static void check_row(int at, const char *s) {
+    erow *row = editorRowAt(at);
+    editorRowGapClose();
+    if (row->size != (int)strlen(s))
+        fprintf(stderr, "row %d: '%.*s', want '%s'\n", at, row->size,
+                row->chars, s);
+    assert(row->size == (int)strlen(s));
+    assert(memcmp(row->chars, s, row->size) == 0);
+}
+
+static void write_file(void) {
+    FILE *fp = fopen(TEST_FILE, "w");
+    for (int j = 0; j < 1000; j++)
+        fprintf(fp, j % 10 ? "row %d\n" : "row %d: foo, foofoo\tfoo\n", j);
+    fclose(fp);
+    initEditor();
+    assert(editorOpen(TEST_FILE) == 0);
+}
+
+void test_replace_all(void) {
+    write_file();
+    editorInsertRow(5, "ffoooo", 6);
+    editorRowInsertChar(editorRowAt(10), 0, '>');
+    int dirty = E.dirty, undo = E.undo_count;
+
+    /* Every match is replaced, in original and changed rows. */
+    editorSearchStart("foo", 3);
+    assert(editorReplaceAll("barbaz", 6) == 401);
+    assert(E.search == NULL);
+    check_row(0, "row 0: barbaz, barbazbarbaz\tbarbaz");
+    check_row(5, "fbarbazoo");
+    check_row(10, ">row 9");
+    check_row(11, "row 10: barbaz, barbazbarbaz\tbarbaz");
+    check_row(991, "row 990: barbaz, barbazbarbaz\tbarbaz");
+    assert(E.dirty == dirty + 101);
+    assert(E.undo_count == undo + 1);
+
+    /* Text can be replaced with nothing, and overlapping matches are
+     * replaced only once. */
+    editorSearchStart("zbar", 4);
+    assert(editorReplaceAll("", 0) == 100);
+    check_row(0, "row 0: barbaz, barbabaz\tbarbaz");
+    editorInsertRow(E.numrows, "aaaaa", 5);
+    editorSearchStart("aa", 2);
+    assert(editorReplaceAll("x", 1) == 2);
+    check_row(E.numrows - 1, "xxa");
+    editorSearchStart("none", 4);
+    assert(editorReplaceAll("x", 1) == 0);
+
+    /* A single undo puts back each replace. */
+    executeUndo();
+    check_row(E.numrows - 1, "aaaaa");
+    executeUndo();
+    check_row(0, "row 0: barbaz, barbazbarbaz\tbarbaz");
+    executeUndo();
+    check_row(0, "row 0: foo, foofoo\tfoo");
+    check_row(5, "ffoooo");
+    check_row(10, ">row 9");
+    check_row(991, "row 990: foo, foofoo\tfoo");
+    assert(E.undo_count == undo);
+    initEditor();
+    remove(TEST_FILE);
+}
+
+void test_replace_regex(void) {
+    write_file();
+    int undo = E.undo_count;
+
+    /* Regex matches replace text of any length. */
+    E.findregex = 1;
+    editorSearchStart("fo+,? ?", 7);
+    assert(editorReplaceAll("<>", 2) == 400);
+    check_row(0, "row 0: <><><>\t<>");
+    check_row(1, "row 1");
+    editorSearchStart("^row \\d+5$", 10);
+    assert(editorReplaceAll("five", 4) == 99);
+    check_row(15, "five");
+    check_row(995, "five");
+    E.findregex = 0;
+
+    executeUndo();
+    check_row(15, "row 15");
+    executeUndo();
+    check_row(0, "row 0: foo, foofoo\tfoo");
+    check_row(990, "row 990: foo, foofoo\tfoo");
+    assert(E.undo_count == undo);
+    initEditor();
+    remove(TEST_FILE);
+}
+
+void test_replace_undo_changed(void) {
+    FILE *fp = fopen(TEST_FILE, "w");
+    fputs("foo bar foo baz foo\nfoo\n", fp);
+    fclose(fp);
+    initEditor();
+    assert(editorOpen(TEST_FILE) == 0);
+
+    /* Edits that are not undone, as Enter, may leave the replace record
+     * pointing past the rows: it is refused, leaving them as they are. */
+    editorSearchStart("foo", 3);
+    assert(editorReplaceAll("x", 1) == 4);
+    editorRowTruncate(editorRowAt(0), 2);
+    assert(editorUndoReplace(E.undo_stack->data,
+                             E.undo_stack->data_len) == -1);
+    executeUndo();
+    check_row(0, "x ");
+    check_row(1, "x");
+
+    /* As when a replaced row is gone, or holds something else. */
+    editorSearchStart("x", 1);
+    assert(editorReplaceAll("yy", 2) == 2);
+    editorDelRow(1);
+    assert(editorUndoReplace(E.undo_stack->data,
+                             E.undo_stack->data_len) == -1);
+    editorInsertRow(1, "zz", 2);
+    assert(editorUndoReplace(E.undo_stack->data,
+                             E.undo_stack->data_len) == -1);
+    editorDelRow(1);
+    editorInsertRow(1, "yy", 2);
+    assert(editorUndoReplace(E.undo_stack->data,
+                             E.undo_stack->data_len) == 2);
+    check_row(0, "x ");
+    check_row(1, "x");
+    initEditor();
+    remove(TEST_FILE);
+}
@@ -0,0 +1,49 @@
+#include <assert.h>
+#include <string.h>
+#include "../kilo.h"
+
+void test_row_alloc_classes(void) {
+    static size_t sizes[] = {1, 15, 16, 17, 100, 129, 1000, 4096, 4097, 100000};
+    char *p[10];
+
+    rowAllocReset();
+    for (int j = 0; j < 10; j++) {
+        p[j] = rowAlloc(sizes[j]);
+        memset(p[j], 'a' + j, sizes[j]);
+    }
+    /* Blocks don't overlap. */
+    for (int j = 0; j < 10; j++)
+        for (size_t k = 0; k < sizes[j]; k++)
+            assert(p[j][k] == 'a' + j);
+
+    /* A freed block is reused for the same class. */
+    char *old = p[4];
+    rowFree(p[4], sizes[4]);
+    p[4] = rowAlloc(sizes[4] - 1);
+    assert(p[4] == old);
+
+    /* Growing keeps the content. */
+    p[0] = rowRealloc(p[0], 1, 5000);
+    assert(p[0][0] == 'a');
+    p[9] = rowRealloc(p[9], 100000, 10);
+    assert(memcmp(p[9], "jjjjjjjjjj", 10) == 0);
+
+    /* Big blocks are resized as they are, wherever they are in the list. */
+    char *big[3];
+    for (int j = 0; j < 3; j++) {
+        big[j] = rowAlloc(10000);
+        memset(big[j], 'x' + j, 10000);
+    }
+    assert(rowRealloc(big[1], 10000, 10000) == big[1]);
+    big[1] = rowRealloc(big[1], 10000, 5000);
+    big[2] = rowRealloc(big[2], 10000, 200000);
+    big[0] = rowRealloc(big[0], 10000, 8000);
+    for (int j = 0; j < 3; j++)
+        assert(big[j][0] == 'x' + j && big[j][4999] == 'x' + j);
+    rowFree(big[1], 5000);
+    rowFree(big[2], 200000);
+    rowFree(big[0], 8000);
+
+    rowAllocReset();
+    assert(E.arena.chunk == NULL && E.arena.big == NULL);
+}
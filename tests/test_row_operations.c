@@ -4,8 +4,6 @@
 
 void editorUpdateRow(erow *row);
 
-struct editorConfig E;
-
 void test_editorUpdateRow_tab_expansion(void) {
     erow row;
     row.chars = "\t";
@@ -19,7 +17,7 @@ void test_editorUpdateRow_tab_expansion(void) {
     assert(row.rsize == TAB_SIZE);
     assert(strncmp(row.render, "    ", TAB_SIZE) == 0);
 
-    free(row.render);
-    free(row.hl);
+    rowFree(row.render, row.rsize + 1);
+    rowFree(row.hl, row.rsize);
 }
 
@@ -0,0 +1,64 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "../kilo.h"
+
+void initEditor(void);
+void editorInsertRow(int at, char *s, size_t len);
+void editorDelRow(int at);
+
+/* Check that every row holds the number it was tagged with, in order, and
+ * that row numbers derived from the tree agree with the position. */
+static void check_rows(int *expect, int n) {
+    rowIter it;
+    erow *row;
+    int j = 0;
+
+    assert(E.numrows == n);
+    rowIterInit(&it, 0);
+    while ((row = rowIterNext(&it)) != NULL) {
+        assert(atoi(row->chars) == expect[j]);
+        assert(editorRowAt(j) == row);
+        assert(editorRowIndex(row) == j);
+        j++;
+    }
+    assert(j == n);
+}
+
+void test_row_tree_insert_delete(void) {
+    static int expect[5000];
+    int n = 0;
+    char buf[16];
+
+    initEditor();
+    srand(1);
+    /* Grow the tree past a few levels with inserts at random places. */
+    for (int j = 0; j < 5000; j++) {
+        int at = n ? rand() % (n + 1) : 0;
+        int len = snprintf(buf, sizeof(buf), "%d", j);
+        editorInsertRow(at, buf, len);
+        memmove(expect + at + 1, expect + at, sizeof(int) * (n - at));
+        expect[at] = j;
+        n++;
+    }
+    check_rows(expect, n);
+
+    /* Shrink it back, merging leaves on the way. */
+    while (n > 10) {
+        int at = rand() % n;
+        editorDelRow(at);
+        memmove(expect + at, expect + at + 1, sizeof(int) * (n - at - 1));
+        n--;
+    }
+    check_rows(expect, n);
+
+    while (n > 0) {
+        editorDelRow(0);
+        n--;
+    }
+    assert(E.numrows == 0);
+    assert(editorRowAt(0) == NULL);
+    editorInsertRow(0, "7", 1);
+    expect[0] = 7;
+    check_rows(expect, 1);
+}
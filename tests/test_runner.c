@@ -1,18 +1,121 @@
 #include <stdio.h>
+#include "../kilo.h"
 
 void test_is_separator(void);
 void test_editorSyntaxToColor(void);
+void test_keyword_lookup(void);
+void test_lexer_bulk_runs(void);
+void test_syntax_files(void);
+void test_overlay_spans(void);
+void test_word_highlight_cache(void);
 void test_editorRowHasOpenComment(void);
+void test_open_comment_propagation_is_bounded(void);
+void test_background_highlighting(void);
 void test_editorUpdateRow_tab_expansion(void);
 void test_editorSetStatusMessage(void);
+void test_del_key_middle_of_line(void);
+void test_del_key_end_of_line_merge(void);
+void test_del_key_at_end_of_file(void);
+void test_row_tree_insert_delete(void);
+void test_open_rows_are_views(void);
+void test_save_after_edit(void);
+void test_open_is_lazy(void);
+void test_line_index_scan(void);
+void test_open_crlf(void);
+void test_open_mixed_endings(void);
+void test_line_index_threads(void);
+void test_paging_open_edit_save(void);
+void test_paging_settings(void);
+void test_save_replaces_file(void);
+void test_save_keeps_links(void);
+void test_save_readonly_dir(void);
+void test_file_truncated(void);
+void test_open_too_many_lines(void);
+void test_save_background(void);
+void test_save_large_unchanged_spans(void);
+void test_gap_buffer_edits(void);
+void test_gap_buffer_switch_rows(void);
+void test_gap_buffer_render_from(void);
+void test_row_alloc_classes(void);
+void test_journal_recovers_edits(void);
+void test_journal_open(void);
+void test_journal_truncated(void);
+void test_journal_background_save(void);
+void test_ident_index(void);
+void test_ident_index_remove(void);
+void test_search_find(void);
+void test_search_rows(void);
+void test_search_threads(void);
+void test_search_narrow(void);
+void test_regex_match(void);
+void test_regex_prefix(void);
+void test_regex_dfa_flush(void);
+void test_regex_gen_wrap(void);
+void test_regex_budget(void);
+void test_search_regex(void);
+void test_replace_all(void);
+void test_replace_regex(void);
+void test_replace_undo_changed(void);
 
 int main(void) {
     printf("Running tests...\n");
+    /* Tests use the built-in syntaxes, not those installed on the machine. */
+    E.syntaxloaded = 1;
     test_is_separator();
     test_editorSyntaxToColor();
+    test_keyword_lookup();
+    test_lexer_bulk_runs();
+    test_syntax_files();
+    test_overlay_spans();
+    test_word_highlight_cache();
     test_editorRowHasOpenComment();
+    test_open_comment_propagation_is_bounded();
+    test_background_highlighting();
     test_editorUpdateRow_tab_expansion();
     test_editorSetStatusMessage();
+    test_del_key_middle_of_line();
+    test_del_key_end_of_line_merge();
+    test_del_key_at_end_of_file();
+    test_row_tree_insert_delete();
+    test_open_rows_are_views();
+    test_save_after_edit();
+    test_open_is_lazy();
+    test_line_index_scan();
+    test_open_crlf();
+    test_open_mixed_endings();
+    test_line_index_threads();
+    test_paging_open_edit_save();
+    test_paging_settings();
+    test_save_replaces_file();
+    test_save_keeps_links();
+    test_save_readonly_dir();
+    test_file_truncated();
+    test_open_too_many_lines();
+    test_save_background();
+    test_save_large_unchanged_spans();
+    test_gap_buffer_edits();
+    test_gap_buffer_switch_rows();
+    test_gap_buffer_render_from();
+    test_row_alloc_classes();
+    test_journal_recovers_edits();
+    test_journal_open();
+    test_journal_truncated();
+    test_journal_background_save();
+    test_ident_index();
+    test_ident_index_remove();
+    test_search_find();
+    test_search_rows();
+    test_search_threads();
+    test_search_narrow();
+    test_regex_match();
+    test_regex_prefix();
+    test_regex_dfa_flush();
+    test_regex_gen_wrap();
+    test_regex_budget();
+    test_search_regex();
+    test_replace_all();
+    test_replace_regex();
+    test_replace_undo_changed();
     printf("All tests passed.\n");
     return 0;
 }
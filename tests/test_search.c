@@ -0,0 +1,217 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../kilo.h"
+
+void initEditor(void);
+int editorOpen(char *filename);
+void editorRowInsertChar(erow *row, int at, int c);
+void editorInsertRow(int at, char *s, size_t len);
+void editorDelRow(int at);
+
+#define TEST_FILE "/tmp/kilo_test_search.txt"
+
+static const char *naive_find(const char *p, int len, const char *hay,
+                              const char *end) {
+    for (; end - hay >= len; hay++)
+        if (memcmp(hay, p, len) == 0)
+            return hay;
+    return NULL;
+}
+
+void test_search_find(void) {
+    static char hay[4096];
+    char pat[100];
+    srand(11);
+    for (size_t j = 0; j < sizeof(hay); j++)
+        hay[j] = "aab\nc"[rand() % 5];
+
+    /* Patterns of every length, either taken from the text or random, and
+     * searched from several offsets: short ones take the vector path,
+     * long ones Horspool. */
+    for (int len = 1; len <= 90; len++) {
+        for (int k = 0; k < 20; k++) {
+            if (k % 2) {
+                memcpy(pat, hay + rand() % (sizeof(hay) - len), len);
+            } else {
+                for (int j = 0; j < len; j++)
+                    pat[j] = "abc"[rand() % 3];
+            }
+            searchPattern p;
+            searchCompile(&p, pat, len);
+            int from = rand() % 200, to = sizeof(hay) - rand() % 200;
+            assert(searchFind(&p, hay + from, hay + to) ==
+                   naive_find(pat, len, hay + from, hay + to));
+        }
+    }
+}
+
+/* Check the matches of the search against the ones of its query found row
+ * by row. Returns the number of matches. */
+static int check_matches(void) {
+    editorSearchPoll(1);
+    searchJob *j = E.search;
+    const char *query = j->query;
+    int len = strlen(query), k = 0;
+    assert(j && j->done);
+    for (int r = 0; r < E.numrows; r++) {
+        erow *row = editorRowAt(r);
+        editorRowGapClose();
+        for (int c = 0; c + len <= row->size; c++) {
+            if (memcmp(row->chars + c, query, len))
+                continue;
+            assert(k < j->count);
+            assert(j->matches[k].row == r && j->matches[k].col == c);
+            k++;
+        }
+    }
+    assert(k == j->count);
+    return k;
+}
+
+/* Search the whole file for 'query' and check the matches. */
+static int check_search(const char *query) {
+    editorSearchStop();
+    editorSearchStart(query, strlen(query));
+    return check_matches();
+}
+
+void test_search_rows(void) {
+    FILE *fp = fopen(TEST_FILE, "w");
+    for (int j = 0; j < 500; j++)
+        fprintf(fp, j % 97 == 13 ? "line %d needle\r\n" : "line %d\r\n", j);
+    fclose(fp);
+    initEditor();
+    assert(editorOpen(TEST_FILE) == 0);
+    assert(E.crlf);
+
+    /* Matches are found across the rows of the original file. */
+    assert(check_search("needle") == 6);
+    searchJob *j = E.search;
+    assert(j->matches[0].row == 13 && j->matches[0].col == 8);
+    assert(j->matches[5].row == 498 && j->matches[5].col == 9);
+    assert(editorSearchFirst() && j->cur == 0);
+    assert(editorSearchLocate(j, 13, 9) == 1);
+    assert(editorSearchLocate(j, 110, 0) == 1);
+    assert(editorSearchLocate(j, 499, 0) == 6);
+    assert(check_search("line 49") == 11);
+    assert(check_search("e") == 500 + 6 * 3);
+    assert(check_search("ee") == 6);
+    editorSearchStart("eedl", 4);
+    assert(E.search->prev && check_matches() == 6);
+
+    /* And in the rows changed since, or added. */
+    editorRowInsertChar(editorRowAt(13), 10, 'x');
+    assert(check_search("needle") == 5);
+    assert(E.search->matches[0].row == 110);
+    editorInsertRow(200, "a needle", 8);
+    editorInsertRow(201, "needleneedle", 12);
+    assert(check_search("needle") == 8);
+    editorDelRow(110);
+    assert(check_search("needle") == 7);
+    assert(E.search->matches[0].row == 199);
+    editorRowInsertChar(editorRowAt(300), 0, 'n');
+    assert(check_search("nline") == 1);
+    assert(check_search("line 498") == 1);
+
+    /* No query, no search. */
+    editorSearchStart("", 0);
+    assert(E.search == NULL && !editorSearchFirst());
+    editorSearchStop();
+    initEditor();
+    remove(TEST_FILE);
+}
+
+void test_search_threads(void) {
+    FILE *fp = fopen(TEST_FILE, "w");
+    for (int j = 0; j < 400000; j++)
+        fprintf(fp, j % 1009 == 5 ? "row %d, needle\n" : "row %d\n", j);
+    fclose(fp);
+    int threads = E.indexthreads;
+    initEditor();
+    E.indexthreads = 4;
+    assert(editorOpen(TEST_FILE) == 0);
+
+    /* The file is split between threads, whose matches join in order. */
+    assert(check_search("needle") == 397);
+    assert(E.search->nparts == 4);
+    editorInsertRow(150000, "needle", 6);
+    assert(check_search("needle") == 398);
+    assert(check_search("row 29999") == 11);
+
+    /* The first match is known without waiting for the rest. */
+    editorSearchStart("needle", 6);
+    assert(editorSearchFirst());
+    assert(E.search->current.row == 5 && E.search->current.col == 7);
+    editorSearchPoll(1);
+    assert(E.search->count == 398 && E.search->cur == 0);
+
+    /* A search can be dropped at any time. */
+    editorSearchStart("row", 3);
+    editorSearchStop();
+    assert(E.search == NULL);
+    initEditor();
+    E.indexthreads = threads;
+    remove(TEST_FILE);
+}
+
+void test_search_narrow(void) {
+    FILE *fp = fopen(TEST_FILE, "w");
+    for (int j = 0; j < 2000; j++)
+        fprintf(fp, "%d %s\n", j, j % 3 ? "nest" : j % 7 ? "need" : "needle");
+    fclose(fp);
+    initEditor();
+    assert(editorOpen(TEST_FILE) == 0);
+    editorInsertRow(10, "needle in a copied row", 22);
+    editorInsertRow(20, "nxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx", 41);
+
+    /* A longer query only searches the rows matching the shorter one. */
+    editorSearchStart("ne", 2);
+    assert(check_matches() == 2001);
+    searchJob *ne = E.search;
+    editorSearchStart("nee", 3);
+    assert(check_matches() == 668);
+    assert(E.search->prev == ne && E.search->nspans < ne->nlines);
+    searchJob *nee = E.search;
+    editorSearchStart("needl", 5);
+    assert(check_matches() == 97);
+    assert(E.search->prev == nee && E.search->nspans <= nee->nlines);
+
+    /* Backspace goes back to the earlier searches. */
+    editorSearchStart("need", 4);
+    assert(E.search->prev == nee && check_matches() == 668);
+    editorSearchStart("nee", 3);
+    assert(E.search == nee && E.search->cur == -1);
+    editorSearchStart("ne", 2);
+    assert(E.search == ne && E.search->prev == NULL);
+    editorSearchStart("z", 1);
+    assert(E.search->prev == NULL && check_matches() == 0);
+
+    /* Regexes search the whole file again, and text does after them. */
+    editorSearchStart("ne", 2);
+    E.findregex = 1;
+    editorSearchStart("ne", 2);
+    assert(E.search->prev == NULL && E.search->regex);
+    E.findregex = 0;
+    editorSearchStart("nee", 3);
+    assert(E.search->prev == NULL && check_matches() == 668);
+
+    /* The stack keeps the latest searches only, and what they read. */
+    char query[64] = "n";
+    editorSearchStart(query, 1);
+    for (int len = 2; len < 40; len++) {
+        query[len - 1] = 'x';
+        query[len] = '\0';
+        editorSearchStart(query, len);
+        assert(E.search->prev != NULL);
+        check_matches();
+    }
+    int depth = 0;
+    for (searchJob *j = E.search; j; j = j->prev)
+        depth++;
+    assert(depth == KILO_SEARCH_STACK);
+    editorSearchStop();
+    initEditor();
+    remove(TEST_FILE);
+}
@@ -3,8 +3,6 @@
 #include <time.h>
 #include "../kilo.h"
 
-struct editorConfig E;
-
 void test_editorSetStatusMessage(void) {
     editorSetStatusMessage("test message");
     assert(strcmp(E.statusmsg, "test message") == 0);
@@ -1,6 +1,11 @@
 #include <assert.h>
 #include "../kilo.h"
 
+/* The syntax directory of the source tree, set by the Makefile. */
+#ifndef SYNTAX_DIR
+#define SYNTAX_DIR "syntax"
+#endif
+
 int editorSyntaxToColor(int hl);
 
 void test_editorSyntaxToColor(void) {
@@ -11,3 +16,213 @@ void test_editorSyntaxToColor(void) {
     assert(editorSyntaxToColor(HL_NUMBER) == 31);
     assert(editorSyntaxToColor(HL_MATCH) == 34);
 }
+
+void initEditor(void);
+void editorSelectSyntaxHighlight(char *filename);
+void editorInsertRow(int at, char *s, size_t len);
+
+void test_keyword_lookup(void) {
+    initEditor();
+    editorSelectSyntaxHighlight("test.c");
+    keywordTable *t = E.syntax->kwtable;
+    assert(t != NULL);
+
+    /* Every keyword is found, with its type. */
+    for (int j = 0; E.syntax->keywords[j]; j++) {
+        char *kw = E.syntax->keywords[j];
+        int len = strlen(kw);
+        int type = kw[len - 1] == '|' ? HL_KEYWORD2 : HL_KEYWORD1;
+        if (type == HL_KEYWORD2)
+            len--;
+        if (strcmp(kw, "auto|") != 0) /* Also listed as HL_KEYWORD1. */
+            assert(keywordLookup(t, kw, len) == type);
+    }
+    assert(keywordLookup(t, "auto", 4) == HL_KEYWORD1);
+    assert(keywordLookup(t, "in", 2) == HL_NORMAL);
+    assert(keywordLookup(t, "intx", 4) == HL_NORMAL);
+    assert(keywordLookup(t, "x", 1) == HL_NORMAL);
+
+    /* Only whole words are highlighted. */
+    editorInsertRow(0, "int interval; return(x);", 24);
+    erow *row = editorRowAt(0);
+    assert(row->hl[0] == HL_KEYWORD2 && row->hl[2] == HL_KEYWORD2);
+    assert(row->hl[4] == HL_NORMAL);
+    assert(row->hl[14] == HL_KEYWORD1 && row->hl[19] == HL_KEYWORD1);
+    assert(row->hl[20] == HL_NORMAL);
+    initEditor();
+}
+
+static void check_hl(int at, const char *expect) {
+    erow *row = editorRowAt(at);
+    static const char types[] = {
+        [HL_NORMAL] = '.', [HL_NONPRINT] = '?', [HL_COMMENT] = 'c',
+        [HL_MLCOMMENT] = 'm', [HL_KEYWORD1] = 'k', [HL_KEYWORD2] = 't',
+        [HL_STRING] = 's', [HL_NUMBER] = 'n', [HL_MATCH] = '!'};
+    assert(row->rsize == (int)strlen(expect));
+    for (int j = 0; j < row->rsize; j++)
+        assert(types[row->hl[j]] == expect[j]);
+}
+
+void test_lexer_bulk_runs(void) {
+    initEditor();
+    editorSelectSyntaxHighlight("test.c");
+    /* Runs longer than a vector, with what ends them right after. */
+    char *rows[] = {
+        "averyveryveryverylongidentifier_with_digits_0123456789 if 12;",
+        "x = \"a string long enough to be skipped in bulk \\\" still\" + 1;",
+        "x = \"unterminated string ending with a backslash\\",
+        "y /* a comment long enough to be skipped in bulk, then */ return",
+        "z /* a comment that goes on to the next row, for a while ...",
+        "still the comment, long enough for a few vectors */ int",
+    };
+    for (int j = 0; j < 6; j++)
+        editorInsertRow(j, rows[j], strlen(rows[j]));
+    check_hl(0, ".........................................."
+                ".............kk.nn.");
+    check_hl(1, "....ssssssssssssssssssssssssssssssssssssss"
+                "sssssssssssssss...n.");
+    check_hl(2, "....ssssssssssssssssssssssssssssssssssssss"
+                "sssssss");
+    check_hl(3, "..mmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmm"
+                "mmmmmmmmmmmmmmm.kkkkkk");
+    check_hl(4, "..mmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmm"
+                "mmmmmmmmmmmmmmmmmm");
+    check_hl(5, "mmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmm"
+                "mmmmmmmmm.ttt");
+    initEditor();
+}
+
+extern struct editorSyntax HLDB[];
+
+#define BAD_SYNTAX_FILE "/tmp/kilo_test_bad.syntax"
+
+void test_syntax_files(void) {
+    initEditor();
+    /* Only the syntaxes loaded below, whatever is installed. */
+    editorSyntaxUnload();
+    E.syntaxloaded = 1;
+
+    /* Definitions of the syntax directory are valid. */
+    struct editorSyntax *syn = editorSyntaxLoad(SYNTAX_DIR "/sql.syntax");
+    assert(syn != NULL);
+    assert(strcmp(syn->name, "SQL") == 0);
+    assert(strcmp(syn->filematch[0], ".sql") == 0);
+    assert(strcmp(syn->singleline_comment_start, "--") == 0);
+    assert(strcmp(syn->quotes, "'\"") == 0);
+    editorSyntaxCompile(syn);
+    E.syntax = syn;
+    editorInsertRow(0, "SELECT 'a--b' FROM t -- x", 25);
+    check_hl(0, "kkkkkk.ssssss.kkkk...cccc");
+
+    initEditor();
+    editorSyntaxFree(syn);
+
+    /* Loading a directory adds its syntaxes before the built-in ones. */
+    editorSyntaxLoadDir(SYNTAX_DIR);
+    editorSelectSyntaxHighlight("main.go");
+    assert(strcmp(E.syntax->name, "Go") == 0);
+    editorSelectSyntaxHighlight("main.c");
+    assert(E.syntax == HLDB);
+
+    /* Invalid definitions are reported. */
+    FILE *fp = fopen(BAD_SYNTAX_FILE, "w");
+    fputs("name Bad\nfiles .bad\ncomment ####\n", fp);
+    fclose(fp);
+    assert(editorSyntaxLoad(BAD_SYNTAX_FILE) == NULL);
+    assert(strstr(E.statusmsg, ":3: comment") != NULL);
+    fp = fopen(BAD_SYNTAX_FILE, "w");
+    fputs("name Bad\nkeywords if e-lse\n", fp);
+    fclose(fp);
+    assert(editorSyntaxLoad(BAD_SYNTAX_FILE) == NULL);
+    assert(strstr(E.statusmsg, ":2: keywords") != NULL);
+    assert(editorSyntaxLoad("/nonexistent.syntax") == NULL);
+    remove(BAD_SYNTAX_FILE);
+    initEditor();
+    editorSyntaxUnload();
+    E.syntaxloaded = 1;
+}
+
+void test_overlay_spans(void) {
+    initEditor();
+    editorSelectSyntaxHighlight("test.c");
+    editorInsertRow(0, "int foo = foo + 1; /* foo */", 28);
+    erow *row = editorRowAt(0);
+    unsigned char before[28], hl[28];
+    memcpy(before, row->hl, sizeof(before));
+    int screenrows = E.screenrows;
+    E.screenrows = 10;
+
+    /* Occurrences of the word under the cursor, not in comments. */
+    E.cx = 5;
+    editorHighlightWordUnderCursor();
+    assert(E.overlay[OVERLAY_WORD].count == 3);
+    assert(memcmp(row->hl, before, sizeof(before)) == 0);
+    memcpy(hl, row->hl, sizeof(hl));
+    editorOverlayApply(0, 0, 28, hl);
+    assert(hl[3] == HL_NORMAL && hl[4] == HL_UNDERLINE && hl[6] == HL_UNDERLINE);
+    assert(hl[7] == HL_NORMAL && hl[10] == HL_UNDERLINE);
+    assert(hl[22] == HL_MLCOMMENT);
+    assert(hl[0] == HL_KEYWORD2);
+
+    /* Search matches are drawn on top, clipped to the columns merged. */
+    editorOverlayAdd(OVERLAY_MATCH, 0, 8, 4);
+    memcpy(hl, row->hl + 6, 10);
+    editorOverlayApply(0, 6, 10, hl);
+    assert(hl[0] == HL_UNDERLINE && hl[2] == HL_MATCH && hl[5] == HL_MATCH);
+    assert(hl[6] == HL_UNDERLINE);
+    editorOverlayApply(1, 0, 28, hl);
+
+    /* Clearing leaves the syntax highlight as it was. */
+    editorOverlayClear(OVERLAY_MATCH);
+    E.cx = 1;
+    editorHighlightWordUnderCursor();
+    assert(E.overlay[OVERLAY_WORD].count == 1);
+    E.cx = 3;
+    editorHighlightWordUnderCursor();
+    assert(E.overlay[OVERLAY_WORD].count == 0);
+    memcpy(hl, row->hl, sizeof(hl));
+    editorOverlayApply(0, 0, 28, hl);
+    assert(memcmp(hl, before, sizeof(before)) == 0);
+    E.screenrows = screenrows;
+    initEditor();
+}
+
+void editorRowInsertChar(erow *row, int at, int c);
+
+void test_word_highlight_cache(void) {
+    initEditor();
+    for (int j = 0; j < 20; j++)
+        editorInsertRow(j, "foo bar foo", 11);
+    int screenrows = E.screenrows;
+    E.screenrows = 5;
+
+    /* Occurrences are searched on screen only. */
+    editorHighlightWordUnderCursor();
+    assert(E.overlay[OVERLAY_WORD].count == 10);
+    assert(E.overlay[OVERLAY_WORD].spans[9].row == 4);
+
+    /* Nothing is searched again while the word and the rows are the same:
+     * the emptied overlay stays empty. */
+    editorOverlayClear(OVERLAY_WORD);
+    E.cx = 9;
+    editorHighlightWordUnderCursor();
+    assert(E.overlay[OVERLAY_WORD].count == 0);
+
+    /* Another word, scrolling, or an edit on screen search again. */
+    E.cx = 5;
+    editorHighlightWordUnderCursor();
+    assert(E.overlay[OVERLAY_WORD].count == 5);
+    editorOverlayClear(OVERLAY_WORD);
+    E.rowoff = 2;
+    editorHighlightWordUnderCursor();
+    assert(E.overlay[OVERLAY_WORD].count == 5);
+    assert(E.overlay[OVERLAY_WORD].spans[0].row == 2);
+    editorRowInsertChar(editorRowAt(3), 4, 'x');
+    editorHighlightWordUnderCursor();
+    assert(E.overlay[OVERLAY_WORD].count == 4);
+    E.cx = 3;
+    editorHighlightWordUnderCursor();
+    assert(E.overlay[OVERLAY_WORD].count == 0);
+    E.screenrows = screenrows;
+    initEditor();
+}